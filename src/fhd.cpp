@@ -1,14 +1,17 @@
 #include "fhd.h"
 #include <assert.h>
-#include <emmintrin.h>
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <algorithm>
-#include <unordered_map>
 #include "fhd_block_allocator.h"
+#include "fhd_cascade.h"
 #include "fhd_classifier.h"
 #include "fhd_kinect.h"
 #include "fhd_segmentation.h"
+#include "fhd_simd.h"
+#include "fhd_worker_pool.h"
 #include "pcg/pcg_basic.h"
 
 #ifdef FHD_OMP
@@ -20,15 +23,14 @@ static fhd_edge construct_depth_edge(int idx_a, float weight_a, int idx_b,
   return fhd_edge{idx_a, idx_b, fabsf(weight_a - weight_b)};
 }
 
-void fhd_regions_remove(fhd_region* regions, int len, int idx) {
-  for (int k = idx + 1; k < len; k++) {
-    regions[k - 1] = regions[k];
-  }
+static uint16_t fhd_mask_depth(uint16_t v) {
+  return v >= FHD_DEPTH_MIN && v <= FHD_DEPTH_MAX ? v : 0;
 }
 
-void fhd_construct_point_cloud(fhd_context* fhd) {
+// depth is either the raw frame or normalized_source, samples are masked to
+// the valid range either way
+void fhd_construct_point_cloud(fhd_context* fhd, const uint16_t* depth) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_construct_pcl]);
-  memset(fhd->point_cloud, 0, fhd->cells_len * sizeof(fhd_vec3));
 
   const int cell_sample_count = fhd->sampler_len;
   uint16_t* sample_buffer = fhd->cell_sample_buffer;
@@ -38,37 +40,88 @@ void fhd_construct_point_cloud(fhd_context* fhd) {
   const int source_w = fhd->source_w;
   const int cell_w = fhd->cell_w;
   const int cell_h = fhd->cell_h;
-  const float cell_wf = fhd->cell_wf;
-  const float cell_hf = fhd->cell_hf;
-
-  for (int y = 0; y < cells_y; y++) {
-    for (int x = 0; x < cells_x; x++) {
-      for (int s = 0; s < cell_sample_count; s++) {
-        fhd_index_2d p = fhd->sampler[s];
-        int sx = x * cell_w + p.x;
-        int sy = y * cell_h + p.y;
-        sample_buffer[s] = fhd->normalized_source.data[sy * source_w + sx];
+
+  if (fhd->median_method == fhd_median_network && cell_sample_count == 16) {
+    fhd->kernels->median16(depth, source_w, fhd->sampler, cell_w, cell_h,
+                           cells_x, cells_y, fhd->downscaled_depth);
+  } else {
+    for (int y = 0; y < cells_y; y++) {
+      for (int x = 0; x < cells_x; x++) {
+        for (int s = 0; s < cell_sample_count; s++) {
+          fhd_index_2d p = fhd->sampler[s];
+          int sx = x * cell_w + p.x;
+          int sy = y * cell_h + p.y;
+          sample_buffer[s] = fhd_mask_depth(depth[sy * source_w + sx]);
+        }
+
+        const int pivot = cell_sample_count / 2;
+        std::nth_element(sample_buffer, sample_buffer + pivot,
+                         sample_buffer + cell_sample_count);
+
+        fhd->downscaled_depth[y * cells_x + x] = sample_buffer[pivot];
       }
+    }
+  }
 
-      const int pivot = cell_sample_count / 2;
-      std::nth_element(sample_buffer, sample_buffer + pivot,
-                       sample_buffer + cell_sample_count);
+  const fhd_vec3* rays = fhd->cell_rays;
+  for (int i = 0; i < fhd->cells_len; i++) {
+    const uint16_t v = fhd->downscaled_depth[i];
+    const float depth = float(v) / 1000.f;
+    const fhd_vec3 ray = rays[i];
+    fhd->point_cloud[i] =
+        v > 0 ? fhd_vec3{ray.x * depth, ray.y * depth, ray.z * depth}
+              : fhd_vec3{0.f, 0.f, 0.f};
+  }
+}
 
-      const uint16_t v = sample_buffer[pivot];
+// Edges to the right and below every valid cell, weight(idx_a, idx_b)
+template <typename F>
+static int fhd_build_grid_edges(const fhd_context* fhd, fhd_grid_edge* edges,
+                                F weight) {
+  const fhd_vec3* pc = fhd->point_cloud;
+  int num_edges = 0;
+  for (int y = 0; y < fhd->cells_y; y++) {
+    for (int x = 0; x < fhd->cells_x; x++) {
+      const int idx = y * fhd->cells_x + x;
+      if (pc[idx].z <= 0.f) continue;
 
-      const int idx = y * cells_x + x;
-      fhd->downscaled_depth[idx] = v;
+      if (x < fhd->cells_x - 1 && pc[idx + 1].z > 0.f) {
+        edges[num_edges++] = fhd_grid_edge{2 * idx, weight(idx, idx + 1)};
+      }
 
-      if (v > 0) {
-        fhd->point_cloud[idx] = fhd_depth_to_3d(
-            float(v) / 1000.f, float(x) * cell_wf, float(y) * cell_hf);
+      const int below = idx + fhd->cells_x;
+      if (y < fhd->cells_y - 1 && pc[below].z > 0.f) {
+        edges[num_edges++] = fhd_grid_edge{2 * idx + 1, weight(idx, below)};
       }
     }
   }
+
+  return num_edges;
 }
 
 void fhd_perform_depth_segmentation(fhd_context* fhd) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_segment_depth]);
+  fhd_segmentation_reset(fhd->depth_segmentation);
+  if (fhd->segmentation_graph == fhd_graph_grid) {
+    const fhd_vec3* pc = fhd->point_cloud;
+    fhd->num_depth_edges =
+        fhd_build_grid_edges(fhd, fhd->grid_edges, [pc](int a, int b) {
+          return fabsf(pc[a].z - pc[b].z);
+        });
+    if (fhd->tiled_segmentation) {
+      fhd_segment_grid_tiled(fhd->depth_segmentation, fhd->pool,
+                             fhd->grid_edges, fhd->num_depth_edges,
+                             fhd->cells_x, fhd->depth_segmentation_threshold,
+                             fhd->min_depth_segment_size);
+    } else {
+      fhd_segment_grid(fhd->depth_segmentation, fhd->grid_edges,
+                       fhd->num_depth_edges, fhd->cells_x,
+                       fhd->depth_segmentation_threshold,
+                       fhd->min_depth_segment_size);
+    }
+    return;
+  }
+
   // build graph
   for (int y = 0; y < fhd->cells_y; y++) {
     for (int x = 0; x < fhd->cells_x; x++) {
@@ -96,57 +149,198 @@ void fhd_perform_depth_segmentation(fhd_context* fhd) {
     }
   }
 
-  fhd_segmentation_reset(fhd->depth_segmentation);
-  fhd_segment_graph(fhd->depth_segmentation, fhd->depth_graph,
-                    fhd->num_depth_edges, fhd->depth_segmentation_threshold,
-                    fhd->min_depth_segment_size);
+  if (fhd->tiled_segmentation) {
+    fhd_segment_graph_tiled(fhd->depth_segmentation, fhd->pool,
+                            fhd->depth_graph, fhd->num_depth_edges,
+                            fhd->cells_x, fhd->depth_segmentation_threshold,
+                            fhd->min_depth_segment_size);
+  } else {
+    fhd_segment_graph(fhd->depth_segmentation, fhd->depth_graph,
+                      fhd->num_depth_edges, fhd->depth_segmentation_threshold,
+                      fhd->min_depth_segment_size);
+  }
 }
 
-void fhd_construct_normals(fhd_context* fhd) {
-  FHD_TIMED_BLOCK(&fhd->perf_records[pr_construct_normals]);
-  memset(fhd->normals, 0, fhd->cells_len * sizeof(fhd_vec3));
-  fhd_vec3 pts_buffer[9];
-  int pts_buffer_len = 0;
+// The valid cells around (x, y) in its depth component, center first. Sets
+// *partial when valid neighbours belong to other components.
+static int fhd_normal_neighbours(const fhd_context* fhd, int x, int y,
+                                 fhd_vec3* points, bool* partial) {
+  const int* components = fhd->depth_components;
+  const int idx = y * fhd->cells_x + x;
+  const int component = components[idx];
+  int len = 0;
+  points[len++] = fhd->point_cloud[idx];
+  *partial = false;
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      if (dx == 0 && dy == 0) continue;
+
+      const int neighbour_idx = idx + dy * fhd->cells_x + dx;
+      const fhd_vec3 neighbour = fhd->point_cloud[neighbour_idx];
+      if (neighbour.z <= 0.f) continue;
+
+      if (components[neighbour_idx] == component) {
+        points[len++] = neighbour;
+      } else {
+        *partial = true;
+      }
+    }
+  }
+
+  return len;
+}
+
+static void fhd_construct_normals_least_squares(fhd_context* fhd) {
+  fhd_vec3 points[9];
+  for (int y = 1; y < fhd->cells_y - 1; y++) {
+    for (int x = 1; x < fhd->cells_x - 1; x++) {
+      const int idx = y * fhd->cells_x + x;
+      if (fhd->point_cloud[idx].z <= 0.f) continue;
+
+      bool partial;
+      const int len = fhd_normal_neighbours(fhd, x, y, points, &partial);
+      if (len > 1) fhd->normals[idx] = fhd_pcl_normal(points, len);
+    }
+  }
+}
+
+// Moments of every 3x3 neighbourhood from summed area tables of the valid
+// points. Neighbourhoods reaching into another depth component sum their own
+// points, degenerate ones go through fhd_pcl_normal.
+static void fhd_construct_normals_integral(fhd_context* fhd) {
+  const int w = fhd->cells_x + 1;
+  fhd_plane_moments* sums = fhd->normals_moments;
+  memset(sums, 0, w * sizeof(fhd_plane_moments));
+  for (int y = 0; y < fhd->cells_y; y++) {
+    fhd_plane_moments row;
+    memset(&row, 0, sizeof(row));
+    fhd_plane_moments* above = &sums[y * w];
+    fhd_plane_moments* out = &sums[(y + 1) * w];
+    memset(out, 0, sizeof(fhd_plane_moments));
+    for (int x = 0; x < fhd->cells_x; x++) {
+      const fhd_vec3 p = fhd->point_cloud[y * fhd->cells_x + x];
+      if (p.z > 0.f) fhd_plane_moments_add(&row, p);
+
+      const fhd_plane_moments* a = &above[x + 1];
+      fhd_plane_moments* o = &out[x + 1];
+      o->n = a->n + row.n;
+      o->x = a->x + row.x;
+      o->y = a->y + row.y;
+      o->z = a->z + row.z;
+      o->xx = a->xx + row.xx;
+      o->xy = a->xy + row.xy;
+      o->yy = a->yy + row.yy;
+      o->xz = a->xz + row.xz;
+      o->yz = a->yz + row.yz;
+    }
+  }
+
+  fhd_vec3 points[9];
   for (int y = 1; y < fhd->cells_y - 1; y++) {
     for (int x = 1; x < fhd->cells_x - 1; x++) {
       const int idx = y * fhd->cells_x + x;
-      const fhd_vec3 center = fhd->point_cloud[idx];
-      if (center.z > 0.f) {
-        int component = fhd_segmentation_find(fhd->depth_segmentation, idx);
-        pts_buffer[pts_buffer_len++] = center;
-
-#define ADD_POINT(neighbour_idx)                                       \
-  {                                                                    \
-    int neighbour_component =                                          \
-        fhd_segmentation_find(fhd->depth_segmentation, neighbour_idx); \
-    if (component == neighbour_component) {                            \
-      const fhd_vec3 neighbour = fhd->point_cloud[neighbour_idx];      \
-      if (neighbour.z > 0.f) {                                         \
-        pts_buffer[pts_buffer_len++] = neighbour;                      \
-      }                                                                \
-    }                                                                  \
-  }
-        ADD_POINT((y - 1) * fhd->cells_x + (x - 1));
-        ADD_POINT((y - 1) * fhd->cells_x + x);
-        ADD_POINT((y - 1) * fhd->cells_x + (x + 1));
-        ADD_POINT(y * fhd->cells_x + (x - 1));
-        ADD_POINT(y * fhd->cells_x + (x + 1));
-        ADD_POINT((y + 1) * fhd->cells_x + (x - 1));
-        ADD_POINT((y + 1) * fhd->cells_x + x);
-        ADD_POINT((y + 1) * fhd->cells_x + (x + 1));
-#undef ADD_POINT
-        if (pts_buffer_len > 1) {
-          fhd->normals[idx] = fhd_pcl_normal(pts_buffer, pts_buffer_len);
+      if (fhd->point_cloud[idx].z <= 0.f) continue;
+
+      // Only neighbourhoods reaching into another component need their
+      // points gathered
+      const int component = fhd->depth_components[idx];
+      bool partial = false;
+      for (int dy = -1; dy <= 1 && !partial; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          const int j = idx + dy * fhd->cells_x + dx;
+          if (fhd->point_cloud[j].z > 0.f &&
+              fhd->depth_components[j] != component) {
+            partial = true;
+            break;
+          }
+        }
+      }
+
+      fhd_plane_moments m;
+      int len = 0;
+      if (!partial) {
+        const fhd_plane_moments* a = &sums[(y - 1) * w + (x - 1)];
+        const fhd_plane_moments* b = &sums[(y - 1) * w + (x + 2)];
+        const fhd_plane_moments* c = &sums[(y + 2) * w + (x - 1)];
+        const fhd_plane_moments* d = &sums[(y + 2) * w + (x + 2)];
+        m.n = d->n - b->n - c->n + a->n;
+        m.x = d->x - b->x - c->x + a->x;
+        m.y = d->y - b->y - c->y + a->y;
+        m.z = d->z - b->z - c->z + a->z;
+        m.xx = d->xx - b->xx - c->xx + a->xx;
+        m.xy = d->xy - b->xy - c->xy + a->xy;
+        m.yy = d->yy - b->yy - c->yy + a->yy;
+        m.xz = d->xz - b->xz - c->xz + a->xz;
+        m.yz = d->yz - b->yz - c->yz + a->yz;
+        if (m.n < 2.0) continue;
+      } else {
+        len = fhd_normal_neighbours(fhd, x, y, points, &partial);
+        if (len < 2) continue;
+
+        // Three or fewer points are nearly always collinear, leave them to
+        // the least squares solve the closed form would fall back to
+        if (len < 4) {
+          fhd->normals[idx] = fhd_pcl_normal(points, len);
+          continue;
+        }
+
+        memset(&m, 0, sizeof(m));
+        for (int i = 0; i < len; i++) {
+          fhd_plane_moments_add(&m, points[i]);
         }
       }
 
-      pts_buffer_len = 0;
+      if (!fhd_plane_moments_normal(&m, &fhd->normals[idx])) {
+        if (!partial) {
+          len = fhd_normal_neighbours(fhd, x, y, points, &partial);
+        }
+        fhd->normals[idx] = fhd_pcl_normal(points, len);
+      }
     }
   }
 }
 
+void fhd_construct_normals(fhd_context* fhd) {
+  FHD_TIMED_BLOCK(&fhd->perf_records[pr_construct_normals]);
+  memset(fhd->normals, 0, fhd->cells_len * sizeof(fhd_vec3));
+  fhd_segmentation_find_all(fhd->depth_segmentation, fhd->depth_components);
+  switch (fhd->normals_method) {
+    case fhd_normals_least_squares:
+      fhd_construct_normals_least_squares(fhd);
+      break;
+    case fhd_normals_integral:
+      fhd_construct_normals_integral(fhd);
+      break;
+    case fhd_normals_batched:
+      fhd->kernels->plane_normals(fhd->point_cloud, fhd->depth_components,
+                                  fhd->cells_x, fhd->cells_y, fhd->normals);
+      break;
+  }
+}
+
 void fhd_perform_normals_segmentation(fhd_context* fhd) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_segment_normals]);
+  fhd_segmentation_reset(fhd->normals_segmentation);
+  if (fhd->segmentation_graph == fhd_graph_grid) {
+    const fhd_vec3* normals = fhd->normals;
+    fhd->num_normals_edges =
+        fhd_build_grid_edges(fhd, fhd->grid_edges, [normals](int a, int b) {
+          return acosf(fhd_vec3_dot(normals[a], normals[b]));
+        });
+    if (fhd->tiled_segmentation) {
+      fhd_segment_grid_tiled(fhd->normals_segmentation, fhd->pool,
+                             fhd->grid_edges, fhd->num_normals_edges,
+                             fhd->cells_x, fhd->normal_segmentation_threshold,
+                             fhd->min_normal_segment_size);
+    } else {
+      fhd_segment_grid(fhd->normals_segmentation, fhd->grid_edges,
+                       fhd->num_normals_edges, fhd->cells_x,
+                       fhd->normal_segmentation_threshold,
+                       fhd->min_normal_segment_size);
+    }
+    return;
+  }
+
   // construct normals graph
   for (int y = 0; y < fhd->cells_y; y++) {
     for (int x = 0; x < fhd->cells_x; x++) {
@@ -174,33 +368,139 @@ void fhd_perform_normals_segmentation(fhd_context* fhd) {
     }
   }
 
-  fhd_segmentation_reset(fhd->normals_segmentation);
-  fhd_segment_graph(fhd->normals_segmentation, fhd->normals_graph,
-                    fhd->num_normals_edges, fhd->normal_segmentation_threshold,
-                    fhd->min_normal_segment_size);
+  if (fhd->tiled_segmentation) {
+    fhd_segment_graph_tiled(fhd->normals_segmentation, fhd->pool,
+                            fhd->normals_graph, fhd->num_normals_edges,
+                            fhd->cells_x, fhd->normal_segmentation_threshold,
+                            fhd->min_normal_segment_size);
+  } else {
+    fhd_segment_graph(fhd->normals_segmentation, fhd->normals_graph,
+                      fhd->num_normals_edges,
+                      fhd->normal_segmentation_threshold,
+                      fhd->min_normal_segment_size);
+  }
+}
+
+static void fhd_region_add_point(fhd_region* r, fhd_block_allocator* alloc,
+                                 fhd_region_point point) {
+  fhd_point_chunk* chunk = r->points_tail;
+  if (!chunk || chunk->len == FHD_POINT_CHUNK_CAPACITY) {
+    chunk = (fhd_point_chunk*)fhd_block_allocator_acquire(alloc);
+    if (!chunk) return;
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    if (r->points_tail) {
+      r->points_tail->next = chunk;
+    } else {
+      r->points = chunk;
+    }
+    r->points_tail = chunk;
+  }
+
+  chunk->points[chunk->len++] = point;
+  r->points_len++;
+}
+
+// Moves the points of src to the end of dst
+static void fhd_region_splice_points(fhd_region* dst, fhd_region* src) {
+  if (!src->points) return;
+
+  if (dst->points_tail) {
+    dst->points_tail->next = src->points;
+  } else {
+    dst->points = src->points;
+  }
+  dst->points_tail = src->points_tail;
+  dst->points_len += src->points_len;
+
+  src->points = NULL;
+  src->points_tail = NULL;
+  src->points_len = 0;
 }
 
+static void fhd_region_release_points(fhd_region* r,
+                                      fhd_block_allocator* alloc) {
+  fhd_point_chunk* chunk = r->points;
+  while (chunk) {
+    fhd_point_chunk* next = chunk->next;
+    fhd_block_allocator_release(alloc, chunk);
+    chunk = next;
+  }
+
+  r->points = NULL;
+  r->points_tail = NULL;
+  r->points_len = 0;
+}
+
+// Regions are the cells sharing both a depth and a normals component. Cells
+// are first labelled with a dense region index, found through the chain of
+// regions of their normals component, and the statistics are accumulated in
+// place. Filtered regions then collect their points in a second pass
+// over the labels. All buffers are reused between frames.
 void fhd_construct_regions(fhd_context* fhd) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_construct_regions]);
-  std::unordered_map<int64_t, fhd_region> regions;
+  memset(fhd->region_heads, -1, fhd->cells_len * sizeof(int));
+  fhd_segmentation_find_all(fhd->normals_segmentation,
+                            fhd->normals_components);
+
+  fhd_region* regions = fhd->regions;
+  int* cell_regions = fhd->cell_regions;
+  int* region_next = fhd->region_next;
+  int* region_depth_components = fhd->region_depth_components;
+  int regions_len = 0;
+
+  int last_depth_component = -1;
+  int last_normals_component = -1;
+  int region = -1;
   for (int y = 0; y < fhd->cells_y; y++) {
     for (int x = 0; x < fhd->cells_x; x++) {
       const int idx = y * fhd->cells_x + x;
       const fhd_vec3* p = &fhd->point_cloud[idx];
       if (p->z < 0.5f) {
+        cell_regions[idx] = -1;
         continue;
       }
-      const int64_t depth_component =
-          fhd_segmentation_find(fhd->depth_segmentation, idx);
-      const int64_t normals_component =
-          fhd_segmentation_find(fhd->normals_segmentation, idx);
-      const int64_t key = (depth_component << 32) | normals_component;
+      const int depth_component = fhd->depth_components[idx];
+      const int normals_component = fhd->normals_components[idx];
+
+      bool is_new = false;
+      if (depth_component != last_depth_component ||
+          normals_component != last_normals_component) {
+        region = fhd->region_heads[normals_component];
+        while (region != -1 &&
+               region_depth_components[region] != depth_component) {
+          region = region_next[region];
+        }
 
-      auto it = regions.find(key);
+        if (region == -1) {
+          region = regions_len++;
+          region_depth_components[region] = depth_component;
+          region_next[region] = fhd->region_heads[normals_component];
+          fhd->region_heads[normals_component] = region;
+          is_new = true;
+        }
 
-      fhd_region_point rp = {x, y, *p};
-      if (it != regions.end()) {
-        fhd_region* r = &it->second;
+        last_depth_component = depth_component;
+        last_normals_component = normals_component;
+      }
+
+      cell_regions[idx] = region;
+      fhd_region* r = &regions[region];
+      if (is_new) {
+        r->bounds.top_left.x = float(x);
+        r->bounds.top_left.y = float(y);
+        r->bounds.bot_right.x = float(x);
+        r->bounds.bot_right.y = float(y);
+        r->sx = p->x;
+        r->sy = p->y;
+        r->ex = p->x;
+        r->ey = p->y;
+        r->center.x = p->x;
+        r->center.y = p->y;
+        r->center.z = p->z;
+        r->n = 1.f;
+      } else {
         if (p->x < r->sx) r->sx = p->x;
         if (p->x > r->ex) r->ex = p->x;
         if (p->y > r->sy) r->sy = p->y;
@@ -211,196 +511,443 @@ void fhd_construct_regions(fhd_context* fhd) {
         r->center.y = (r->sy + r->ey) * 0.5f;
         r->center.z = (p->z + r->n * r->center.z) / (r->n + 1.f);
         r->n += 1.f;
-        r->points[r->points_len++] = rp;
-      } else {
-        fhd_region r;
-        r.bounds.top_left.x = float(x);
-        r.bounds.top_left.y = float(y);
-        r.bounds.bot_right.x = float(x);
-        r.bounds.bot_right.y = float(y);
-        r.sx = p->x;
-        r.sy = p->y;
-        r.ex = p->x;
-        r.ey = p->y;
-        r.center.x = p->x;
-        r.center.y = p->y;
-        r.center.z = p->z;
-        r.n = 1.f;
-        r.points_len = 1;
-        r.points = (fhd_region_point*)fhd_block_allocator_acquire(
-            fhd->point_allocator);
-        r.points[0] = rp;
-        regions.insert(std::make_pair(key, r));
       }
     }
   }
 
-  int largest_region = 0;
-  for (auto& kv : regions) {
-    fhd_region* r = &kv.second;
+  fhd->regions_len = regions_len;
+
+  // region_next is done with, it now maps regions to filtered_regions
+  int* filtered_index = region_next;
+  for (int i = 0; i < regions_len; i++) {
+    fhd_region* r = &regions[i];
     const float width = r->ex - r->sx;
     const float height = r->sy - r->ey;
-
-    if (r->points_len > largest_region) {
-      largest_region = r->points_len;
+    filtered_index[i] = -1;
+    r->points_len = 0;
+    r->points = NULL;
+    r->points_tail = NULL;
+
+    if (fhd->filtered_regions_len == fhd->filtered_regions_capacity ||
+        r->n <= fhd->min_region_size || width / height > 2.f) {
+      continue;
     }
 
-    if (r->n > fhd->min_region_size && width / height <= 2.f) {
-      fhd->filtered_regions[fhd->filtered_regions_len++] = *r;
-    } else {
-      fhd_block_allocator_release(fhd->point_allocator, r->points);
-    }
+    filtered_index[i] = fhd->filtered_regions_len;
+    fhd->filtered_regions[fhd->filtered_regions_len++] = *r;
+  }
 
-    if (fhd->filtered_regions_len == fhd->filtered_regions_capacity) {
-      break;
+  for (int y = 0; y < fhd->cells_y; y++) {
+    for (int x = 0; x < fhd->cells_x; x++) {
+      const int idx = y * fhd->cells_x + x;
+      const int i = cell_regions[idx];
+      if (i == -1 || filtered_index[i] == -1) continue;
+
+      fhd_region_add_point(&fhd->filtered_regions[filtered_index[i]],
+                           fhd->point_allocator,
+                           fhd_region_point{x, y, fhd->point_cloud[idx]});
     }
   }
 }
 
-float region_inlier_fraction(pcg32_random_t* rng, const fhd_region* r,
-                             float max_plane_distance) {
-  float inlier_fraction = 0.f;
+// RANSAC over 20 random planes. Stops as soon as one plane has
+// min_inlier_fraction of the points, and moves on to the next plane once the
+// remaining points can't get the current one there.
+static bool fhd_region_is_planar(fhd_context* fhd, const fhd_region* r) {
   const uint32_t n_points = uint32_t(r->points_len);
   const float total = float(n_points);
+  if (n_points < 3) return false;
+
+  float* xs = fhd->ransac_points;
+  float* ys = xs + fhd->cells_len;
+  float* zs = ys + fhd->cells_len;
+  int len = 0;
+  for (const fhd_point_chunk* chunk = r->points; chunk; chunk = chunk->next) {
+    for (int i = 0; i < chunk->len; i++) {
+      const fhd_vec3 p = chunk->points[i].p_r;
+      xs[len] = p.x;
+      ys[len] = p.y;
+      zs[len] = p.z;
+      len++;
+    }
+  }
 
+  const float min_fraction = fhd->min_inlier_fraction;
   const int steps = 20;
   for (int k = 0; k < steps; k++) {
     // pick 3 random points
     uint32_t a_i, b_i, c_i;
     do {
-      a_i = pcg32_boundedrand_r(rng, n_points);
-      b_i = pcg32_boundedrand_r(rng, n_points);
-      c_i = pcg32_boundedrand_r(rng, n_points);
+      a_i = pcg32_boundedrand_r(fhd->rng, n_points);
+      b_i = pcg32_boundedrand_r(fhd->rng, n_points);
+      c_i = pcg32_boundedrand_r(fhd->rng, n_points);
     } while (a_i == b_i || a_i == c_i || b_i == c_i);
-    const fhd_region_point* a = &r->points[a_i];
-    const fhd_region_point* b = &r->points[b_i];
-    const fhd_region_point* c = &r->points[c_i];
+    const fhd_vec3 a = {xs[a_i], ys[a_i], zs[a_i]};
+    const fhd_vec3 b = {xs[b_i], ys[b_i], zs[b_i]};
+    const fhd_vec3 c = {xs[c_i], ys[c_i], zs[c_i]};
+    const fhd_plane pi_k = fhd_make_plane(a, b, c);
+
+    int num_fitting = 0;
+    for (int i = 0; i < len; i += FHD_RANSAC_BLOCK) {
+      const int block = std::min(FHD_RANSAC_BLOCK, len - i);
+      num_fitting += fhd->kernels->plane_inliers(
+          &xs[i], &ys[i], &zs[i], block, &pi_k, fhd->ransac_max_plane_distance);
+      if (float(num_fitting) / total >= min_fraction) return true;
+      if (float(num_fitting + len - i - block) / total < min_fraction) break;
+    }
+  }
 
-    const fhd_plane pi_k = fhd_make_plane(a->p_r, b->p_r, c->p_r);
+  return false;
+}
 
-    float num_fitting = 0.f;
+// Region centers bucketed on the XZ plane. Cells are a bit over twice
+// max_merge_distance wide, so every region within merge distance of a center
+// is in the 2x2 cells around the cell corner nearest to it. The grid wraps
+// around so any scene fits.
+const int FHD_MERGE_GRID_SIZE = 16;
+
+struct fhd_merge_key {
+  float n;
+  int region;
+};
+
+struct fhd_merge_scratch {
+  int grid[FHD_MERGE_GRID_SIZE * FHD_MERGE_GRID_SIZE];
+  float inv_cell_size;
+
+  // per filtered region
+  fhd_merge_key* keys;
+  int* order;
+  int* rank;
+  int* parent;
+  int* bucket;
+  int* next;
+  int* prev;
+  fhd_region* regions;
+};
+
+static void fhd_merge_scratch_init(fhd_merge_scratch* m, int capacity) {
+  m->keys = (fhd_merge_key*)calloc(capacity, sizeof(fhd_merge_key));
+  m->order = (int*)calloc(capacity, sizeof(int));
+  m->rank = (int*)calloc(capacity, sizeof(int));
+  m->parent = (int*)calloc(capacity, sizeof(int));
+  m->bucket = (int*)calloc(capacity, sizeof(int));
+  m->next = (int*)calloc(capacity, sizeof(int));
+  m->prev = (int*)calloc(capacity, sizeof(int));
+  m->regions = (fhd_region*)calloc(capacity, sizeof(fhd_region));
+}
 
-    for (int i = 0; i < r->points_len; i++) {
-      const fhd_region_point* cur_point = &r->points[i];
-      const fhd_vec3 P = cur_point->p_r;
-      const float distance = fabsf(fhd_plane_point_dist(pi_k, P));
-      if (distance < max_plane_distance) {
-        num_fitting += 1.f;
-      }
-    }
+static void fhd_merge_scratch_destroy(fhd_merge_scratch* m) {
+  free(m->keys);
+  free(m->order);
+  free(m->rank);
+  free(m->parent);
+  free(m->bucket);
+  free(m->next);
+  free(m->prev);
+  free(m->regions);
+  free(m);
+}
+
+// Grid coordinate in half cells
+static int fhd_merge_grid_coord(const fhd_merge_scratch* m, float v) {
+  const float c = fhd_clamp(v * m->inv_cell_size * 2.f, -1e6f, 1e6f);
+  const int i = int(c);
+  return float(i) > c ? i - 1 : i;
+}
 
-    float iter_fitting = num_fitting / total;
-    if (iter_fitting > inlier_fraction) inlier_fraction = iter_fitting;
+static int fhd_merge_bucket(int gx, int gz) {
+  gx >>= 1;
+  gz >>= 1;
+  return (gz & (FHD_MERGE_GRID_SIZE - 1)) * FHD_MERGE_GRID_SIZE +
+         (gx & (FHD_MERGE_GRID_SIZE - 1));
+}
+
+// Buckets are kept in rank order so lookups can stop at the first match
+static void fhd_merge_grid_insert(fhd_merge_scratch* m, int i, fhd_vec3 c) {
+  const int b = fhd_merge_bucket(fhd_merge_grid_coord(m, c.x),
+                                 fhd_merge_grid_coord(m, c.z));
+  int prev = -1;
+  int next = m->grid[b];
+  while (next != -1 && m->rank[next] < m->rank[i]) {
+    prev = next;
+    next = m->next[next];
   }
 
-  return inlier_fraction;
+  m->bucket[i] = b;
+  m->prev[i] = prev;
+  m->next[i] = next;
+  if (prev != -1) {
+    m->next[prev] = i;
+  } else {
+    m->grid[b] = i;
+  }
+  if (next != -1) m->prev[next] = i;
 }
 
-void fhd_merge_regions(fhd_context* fhd) {
-  FHD_TIMED_BLOCK(&fhd->perf_records[pr_merge_regions]);
+static void fhd_merge_grid_remove(fhd_merge_scratch* m, int i) {
+  if (m->prev[i] != -1) {
+    m->next[m->prev[i]] = m->next[i];
+  } else {
+    m->grid[m->bucket[i]] = m->next[i];
+  }
+
+  if (m->next[i] != -1) m->prev[m->next[i]] = m->prev[i];
+}
+
+static int fhd_merge_find(const fhd_merge_scratch* m, int i) {
+  while (m->parent[i] != i) i = m->parent[i];
+  return i;
+}
+
+// Bounds, center and size of r added to dst, points are moved separately
+static void fhd_merge_into(fhd_region* dst_r, const fhd_region* r) {
+  const float total_points = r->n + dst_r->n;
+  const float w_i = r->n / total_points;
+  const float w_j = dst_r->n / total_points;
+  assert(w_i + w_j == 1.f);
+  fhd_aabb_expand(&dst_r->bounds, r->bounds.top_left);
+  fhd_aabb_expand(&dst_r->bounds, r->bounds.bot_right);
+
+  dst_r->sx = std::min(r->sx, dst_r->sx);
+  dst_r->sy = std::max(r->sy, dst_r->sy);
+  dst_r->ex = std::max(r->ex, dst_r->ex);
+  dst_r->ey = std::min(r->ey, dst_r->ey);
+
+  dst_r->center.x = w_i * r->center.x + w_j * dst_r->center.x;
+  dst_r->center.y = w_i * r->center.y + w_j * dst_r->center.y;
+  dst_r->center.z = w_i * r->center.z + w_j * dst_r->center.z;
+  dst_r->n = total_points;
+}
+
+// Reference for fhd_merge_regions_grid. Each pass sorts the regions by size
+// and merges every small region into the first larger region within merge
+// distance, scanning all of them.
+static void fhd_merge_regions_pairwise(fhd_context* fhd) {
+  const float min_height = fhd->min_region_height;
+  const float max_height = fhd->max_region_height;
+  const float min_width = fhd->min_region_width;
+  const float max_width = fhd->max_region_width;
+  fhd_region* regions = fhd->filtered_regions;
+  int len = fhd->filtered_regions_len;
+
+  int merges;
+  do {
+    std::sort(regions, regions + len, [](const fhd_region& a,
+                                         const fhd_region& b) {
+      return a.n > b.n;
+    });
+
+    merges = 0;
+    for (int i = 0; i < len; i++) {
+      fhd_region* r = &regions[i];
+      const float width = r->ex - r->sx;
+      const float height = r->sy - r->ey;
+      const bool properly_sized = width >= min_width && width <= max_width &&
+                                  height >= min_height && height <= max_height;
+      if (properly_sized) continue;
+
+      const bool is_small = width < min_width || height < min_height;
+      bool remove = !is_small ||
+                    (fhd->planar_regions && !fhd_region_is_planar(fhd, r));
+      if (remove) {
+        fhd_region_release_points(r, fhd->point_allocator);
+      } else {
+        const fhd_vec2 mu_xz_i = {r->center.x, r->center.z};
+        for (int j = 0; j < i; j++) {
+          fhd_region* dst_r = &regions[j];
+          const fhd_vec2 mu_xz_j = {dst_r->center.x, dst_r->center.z};
+          const float sigma_xz =
+              fhd_vec2_length(fhd_vec2_sub(mu_xz_i, mu_xz_j));
+          const float dist_y = fabs(r->center.y - dst_r->center.y);
+          if (sigma_xz < fhd->max_merge_distance &&
+              dist_y < fhd->max_vertical_merge_distance) {
+            fhd_merge_into(dst_r, r);
+            fhd_region_splice_points(dst_r, r);
+            remove = true;
+            merges++;
+            break;
+          }
+        }
+      }
+
+      if (remove) {
+        memmove(r, r + 1, (len - i - 1) * sizeof(fhd_region));
+        i--;
+        len--;
+      }
+    }
+  } while (merges > 0);
+
+  fhd->filtered_regions_len = len;
+}
+
+// Each pass visits the regions by size and merges a small region into the
+// first larger region within merge distance, like the pairwise search did: the
+// grid only holds regions visited earlier in the pass and the lowest ranked
+// match wins. Regions are sorted through an index array and merged regions
+// point at their destination, points are spliced and the array compacted at
+// the end of the pass.
+static void fhd_merge_regions_grid(fhd_context* fhd) {
   const float min_height = fhd->min_region_height;
   const float max_height = fhd->max_region_height;
   const float min_width = fhd->min_region_width;
   const float max_width = fhd->max_region_width;
 
+  fhd_merge_scratch* m = fhd->merge_scratch;
+  fhd_region* regions = fhd->filtered_regions;
+  const float max_distance = std::max(fhd->max_merge_distance * 1.01f, 1e-3f);
+  m->inv_cell_size = 1.f / (2.f * max_distance);
+
+  int len = fhd->filtered_regions_len;
+  for (int i = 0; i < len; i++) {
+    m->order[i] = i;
+  }
+
   bool needs_merge = true;
   do {
-    std::sort(
-        fhd->filtered_regions,
-        fhd->filtered_regions + fhd->filtered_regions_len,
-        [](const fhd_region& a, const fhd_region& b) { return a.n > b.n; });
+    // Same comparisons as sorting the regions themselves, so ties end up in the
+    // same order
+    for (int i = 0; i < len; i++) {
+      m->keys[i] = fhd_merge_key{regions[m->order[i]].n, m->order[i]};
+    }
+    std::sort(m->keys, m->keys + len,
+              [](const fhd_merge_key& a, const fhd_merge_key& b) {
+                return a.n > b.n;
+              });
+    for (int i = 0; i < len; i++) {
+      m->order[i] = m->keys[i].region;
+    }
+    memset(m->grid, -1, sizeof(m->grid));
 
     int merges = 0;
-    int len = fhd->filtered_regions_len;
     for (int i = 0; i < len; i++) {
-      const fhd_region* r = &fhd->filtered_regions[i];
+      const int ri = m->order[i];
+      const fhd_region* r = &regions[ri];
+      m->rank[ri] = i;
+      m->parent[ri] = ri;
+
       const float width = r->ex - r->sx;
       const float height = r->sy - r->ey;
       const bool properly_sized = width >= min_width && width <= max_width &&
                                   height >= min_height && height <= max_height;
 
-      if (!properly_sized) {
-        const bool is_small = width < min_width || height < min_height;
-#if FHD_PLANAR_REGIONS
-        const float fraction =
-            region_inlier_fraction(fhd->rng, r, fhd->ransac_max_plane_distance);
-        if (is_small && fraction >= fhd->min_inlier_fraction) {
-#else
-        if (is_small) {
-#endif
-          // if (is_small && fraction >= fhd->min_inlier_fraction) {
-          // find a region to merge into
-          for (int j = 0; j < i; j++) {
-            fhd_region* dst_r = &fhd->filtered_regions[j];
-            const fhd_vec2 mu_xz_i = {r->center.x, r->center.z};
-            const fhd_vec2 mu_xz_j = {dst_r->center.x, dst_r->center.z};
+      if (properly_sized) {
+        fhd_merge_grid_insert(m, ri, r->center);
+        continue;
+      }
+
+      const bool is_small = width < min_width || height < min_height;
+      if (!is_small ||
+          (fhd->planar_regions && !fhd_region_is_planar(fhd, r))) {
+        m->parent[ri] = -1;
+        continue;
+      }
+
+      // find a region to merge into
+      const fhd_vec2 mu_xz_i = {r->center.x, r->center.z};
+      const int gx = fhd_merge_grid_coord(m, r->center.x);
+      const int gz = fhd_merge_grid_coord(m, r->center.z);
+      int dst = -1;
+      const int x0 = (gx & 1) ? gx : gx - 2;
+      const int z0 = (gz & 1) ? gz : gz - 2;
+      for (int z = z0; z <= z0 + 2; z += 2) {
+        for (int x = x0; x <= x0 + 2; x += 2) {
+          for (int j = m->grid[fhd_merge_bucket(x, z)]; j != -1;
+               j = m->next[j]) {
+            if (dst != -1 && m->rank[j] > m->rank[dst]) break;
+
+            const fhd_region* dst_r = &regions[j];
+            if (fabsf(dst_r->center.x - r->center.x) >= max_distance ||
+                fabsf(dst_r->center.z - r->center.z) >= max_distance) {
+              continue;
+            }
 
+            const fhd_vec2 mu_xz_j = {dst_r->center.x, dst_r->center.z};
             const float sigma_xz =
                 fhd_vec2_length(fhd_vec2_sub(mu_xz_i, mu_xz_j));
             const float dist_y = fabs(r->center.y - dst_r->center.y);
 
             if (sigma_xz < fhd->max_merge_distance &&
                 dist_y < fhd->max_vertical_merge_distance) {
-              const float total_points = r->n + dst_r->n;
-              const float w_i = r->n / total_points;
-              const float w_j = dst_r->n / total_points;
-              assert(w_i + w_j == 1.f);
-              fhd_aabb_expand(&dst_r->bounds, r->bounds.top_left);
-              fhd_aabb_expand(&dst_r->bounds, r->bounds.bot_right);
-
-              dst_r->sx = std::min(r->sx, dst_r->sx);
-              dst_r->sy = std::max(r->sy, dst_r->sy);
-              dst_r->ex = std::max(r->ex, dst_r->ex);
-              dst_r->ey = std::min(r->ey, dst_r->ey);
-
-              dst_r->center.x = w_i * r->center.x + w_j * dst_r->center.x;
-              dst_r->center.y = w_i * r->center.y + w_j * dst_r->center.y;
-              dst_r->center.z = w_i * r->center.z + w_j * dst_r->center.z;
-              dst_r->n = total_points;
-
-              for (int p = 0; p < r->points_len; p++) {
-                dst_r->points[dst_r->points_len + p] = r->points[p];
-              }
-              dst_r->points_len += r->points_len;
-
-              fhd_block_allocator_release(fhd->point_allocator, r->points);
-              fhd_regions_remove(fhd->filtered_regions, len, i);
-              i--;
-              len--;
-              merges++;
-
+              dst = j;
               break;
             }
           }
-        } else {
-          fhd_block_allocator_release(fhd->point_allocator, r->points);
-          fhd_regions_remove(fhd->filtered_regions, len, i);
-          i--;
-          len--;
         }
       }
+
+      if (dst == -1) {
+        fhd_merge_grid_insert(m, ri, r->center);
+        continue;
+      }
+
+      fhd_region* dst_r = &regions[dst];
+      fhd_merge_into(dst_r, r);
+      fhd_merge_grid_remove(m, dst);
+      fhd_merge_grid_insert(m, dst, dst_r->center);
+      m->parent[ri] = dst;
+      merges++;
+    }
+
+    // Merges happened in rank order, splicing in rank order keeps the points
+    // in the same order as merging one at a time.
+    int alive = 0;
+    for (int i = 0; i < len; i++) {
+      const int ri = m->order[i];
+      fhd_region* r = &regions[ri];
+      if (m->parent[ri] == ri) {
+        m->order[alive++] = ri;
+        continue;
+      }
+
+      if (m->parent[ri] != -1) {
+        fhd_region_splice_points(&regions[fhd_merge_find(m, ri)], r);
+      } else {
+        fhd_region_release_points(r, fhd->point_allocator);
+      }
     }
-    fhd->filtered_regions_len = len;
+
+    len = alive;
     needs_merge = merges > 0;
   } while (needs_merge);
+
+  for (int i = 0; i < len; i++) {
+    m->regions[i] = regions[m->order[i]];
+  }
+  memcpy(regions, m->regions, len * sizeof(fhd_region));
+  fhd->filtered_regions_len = len;
+}
+
+void fhd_merge_regions(fhd_context* fhd) {
+  FHD_TIMED_BLOCK(&fhd->perf_records[pr_merge_regions]);
+  if (fhd->merge_method == fhd_merge_grid) {
+    fhd_merge_regions_grid(fhd);
+  } else {
+    fhd_merge_regions_pairwise(fhd);
+  }
 }
 
-void fhd_copy_regions(fhd_context* fhd) {
+void fhd_copy_regions(fhd_context* fhd, const uint16_t* depth,
+                      fhd_region* regions, int regions_len) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_copy_regions]);
   memset(fhd->output_cell_indices, -1, fhd->cells_len * sizeof(int));
   fhd_image_clear(&fhd->output_depth, 0);
 
   const int cells_len = fhd->cells_len;
-  for (int i = 0; i < fhd->filtered_regions_len; i++) {
-    fhd_region* r = &fhd->filtered_regions[i];
-
-    for (int j = 0; j < r->points_len; j++) {
-      fhd_region_point p = r->points[j];
-      for (int y = -1; y <= 1; y++) {
-        for (int x = -1; x <= 1; x++) {
-          int idx = (p.y + y) * fhd->cells_x + (p.x + x);
-          if (idx > -1 && idx < cells_len) {
-            fhd->output_cell_indices[idx] = 1;
+  for (int i = 0; i < regions_len; i++) {
+    fhd_region* r = &regions[i];
+
+    for (const fhd_point_chunk* chunk = r->points; chunk;
+         chunk = chunk->next) {
+      for (int j = 0; j < chunk->len; j++) {
+        fhd_region_point p = chunk->points[j];
+        for (int y = -1; y <= 1; y++) {
+          for (int x = -1; x <= 1; x++) {
+            int idx = (p.y + y) * fhd->cells_x + (p.x + x);
+            if (idx > -1 && idx < cells_len) {
+              fhd->output_cell_indices[idx] = 1;
+            }
           }
         }
       }
@@ -427,17 +974,17 @@ void fhd_copy_regions(fhd_context* fhd) {
         for (int x = 0; x < fhd->cell_w; x++) {
           const int depth_idx = (start_y + y) * fhd->source_w + (x + start_x);
           fhd->output_depth.data[depth_idx] =
-              fhd->normalized_source.data[depth_idx];
+              fhd_mask_depth(depth[depth_idx]);
         }
       }
     }
   }
 
-  fhd->candidates_len = fhd->filtered_regions_len > fhd->candidates_capacity
+  fhd->candidates_len = regions_len > fhd->candidates_capacity
                             ? fhd->candidates_capacity
-                            : fhd->filtered_regions_len;
+                            : regions_len;
   for (int i = 0; i < fhd->candidates_len; i++) {
-    const fhd_region* r = &fhd->filtered_regions[i];
+    const fhd_region* r = &regions[i];
 
     const float tl_x = r->bounds.top_left.x * fhd->cell_wf;
     const float tl_y = r->bounds.top_left.y * fhd->cell_hf;
@@ -446,7 +993,7 @@ void fhd_copy_regions(fhd_context* fhd) {
 
     const float width = br_x - tl_x;
     const float height = br_y - tl_y;
-    const fhd_vec2 center = fhd_kinect_coord_to_depth(r->center);
+    const fhd_vec2 center = fhd_camera_project(&fhd->camera, r->center);
 
     const float z_tl_x = tl_x - center.x;
     const float z_tl_y = tl_y - center.y;
@@ -481,6 +1028,7 @@ void fhd_copy_regions(fhd_context* fhd) {
       dst_reg.height = dst_height;
       fhd_copy_sub_image_scale(&fhd->output_depth, &reg, &candidate->depth,
                                &dst_reg);
+      candidate->depth_window = dst_reg;
     } else {
       fhd_image_region dst_reg;
       dst_reg.x = ((FHD_HOG_WIDTH - int(width)) / 2) + 1;
@@ -488,6 +1036,24 @@ void fhd_copy_regions(fhd_context* fhd) {
       dst_reg.width = int(width);
       dst_reg.height = int(height);
       fhd_copy_sub_image(&fhd->output_depth, &reg, &candidate->depth, &dst_reg);
+      candidate->depth_window = dst_reg;
+    }
+  }
+}
+
+// The parts of ranges inside window
+static void fhd_calculate_cells_in(const fhd_context* fhd,
+                                   fhd_candidate* candidate,
+                                   const fhd_hog_cell_range* ranges, int len,
+                                   const fhd_hog_cell_range* window) {
+  for (int i = 0; i < len; i++) {
+    fhd_hog_cell_range r;
+    r.x0 = std::max(ranges[i].x0, window->x0);
+    r.y0 = std::max(ranges[i].y0, window->y0);
+    r.x1 = std::min(ranges[i].x1, window->x1);
+    r.y1 = std::min(ranges[i].y1, window->y1);
+    if (r.x0 < r.x1 && r.y0 < r.y1) {
+      fhd->kernels->hog_cells(&candidate->depth, &r, candidate->cells);
     }
   }
 }
@@ -495,13 +1061,32 @@ void fhd_copy_regions(fhd_context* fhd) {
 void fhd_calculate_hog_cells(fhd_context* fhd) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_calc_hog]);
 
+  const fhd_cascade* cascade = fhd->cascade;
 #ifdef FHD_OMP
-#pragma omp parallel for num_threads(FHD_NUM_THREADS)
+#pragma omp parallel for num_threads(FHD_NUM_THREADS) \
+    if (!fhd_worker_pool_on_worker())
 #endif
   for (int i = 0; i < fhd->candidates_len; i++) {
     fhd_candidate* candidate = &fhd->candidates[i];
     memset(candidate->cells, 0, candidate->num_cells * sizeof(fhd_hog_cell));
-    fhd_hog_calculate_cells(&candidate->depth, candidate->cells);
+    candidate->rejected = false;
+    const fhd_hog_cell_range range =
+        fhd_hog_cells_in(&candidate->depth_window);
+    if (!cascade) {
+      fhd->kernels->hog_cells(&candidate->depth, &range, candidate->cells);
+      continue;
+    }
+
+    fhd_calculate_cells_in(fhd, candidate, cascade->stage_ranges,
+                           cascade->stage_ranges_len, &range);
+    if (fhd_cascade_score(cascade, candidate->cells) < cascade->threshold) {
+      candidate->rejected = true;
+      candidate->weight = -1.f;
+      continue;
+    }
+
+    fhd_calculate_cells_in(fhd, candidate, cascade->rest_ranges,
+                           cascade->rest_ranges_len, &range);
   }
 }
 
@@ -509,12 +1094,13 @@ void fhd_create_features(fhd_context* fhd) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_create_features]);
   for (int i = 0; i < fhd->candidates_len; i++) {
     fhd_candidate* candidate = &fhd->candidates[i];
+    if (candidate->rejected) continue;
     fhd_hog_create_features(candidate->cells, candidate->features);
   }
 }
 
 void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
-                      int cell_h) {
+                      int cell_h, const fhd_camera* camera) {
   memset(fhd->perf_records, 0, sizeof(fhd->perf_records));
   fhd->source_w = source_w;
   fhd->source_h = source_h;
@@ -530,6 +1116,16 @@ void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
   fhd->cells_y = source_h / cell_h;
   fhd->cells_len = fhd->cells_x * fhd->cells_y;
 
+  fhd->camera = camera ? *camera : FHD_KINECT_CAMERA;
+  fhd->cell_rays = (fhd_vec3*)calloc(fhd->cells_len, sizeof(fhd_vec3));
+  for (int y = 0; y < fhd->cells_y; y++) {
+    for (int x = 0; x < fhd->cells_x; x++) {
+      const fhd_vec2 ray = fhd_camera_ray(&fhd->camera, float(x) * fhd->cell_wf,
+                                          float(y) * fhd->cell_hf);
+      fhd->cell_rays[y * fhd->cells_x + x] = fhd_vec3{ray.x, ray.y, 1.f};
+    }
+  }
+
   fhd->min_region_size = 1.f;
   fhd->max_merge_distance = 0.46f;
   fhd->max_vertical_merge_distance = 1.0f;
@@ -539,13 +1135,21 @@ void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
   fhd->min_region_width = 0.3f;
   fhd->max_region_width = 1.0f;
   fhd->ransac_max_plane_distance = 0.05f;
+  fhd->planar_regions = false;
   fhd->min_depth_segment_size = 10;
   fhd->min_normal_segment_size = 1;
   fhd->depth_segmentation_threshold = 4.f;
   fhd->normal_segmentation_threshold = 4.f;
-
-  fhd->point_allocator =
-      fhd_block_allocator_create(sizeof(fhd_region_point) * 2048, 1024);
+  fhd->median_method = fhd_median_network;
+  fhd->normals_method = fhd_normals_least_squares;
+  fhd->merge_method = fhd_merge_pairwise;
+  fhd->fuse_depth_normalization = true;
+  fhd->fuse_features = false;
+  fhd->cascade = NULL;
+  fhd->pool = NULL;
+  fhd->tiled_segmentation = false;
+  fhd->segmentation_graph = fhd_graph_edges;
+  fhd->kernels = fhd_default_kernels();
 
   fhd_image_init(&fhd->normalized_source, source_w, source_h);
   fhd->downscaled_depth = (uint16_t*)calloc(fhd->cells_len, sizeof(uint16_t));
@@ -554,25 +1158,56 @@ void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
   fhd->point_cloud = (fhd_vec3*)calloc(fhd->cells_len, sizeof(fhd_vec3));
   fhd->normals = (fhd_vec3*)calloc(fhd->cells_len, sizeof(fhd_vec3));
 
-  fhd->depth_graph = (fhd_edge*)calloc(fhd->cells_len * 4, sizeof(fhd_edge));
-  fhd->normals_graph = (fhd_edge*)calloc(fhd->cells_len * 4, sizeof(fhd_edge));
+  // At most an edge to the right and one below per cell
+  const int max_edges = fhd->cells_len * 2;
+  fhd->depth_graph = (fhd_edge*)calloc(max_edges, sizeof(fhd_edge));
+  fhd->normals_graph = (fhd_edge*)calloc(max_edges, sizeof(fhd_edge));
+  fhd->grid_edges = (fhd_grid_edge*)calloc(max_edges, sizeof(fhd_grid_edge));
+  fhd->depth_components = (int*)calloc(fhd->cells_len, sizeof(int));
+  fhd->normals_moments = (fhd_plane_moments*)calloc(
+      (fhd->cells_x + 1) * (fhd->cells_y + 1), sizeof(fhd_plane_moments));
+  fhd->normals_components = (int*)calloc(fhd->cells_len, sizeof(int));
 
   fhd->normals_segmentation =
       (fhd_segmentation*)calloc(1, sizeof(fhd_segmentation));
-  fhd_segmentation_init(fhd->normals_segmentation, fhd->cells_len);
+  fhd_segmentation_init(fhd->normals_segmentation, fhd->cells_len,
+                        max_edges);
 
   fhd->depth_segmentation =
       (fhd_segmentation*)calloc(1, sizeof(fhd_segmentation));
-  fhd_segmentation_init(fhd->depth_segmentation, fhd->cells_len);
+  fhd_segmentation_init(fhd->depth_segmentation, fhd->cells_len,
+                        max_edges);
 
   fhd->num_depth_edges = 0;
   fhd->num_normals_edges = 0;
 
+  fhd->regions_len = 0;
+  fhd->regions = (fhd_region*)calloc(fhd->cells_len, sizeof(fhd_region));
+  fhd->cell_regions = (int*)calloc(fhd->cells_len, sizeof(int));
+  fhd->region_heads = (int*)calloc(fhd->cells_len, sizeof(int));
+  fhd->region_next = (int*)calloc(fhd->cells_len, sizeof(int));
+  fhd->region_depth_components = (int*)calloc(fhd->cells_len, sizeof(int));
+
   fhd->filtered_regions_capacity = 64;
   fhd->filtered_regions_len = 0;
   fhd->filtered_regions =
       (fhd_region*)calloc(fhd->filtered_regions_capacity, sizeof(fhd_region));
 
+  // Every cell belongs to at most one region and merging only moves chunks
+  // around, so one partially filled chunk per region on top of the cells
+  // always fits
+  fhd->point_chunks_capacity =
+      (fhd->cells_len + FHD_POINT_CHUNK_CAPACITY - 1) /
+          FHD_POINT_CHUNK_CAPACITY +
+      fhd->filtered_regions_capacity;
+  fhd->point_allocator = fhd_block_allocator_create(
+      sizeof(fhd_point_chunk), fhd->point_chunks_capacity);
+
+  fhd->merge_scratch =
+      (fhd_merge_scratch*)calloc(1, sizeof(fhd_merge_scratch));
+  fhd_merge_scratch_init(fhd->merge_scratch, fhd->filtered_regions_capacity);
+  fhd->ransac_points = (float*)calloc(fhd->cells_len * 3, sizeof(float));
+
   fhd->output_cell_indices = (int*)calloc(fhd->cells_len, sizeof(int));
 
   fhd_image_init(&fhd->output_depth, source_w, source_h);
@@ -598,6 +1233,7 @@ void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
     candidate->features =
         (float*)calloc(candidate->num_features, sizeof(float));
     candidate->weight = 0.f;
+    candidate->rejected = false;
   }
 
   int sampler_n_pot = 4;
@@ -622,34 +1258,41 @@ void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
 
 void fhd_copy_depth(fhd_context* fhd, const uint16_t* source) {
   FHD_TIMED_BLOCK(&fhd->perf_records[pr_normalize_depth]);
-  fhd->num_depth_edges = 0;
-  fhd->num_normals_edges = 0;
-
-  __m128i least = _mm_set1_epi16(499);
-  __m128i most = _mm_set1_epi16(4501);
-  for (int i = 0; i < fhd->source_len; i += 8) {
-    __m128i vals = _mm_load_si128((const __m128i*)&source[i]);
-    __m128i mask_least = _mm_cmpgt_epi16(vals, least);
-    __m128i mask_most = _mm_cmplt_epi16(vals, most);
-    __m128i mask_between = _mm_and_si128(mask_least, mask_most);
-    __m128i between = _mm_and_si128(vals, mask_between);
-    _mm_store_si128((__m128i*)&fhd->normalized_source.data[i], between);
-  }
+  fhd->kernels->mask_depth(source, fhd->normalized_source.data,
+                           fhd->source_len);
 }
 
-void fhd_run_pass(fhd_context* fhd, const uint16_t* source) {
+void fhd_run_region_stages(fhd_context* fhd, const uint16_t* source) {
   fhd->filtered_regions_len = 0;
+  fhd->num_depth_edges = 0;
+  fhd->num_normals_edges = 0;
   fhd_block_allocator_clear(fhd->point_allocator);
-  fhd_copy_depth(fhd, source);
-  fhd_construct_point_cloud(fhd);
+  if (fhd->fuse_depth_normalization) {
+    fhd_construct_point_cloud(fhd, source);
+  } else {
+    fhd_copy_depth(fhd, source);
+    fhd_construct_point_cloud(fhd, fhd->normalized_source.data);
+  }
   fhd_perform_depth_segmentation(fhd);
   fhd_construct_normals(fhd);
   fhd_perform_normals_segmentation(fhd);
   fhd_construct_regions(fhd);
   fhd_merge_regions(fhd);
-  fhd_copy_regions(fhd);
+}
+
+void fhd_run_candidate_stages(fhd_context* fhd, const uint16_t* depth,
+                              fhd_region* regions, int regions_len) {
+  fhd_copy_regions(fhd, depth, regions, regions_len);
   fhd_calculate_hog_cells(fhd);
-  fhd_create_features(fhd);
+  if (!fhd->fuse_features) fhd_create_features(fhd);
+}
+
+void fhd_run_pass(fhd_context* fhd, const uint16_t* source) {
+  fhd_run_region_stages(fhd, source);
+  const uint16_t* depth =
+      fhd->fuse_depth_normalization ? source : fhd->normalized_source.data;
+  fhd_run_candidate_stages(fhd, depth, fhd->filtered_regions,
+                           fhd->filtered_regions_len);
 }
 
 void fhd_context_destroy(fhd_context* fhd) {
@@ -657,14 +1300,26 @@ void fhd_context_destroy(fhd_context* fhd) {
   fhd_image_destroy(&fhd->normalized_source);
   fhd_image_destroy(&fhd->output_depth);
 
+  free(fhd->cell_rays);
   free(fhd->downscaled_depth);
   free(fhd->point_cloud);
   free(fhd->normals);
   free(fhd->depth_graph);
   free(fhd->normals_graph);
-  free(fhd->normals_segmentation);
-  free(fhd->depth_segmentation);
+  free(fhd->grid_edges);
+  free(fhd->depth_components);
+  free(fhd->normals_moments);
+  free(fhd->normals_components);
+  fhd_segmentation_destroy(fhd->normals_segmentation);
+  fhd_segmentation_destroy(fhd->depth_segmentation);
+  free(fhd->regions);
+  free(fhd->cell_regions);
+  free(fhd->region_heads);
+  free(fhd->region_next);
+  free(fhd->region_depth_components);
   free(fhd->filtered_regions);
+  fhd_merge_scratch_destroy(fhd->merge_scratch);
+  free(fhd->ransac_points);
   free(fhd->output_cell_indices);
 
   for (int i = 0; i < fhd->candidates_capacity; i++) {
@@ -680,10 +1335,87 @@ void fhd_context_destroy(fhd_context* fhd) {
   free(fhd->rng);
 }
 
-void fhd_run_classifier(fhd_context* fhd, const fhd_classifier* classifier) {
-  FHD_TIMED_BLOCK(&fhd->perf_records[pr_classify]);
+// Candidates waiting to be scored together by fhd_classify_batch
+struct fhd_classify_queue {
+  int len;
+  fhd_candidate* candidates[FHD_CLASSIFY_BATCH];
+  const float* features[FHD_CLASSIFY_BATCH];
+};
+
+static void fhd_classify_flush(fhd_classify_queue* queue,
+                               const fhd_classifier* classifier) {
+  float scores[FHD_CLASSIFY_BATCH];
+  fhd_classify_batch(classifier, queue->features, queue->len, scores);
+  for (int i = 0; i < queue->len; i++) {
+    queue->candidates[i]->weight = scores[i];
+  }
+
+  queue->len = 0;
+}
+
+static void fhd_classify_candidates(fhd_context* fhd,
+                                    const fhd_classifier* classifier,
+                                    fhd_classify_queue* queue) {
   for (int i = 0; i < fhd->candidates_len; i++) {
     fhd_candidate* candidate = &fhd->candidates[i];
-    candidate->weight = fhd_classify(classifier, candidate);
+    if (candidate->rejected) continue;
+    if (fhd->fuse_features) {
+      candidate->weight = fhd_classify_cells(classifier, candidate->cells);
+      continue;
+    }
+
+    queue->candidates[queue->len] = candidate;
+    queue->features[queue->len] = candidate->features;
+    if (++queue->len == FHD_CLASSIFY_BATCH) {
+      fhd_classify_flush(queue, classifier);
+    }
+  }
+}
+
+void fhd_run_classifier(fhd_context* fhd, const fhd_classifier* classifier) {
+  FHD_TIMED_BLOCK(&fhd->perf_records[pr_classify]);
+  fhd_classify_queue queue;
+  queue.len = 0;
+  fhd_classify_candidates(fhd, classifier, &queue);
+  fhd_classify_flush(&queue, classifier);
+}
+
+void fhd_run_classifier_streams(fhd_context** contexts, int n,
+                                const fhd_classifier* classifier) {
+  fhd_classify_queue queue;
+  queue.len = 0;
+  for (int i = 0; i < n; i++) {
+    fhd_classify_candidates(contexts[i], classifier, &queue);
   }
+
+  fhd_classify_flush(&queue, classifier);
+}
+
+struct fhd_pass_batch {
+  fhd_context** contexts;
+  const uint16_t* const* sources;
+  const fhd_classifier* const* classifiers;
+};
+
+void fhd_run_pass_batch(fhd_worker_pool* pool, fhd_context** contexts,
+                        const uint16_t* const* sources, int n) {
+  fhd_pass_batch batch = {contexts, sources, NULL};
+  fhd_worker_pool_run(pool,
+                      [](void* user, int i) {
+                        fhd_pass_batch* b = (fhd_pass_batch*)user;
+                        fhd_run_pass(b->contexts[i], b->sources[i]);
+                      },
+                      &batch, n);
+}
+
+void fhd_run_classifier_batch(fhd_worker_pool* pool, fhd_context** contexts,
+                              const fhd_classifier* const* classifiers,
+                              int n) {
+  fhd_pass_batch batch = {contexts, NULL, classifiers};
+  fhd_worker_pool_run(pool,
+                      [](void* user, int i) {
+                        fhd_pass_batch* b = (fhd_pass_batch*)user;
+                        fhd_run_classifier(b->contexts[i], b->classifiers[i]);
+                      },
+                      &batch, n);
 }
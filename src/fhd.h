@@ -1,15 +1,22 @@
 #pragma once
 
+#include "fhd_camera.h"
 #include "fhd_config.h"
 #include "fhd_candidate.h"
 #include "fhd_sampler.h"
 #include "fhd_perf.h"
+#include <stddef.h>
 #include <stdint.h>
 
 struct fhd_block_allocator;
+struct fhd_cascade;
 struct fhd_segmentation;
 struct fhd_classifier;
 struct fhd_edge;
+struct fhd_grid_edge;
+struct fhd_kernels;
+struct fhd_merge_scratch;
+struct fhd_worker_pool;
 struct pcg_state_setseq_64;
 
 struct fhd_region_point {
@@ -18,6 +25,12 @@ struct fhd_region_point {
   fhd_vec3 p_r;
 };
 
+struct fhd_point_chunk {
+  fhd_point_chunk* next;
+  int len;
+  fhd_region_point points[FHD_POINT_CHUNK_CAPACITY];
+};
+
 struct fhd_region {
   fhd_aabb bounds;  // x, y depth space coordinates
 
@@ -30,8 +43,33 @@ struct fhd_region {
   fhd_vec3 center;  // metric space
   float n;
 
+  // Merging splices the chains together, so points are not contiguous
   int points_len;
-  fhd_region_point* points;
+  fhd_point_chunk* points;
+  fhd_point_chunk* points_tail;
+};
+
+enum fhd_median_method {
+  fhd_median_nth_element,  // scalar reference
+  fhd_median_network       // SIMD selection network, needs 16 samples
+};
+
+enum fhd_normals_method {
+  fhd_normals_least_squares,  // Eigen solve per cell, reference
+  fhd_normals_integral,       // summed area tables, for large depth components
+  fhd_normals_batched         // closed-form fits, fhd_kernels::plane_normals
+};
+
+enum fhd_merge_method {
+  // Every small region against all larger ones, reference. Faster than the
+  // grid at the filtered region cap of 64.
+  fhd_merge_pairwise,
+  fhd_merge_grid  // larger regions bucketed on the XZ plane, same output
+};
+
+enum fhd_segmentation_graph {
+  fhd_graph_edges,  // every pair of neighbouring cells, reference
+  fhd_graph_grid    // grid edges between valid cells only
 };
 
 struct fhd_context {
@@ -50,6 +88,10 @@ struct fhd_context {
   int cells_y;
   int cells_len;
 
+  fhd_camera camera;
+  // Unit depth point of each cell, a cell at depth d is at cell_rays[i] * d
+  fhd_vec3* cell_rays;
+
   float min_region_size;
   float max_merge_distance;
   float max_vertical_merge_distance;
@@ -59,11 +101,33 @@ struct fhd_context {
   float min_region_width;
   float max_region_width;
   float ransac_max_plane_distance;
+  // Drop small regions that are not at least min_inlier_fraction planar
+  // instead of merging them. Off by default.
+  bool planar_regions;
   int min_depth_segment_size;
   int min_normal_segment_size;
   float depth_segmentation_threshold;
   float normal_segmentation_threshold;
-
+  fhd_median_method median_method;
+  fhd_normals_method normals_method;
+  fhd_merge_method merge_method;
+  // Mask invalid readings while sampling instead of writing normalized_source
+  // every pass. normalized_source is then only written by fhd_copy_depth.
+  bool fuse_depth_normalization;
+  // Score candidates straight from their HOG cells in fhd_run_classifier
+  // instead of writing candidate->features every pass, off by default. Turn it
+  // off to label or store candidates.
+  bool fuse_features;
+  // Rejects candidates from the HOG cells of a few blocks before calculating
+  // the rest, NULL by default. Rejected candidates get weight -1 and no
+  // features.
+  const fhd_cascade* cascade;
+  // SIMD implementations of the hot loops, the best the CPU supports unless
+  // capped with fhd_set_max_isa
+  const fhd_kernels* kernels;
+
+  // Chunks for fhd_region::points, cleared every pass
+  int point_chunks_capacity;
   fhd_block_allocator* point_allocator;
 
   fhd_image normalized_source;
@@ -71,19 +135,50 @@ struct fhd_context {
 
   fhd_vec3* point_cloud;
   fhd_vec3* normals;
-
+  // (cells_x + 1) * (cells_y + 1) summed moments for fhd_normals_integral
+  fhd_plane_moments* normals_moments;
+
+  // Runs the tasks of tiled_segmentation, NULL by default. Tasks are run
+  // inline without one or when the pass itself runs on the pool.
+  fhd_worker_pool* pool;
+  // Segments bands of rows separately and joins them, off by default. Bands
+  // are joined with the same threshold rule but the components can differ
+  // from the serial segmentation.
+  bool tiled_segmentation;
+
+  // Graphs are built in either depth_graph and normals_graph or grid_edges,
+  // depending on segmentation_graph
+  fhd_segmentation_graph segmentation_graph;
   fhd_edge* depth_graph;
   fhd_edge* normals_graph;
+  fhd_grid_edge* grid_edges;
 
   fhd_segmentation* normals_segmentation;
   fhd_segmentation* depth_segmentation;
+  // Component of every cell, depth from fhd_construct_normals on and normals
+  // from fhd_construct_regions on
+  int* depth_components;
+  int* normals_components;
 
   int num_depth_edges;
   int num_normals_edges;
 
+  // Every region of the frame before filtering, indexed by cell_regions.
+  // region_heads, region_next and region_depth_components are lookup scratch
+  // for fhd_construct_regions.
+  int regions_len;
+  fhd_region* regions;
+  int* cell_regions;
+  int* region_heads;
+  int* region_next;
+  int* region_depth_components;
+
   int filtered_regions_capacity;
   int filtered_regions_len;
   fhd_region* filtered_regions;
+  fhd_merge_scratch* merge_scratch;
+  // x, y and z of a region's points, cells_len each, for the planarity test
+  float* ransac_points;
 
   int* output_cell_indices;
 
@@ -100,7 +195,31 @@ struct fhd_context {
   uint16_t* cell_sample_buffer;
 };
 
-void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w, int cell_h);
+// camera defaults to the Kinect v2 depth camera
+void fhd_context_init(fhd_context* fhd, int source_w, int source_h, int cell_w,
+                      int cell_h, const fhd_camera* camera = NULL);
 void fhd_run_pass(fhd_context* fhd, const uint16_t* source);
 void fhd_run_classifier(fhd_context* fhd, const fhd_classifier* classifier);
 void fhd_context_destroy(fhd_context* fhd);
+
+// The two halves of fhd_run_pass. The region stages fill filtered_regions from
+// a depth frame, the candidate stages read the depth frame (raw or normalized)
+// and regions they are given so another frame's buffers can be passed in
+// (see fhd_pipeline).
+void fhd_run_region_stages(fhd_context* fhd, const uint16_t* source);
+void fhd_run_candidate_stages(fhd_context* fhd, const uint16_t* depth,
+                              fhd_region* regions, int regions_len);
+// Writes source to normalized_source with invalid readings zeroed
+void fhd_copy_depth(fhd_context* fhd, const uint16_t* source);
+
+// Run one pass per context over a shared worker pool, sources[i] is the frame
+// for contexts[i].
+void fhd_run_pass_batch(fhd_worker_pool* pool, fhd_context** contexts,
+                        const uint16_t* const* sources, int n);
+// FANN networks keep per-run state, so each context gets its own classifier.
+void fhd_run_classifier_batch(fhd_worker_pool* pool, fhd_context** contexts,
+                              const fhd_classifier* const* classifiers, int n);
+// Scores the candidates of all contexts with one classifier on the calling
+// thread, batching feature vectors across contexts.
+void fhd_run_classifier_streams(fhd_context** contexts, int n,
+                                const fhd_classifier* classifier);
@@ -3,21 +3,22 @@
 #include <stdlib.h>
 #include <assert.h>
 
-struct fhd_alloc_slot {
-  void* ptr;
-  int idx;
+// Released blocks hold the link to the next free one
+struct fhd_free_block {
+  fhd_free_block* next;
 };
 
 struct fhd_block_allocator {
   int block_size;
-  int num_bytes;
   int num_blocks;
   uint8_t* memory;
-  int free_indices_len;
-  int* free_indices;
 
-  int full_slots_len;
-  fhd_alloc_slot* full_slots;
+  // Blocks past the bump index were never handed out since the last clear
+  int bump_index;
+  fhd_free_block* free_list;
+
+  int used_blocks;
+  int max_used_blocks;
 };
 
 fhd_block_allocator* fhd_block_allocator_create(int block_size,
@@ -25,70 +26,73 @@ fhd_block_allocator* fhd_block_allocator_create(int block_size,
   fhd_block_allocator* block_alloc =
       (fhd_block_allocator*)calloc(1, sizeof(fhd_block_allocator));
 
+  // Keep every block aligned for whatever is stored in it
+  const int align = 16;
+  if (block_size < int(sizeof(fhd_free_block))) {
+    block_size = int(sizeof(fhd_free_block));
+  }
+  block_size = (block_size + align - 1) & ~(align - 1);
+
   block_alloc->block_size = block_size;
-  block_alloc->num_bytes = block_size * num_blocks;
   block_alloc->num_blocks = num_blocks;
-  block_alloc->memory = (uint8_t*)calloc(block_alloc->num_bytes, 1);
-  block_alloc->free_indices_len = num_blocks;
-  block_alloc->free_indices = (int*)calloc(num_blocks, sizeof(int));
-  block_alloc->full_slots_len = 0;
-  block_alloc->full_slots =
-      (fhd_alloc_slot*)calloc(num_blocks, sizeof(fhd_alloc_slot));
-
-  for (int i = 0; i < num_blocks; i++) {
-    block_alloc->free_indices[i] = i;
-  }
+  block_alloc->memory = (uint8_t*)calloc(num_blocks, block_size);
+  block_alloc->bump_index = 0;
+  block_alloc->free_list = NULL;
+  block_alloc->used_blocks = 0;
+  block_alloc->max_used_blocks = 0;
 
   return block_alloc;
 }
 
 void fhd_block_allocator_destroy(fhd_block_allocator* block_alloc) {
   free(block_alloc->memory);
-  free(block_alloc->free_indices);
-  free(block_alloc->full_slots);
   free(block_alloc);
 }
 
 void* fhd_block_allocator_acquire(fhd_block_allocator* block_alloc) {
-  if (block_alloc->free_indices_len == 0) return NULL;
-
-  const int free_idx =
-      block_alloc->free_indices[block_alloc->free_indices_len - 1];
-  const int offset = free_idx * block_alloc->block_size;
-
-  uint8_t* block = block_alloc->memory + offset;
-
-  const fhd_alloc_slot slot = {block, free_idx};
-  block_alloc->full_slots[block_alloc->full_slots_len++] = slot;
+  void* block;
+  if (block_alloc->free_list) {
+    block = block_alloc->free_list;
+    block_alloc->free_list = block_alloc->free_list->next;
+  } else if (block_alloc->bump_index < block_alloc->num_blocks) {
+    block = block_alloc->memory +
+            size_t(block_alloc->bump_index++) * block_alloc->block_size;
+  } else {
+    return NULL;
+  }
 
-  block_alloc->free_indices_len--;
+  block_alloc->used_blocks++;
+  if (block_alloc->used_blocks > block_alloc->max_used_blocks) {
+    block_alloc->max_used_blocks = block_alloc->used_blocks;
+  }
 
   return block;
 }
 
 void fhd_block_allocator_release(fhd_block_allocator* block_alloc, void* ptr) {
-  for (int i = 0; i < block_alloc->full_slots_len; i++) {
-    fhd_alloc_slot slot = block_alloc->full_slots[i];
-    if (ptr == slot.ptr) {
-      block_alloc->free_indices[block_alloc->free_indices_len] = slot.idx;
-
-      for (int j = i; j < block_alloc->full_slots_len - 1; j++) {
-        block_alloc->full_slots[j] = block_alloc->full_slots[j + 1];
-      }
-
-      block_alloc->free_indices_len++;
-      block_alloc->full_slots_len--;
-
-      return;
-    }
-  }
+  if (!ptr) return;
+
+  assert((uint8_t*)ptr >= block_alloc->memory &&
+         (uint8_t*)ptr < block_alloc->memory + size_t(block_alloc->bump_index) *
+                                                   block_alloc->block_size);
+  fhd_free_block* block = (fhd_free_block*)ptr;
+  block->next = block_alloc->free_list;
+  block_alloc->free_list = block;
+  block_alloc->used_blocks--;
 }
 
 void fhd_block_allocator_clear(fhd_block_allocator* block_alloc) {
-  for (int i = 0; i < block_alloc->full_slots_len; i++) {
-    block_alloc->free_indices[block_alloc->free_indices_len++] =
-        block_alloc->full_slots[i].idx;
-  }
+  block_alloc->bump_index = 0;
+  block_alloc->free_list = NULL;
+  block_alloc->used_blocks = 0;
+}
 
-  block_alloc->full_slots_len = 0;
+fhd_block_allocator_stats fhd_block_allocator_get_stats(
+    const fhd_block_allocator* block_alloc) {
+  fhd_block_allocator_stats stats;
+  stats.block_size = block_alloc->block_size;
+  stats.num_blocks = block_alloc->num_blocks;
+  stats.used_blocks = block_alloc->used_blocks;
+  stats.max_used_blocks = block_alloc->max_used_blocks;
+  return stats;
 }
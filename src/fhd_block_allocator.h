@@ -2,8 +2,21 @@
 
 struct fhd_block_allocator;
 
+struct fhd_block_allocator_stats {
+  int block_size;
+  int num_blocks;
+  int used_blocks;
+  // most blocks in use at once since creation
+  int max_used_blocks;
+};
+
+// Fixed size blocks out of one allocation. Acquire and release are O(1) and
+// clear hands back every block at once, for memory that lives for one frame.
 fhd_block_allocator* fhd_block_allocator_create(int block_size, int num_blocks);
 void fhd_block_allocator_destroy(fhd_block_allocator* block_alloc);
+// Returns NULL when all blocks are in use
 void* fhd_block_allocator_acquire(fhd_block_allocator* block_alloc);
 void fhd_block_allocator_release(fhd_block_allocator* block_alloc, void* ptr);
 void fhd_block_allocator_clear(fhd_block_allocator* block_alloc);
+fhd_block_allocator_stats fhd_block_allocator_get_stats(
+    const fhd_block_allocator* block_alloc);
@@ -0,0 +1,18 @@
+#include "fhd_camera.h"
+
+fhd_vec2 fhd_camera_project(const fhd_camera* camera, fhd_vec3 p) {
+  fhd_vec2 r;
+  r.x = fhd_clamp((p.x * camera->fx) / p.z + camera->cx, 0.f, camera->width);
+  r.y = fhd_clamp(-(p.y * camera->fy) / p.z + camera->cy, 0.f, camera->height);
+  return r;
+}
+
+fhd_vec3 fhd_camera_unproject(const fhd_camera* camera, float depth, float x,
+                              float y) {
+  return {((x - camera->cx) / camera->fx) * depth,
+          ((y - camera->cy) / camera->fy) * -depth, depth};
+}
+
+fhd_vec2 fhd_camera_ray(const fhd_camera* camera, float x, float y) {
+  return {(x - camera->cx) / camera->fx, -((y - camera->cy) / camera->fy)};
+}
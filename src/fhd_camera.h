@@ -0,0 +1,22 @@
+#pragma once
+
+#include "fhd_math.h"
+
+// Pinhole depth camera, fx/fy in pixels and cx/cy the principal point in
+// depth image coordinates. Points are in meters with y pointing up.
+struct fhd_camera {
+  float width;
+  float height;
+  float fx;
+  float fy;
+  float cx;
+  float cy;
+};
+
+// Depth image coordinates of p, clamped to the image
+fhd_vec2 fhd_camera_project(const fhd_camera* camera, fhd_vec3 p);
+fhd_vec3 fhd_camera_unproject(const fhd_camera* camera, float depth, float x,
+                              float y);
+// The point at depth 1 m behind depth image coordinate (x, y), so that
+// fhd_camera_unproject(camera, d, x, y) == ray * d
+fhd_vec2 fhd_camera_ray(const fhd_camera* camera, float x, float y);
@@ -1,14 +1,85 @@
 #include "fhd_candidate.h"
 #include "fhd_config.h"
 #include "fhd_math.h"
+#include "fhd_simd_kernels.h"
 #include <math.h>
 #include <float.h>
 #include <assert.h>
+#include <algorithm>
 
-void fhd_hog_calculate_cells(const fhd_image* img, fhd_hog_cell* out) {
+static int fhd_hog_bin(fhd_vec2 grad) {
+  const float num_bins = float(FHD_HOG_BINS);
+  const float angle = (fhd_fast_atan2(grad.y, grad.x) + F_PI) / (2.f * F_PI);
+  return int(angle * num_bins + FLT_EPSILON) % FHD_HOG_BINS;
+}
+
+// Bisects for the direction where the bin goes from 4 + k to 5 + k. The bin
+// only depends on the direction of the gradient and grows with its angle above
+// the x axis.
+static fhd_hog_boundaries fhd_hog_find_boundaries() {
+  fhd_hog_boundaries b;
+  for (int k = 0; k < FHD_HOG_BINS / 2; k++) {
+    double lo = 0.0;
+    double hi = 3.14159265358979 - 1e-3;
+    for (int i = 0; i < 64; i++) {
+      const double mid = 0.5 * (lo + hi);
+      const fhd_vec2 grad = {float(cos(mid)), float(sin(mid))};
+      if (fhd_hog_bin(grad) > FHD_HOG_BINS / 2 + k) {
+        hi = mid;
+      } else {
+        lo = mid;
+      }
+    }
+
+    b.cos[k] = float(cos(hi));
+    b.sin[k] = float(sin(hi));
+  }
+
+  return b;
+}
+
+const fhd_hog_boundaries* fhd_hog_get_boundaries() {
+  static const fhd_hog_boundaries boundaries = fhd_hog_find_boundaries();
+  return &boundaries;
+}
+
+fhd_hog_cell_range fhd_hog_all_cells() {
+  return fhd_hog_cell_range{0, 0, FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE,
+                            FHD_HOG_HEIGHT / FHD_HOG_CELL_SIZE};
+}
+
+// Pixel x of the window is at x + 1 in the image, its gradient needs x and
+// x + 2 or x + 1 to be in the window. Same for y.
+fhd_hog_cell_range fhd_hog_cells_in(const fhd_image_region* window) {
+  const fhd_hog_cell_range all = fhd_hog_all_cells();
+  if (window->width <= 0 || window->height <= 0) {
+    return fhd_hog_cell_range{0, 0, 0, 0};
+  }
+
+  const int first_x = window->x - 1;
+  const int first_y = window->y - 1;
+  const int last_x = window->x + window->width - 2;
+  const int last_y = window->y + window->height - 2;
+  fhd_hog_cell_range r;
+  r.x0 = std::max(first_x, 0) / FHD_HOG_CELL_SIZE;
+  r.y0 = std::max(first_y, 0) / FHD_HOG_CELL_SIZE;
+  r.x1 = std::min(last_x / FHD_HOG_CELL_SIZE + 1, all.x1);
+  r.y1 = std::min(last_y / FHD_HOG_CELL_SIZE + 1, all.y1);
+  if (last_x < 0 || last_y < 0 || r.x0 >= r.x1 || r.y0 >= r.y1) {
+    return fhd_hog_cell_range{0, 0, 0, 0};
+  }
+
+  return r;
+}
+
+void fhd_hog_calculate_cells(const fhd_image* img,
+                             const fhd_hog_cell_range* range,
+                             fhd_hog_cell* out) {
   const int width = img->width;
-  for (int y = 0; y < FHD_HOG_HEIGHT; y++) {
-    for (int x = 0; x < FHD_HOG_WIDTH; x++) {
+  for (int y = range->y0 * FHD_HOG_CELL_SIZE;
+       y < range->y1 * FHD_HOG_CELL_SIZE; y++) {
+    for (int x = range->x0 * FHD_HOG_CELL_SIZE;
+         x < range->x1 * FHD_HOG_CELL_SIZE; x++) {
       const int idx = (y + 1) * width + (x + 1);
       const int16_t pv_y = int16_t(img->data[idx - width]);
       const int16_t pv_x = int16_t(img->data[idx - 1]);
@@ -29,10 +100,7 @@ void fhd_hog_calculate_cells(const fhd_image* img, fhd_hog_cell* out) {
       }
 
       const float magnitude = fhd_vec2_length(grad);
-      const float num_bins = float(FHD_HOG_BINS);
-      const float angle =
-          (fhd_fast_atan2(grad.y, grad.x) + F_PI) / (2.f * F_PI);
-      const int bin = int(angle * num_bins + FLT_EPSILON) % FHD_HOG_BINS;
+      const int bin = fhd_hog_bin(grad);
       assert(bin >= 0 && bin < FHD_HOG_BINS);
 
       const int cell_x = x / FHD_HOG_CELL_SIZE;
@@ -77,3 +145,80 @@ void fhd_hog_create_features(const fhd_hog_cell* cells, float* features) {
     }
   }
 }
+
+void fhd_hog_create_features_u8(const fhd_hog_cell* cells,
+                                const float* scales, uint8_t* out) {
+  const int cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+  for (int y = 0; y < FHD_HOG_BLOCKS_Y; y++) {
+    for (int x = 0; x < FHD_HOG_BLOCKS_X; x++) {
+      float squared_sum = 1.f;
+      for (int cy = 0; cy < FHD_HOG_BLOCK_SIZE; cy++) {
+        for (int cx = 0; cx < FHD_HOG_BLOCK_SIZE; cx++) {
+          const fhd_hog_cell* cell = &cells[(y + cy) * cells_x + x + cx];
+          for (int bin = 0; bin < FHD_HOG_BINS; bin++) {
+            squared_sum += cell->bins[bin] * cell->bins[bin];
+          }
+        }
+      }
+
+      // The same operations as fhd_hog_create_features and
+      // fhd_quantize_u8_scalar
+      const float normalization_factor = 1.f / sqrtf(squared_sum);
+      int idx = FHD_HOG_BLOCK_LEN * (y * FHD_HOG_BLOCKS_X + x);
+      for (int cy = 0; cy < FHD_HOG_BLOCK_SIZE; cy++) {
+        for (int cx = 0; cx < FHD_HOG_BLOCK_SIZE; cx++) {
+          const fhd_hog_cell* cell = &cells[(y + cy) * cells_x + x + cx];
+          for (int bin = 0; bin < FHD_HOG_BINS; bin++, idx++) {
+            const float f =
+                (cell->bins[bin] * normalization_factor) * 2.f - 1.f;
+            const float v = (f + 1.f) * scales[idx];
+            out[idx] = v > 0.f ? uint8_t(lrintf(v < 127.f ? v : 127.f)) : 0;
+          }
+        }
+      }
+    }
+  }
+}
+
+static float fhd_hog_block_score(const fhd_hog_cell* cells, int x, int y,
+                                 const float* w) {
+  const int cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+  float squared_sum = 1.f;
+  float dot = 0.f;
+  for (int cy = 0; cy < FHD_HOG_BLOCK_SIZE; cy++) {
+    for (int cx = 0; cx < FHD_HOG_BLOCK_SIZE; cx++) {
+      const fhd_hog_cell* cell = &cells[(y + cy) * cells_x + x + cx];
+      for (int bin = 0; bin < FHD_HOG_BINS; bin++) {
+        const float v = cell->bins[bin];
+        squared_sum += v * v;
+        dot += *w++ * v;
+      }
+    }
+  }
+
+  return dot * (2.f / sqrtf(squared_sum));
+}
+
+float fhd_hog_score(const fhd_hog_cell* cells, const float* weights) {
+  float score = 0.f;
+  for (int y = 0; y < FHD_HOG_BLOCKS_Y; y++) {
+    for (int x = 0; x < FHD_HOG_BLOCKS_X; x++) {
+      const float* w = &weights[(y * FHD_HOG_BLOCKS_X + x) * FHD_HOG_BLOCK_LEN];
+      score += fhd_hog_block_score(cells, x, y, w);
+    }
+  }
+
+  return score;
+}
+
+float fhd_hog_blocks_score(const fhd_hog_cell* cells, const int* blocks,
+                           int num_blocks, const float* weights) {
+  float score = 0.f;
+  for (int b = 0; b < num_blocks; b++) {
+    score += fhd_hog_block_score(cells, blocks[b] % FHD_HOG_BLOCKS_X,
+                                 blocks[b] / FHD_HOG_BLOCKS_X,
+                                 &weights[b * FHD_HOG_BLOCK_LEN]);
+  }
+
+  return score;
+}
@@ -7,11 +7,21 @@ struct fhd_hog_cell {
   float bins[9];
 };
 
+// Cells [x0, x1) x [y0, y1) of a HOG window
+struct fhd_hog_cell_range {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
 struct fhd_candidate {
   int candidate_width;
   int candidate_height;
   fhd_image depth;
   fhd_image_region depth_position;
+  // Where the region was copied into depth, the rest of depth is 0
+  fhd_image_region depth_window;
 
   int num_cells;
   fhd_hog_cell* cells;
@@ -20,6 +30,8 @@ struct fhd_candidate {
   float* features;
 
   float weight;
+  // By fhd_context::cascade, cells and features are incomplete
+  bool rejected;
 };
 
 struct fhd_result {
@@ -28,5 +40,26 @@ struct fhd_result {
   float* features;
 };
 
-void fhd_hog_calculate_cells(const fhd_image* img, fhd_hog_cell* out);
+fhd_hog_cell_range fhd_hog_all_cells();
+// The cells with gradients when img is 0 outside window, the others add
+// nothing
+fhd_hog_cell_range fhd_hog_cells_in(const fhd_image_region* window);
+
+// Adds the gradients of the cells in range to out, the other cells are left
+// alone
+void fhd_hog_calculate_cells(const fhd_image* img,
+                             const fhd_hog_cell_range* range,
+                             fhd_hog_cell* out);
 void fhd_hog_create_features(const fhd_hog_cell* cells, float* features);
+// fhd_kernels::quantize_u8 of the features, written straight from the
+// normalized blocks. scales has one scale per feature.
+void fhd_hog_create_features_u8(const fhd_hog_cell* cells,
+                                const float* scales, uint8_t* out);
+// Sum over the blocks of the block's dot product with its weights, divided by
+// the norm fhd_hog_create_features normalizes it with and doubled. A linear
+// model over the features scores bias - sum(weights) plus this.
+float fhd_hog_score(const fhd_hog_cell* cells, const float* weights);
+// Same over the listed blocks only, weights holds FHD_HOG_BLOCK_LEN per listed
+// block
+float fhd_hog_blocks_score(const fhd_hog_cell* cells, const int* blocks,
+                           int num_blocks, const float* weights);
@@ -184,7 +184,8 @@ void fhd_candidate_db_add_candidate(fhd_candidate_db* db,
       (fhd_hog_cell*)calloc(candidate->num_cells, sizeof(fhd_hog_cell));
   float* features = (float*)calloc(candidate->num_features, sizeof(float));
 
-  fhd_hog_calculate_cells(&flipped_orig_depth, cells);
+  const fhd_hog_cell_range all_cells = fhd_hog_all_cells();
+  fhd_hog_calculate_cells(&flipped_orig_depth, &all_cells, cells);
   fhd_hog_create_features(cells, features);
 
   fhd_db_upsert_candidate(db, &flipped_depth, features, candidate->num_features,
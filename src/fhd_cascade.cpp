@@ -0,0 +1,128 @@
+#include "fhd_cascade.h"
+#include "fhd_config.h"
+#include "fhd_simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// File format: "fhd_hog_cascade <num_blocks> <bias> <threshold>", then a line
+// per block with its index and FHD_HOG_BLOCK_LEN weights
+
+static const int fhd_cascade_cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+static const int fhd_cascade_cells_y = FHD_HOG_HEIGHT / FHD_HOG_CELL_SIZE;
+
+// Runs of cells with covered[i] == value in each row
+static int fhd_cascade_runs(const bool* covered, bool value,
+                            fhd_hog_cell_range* out) {
+  int len = 0;
+  for (int y = 0; y < fhd_cascade_cells_y; y++) {
+    const bool* row = &covered[y * fhd_cascade_cells_x];
+    int x = 0;
+    while (x < fhd_cascade_cells_x) {
+      if (row[x] != value) {
+        x++;
+        continue;
+      }
+
+      const int x0 = x;
+      while (x < fhd_cascade_cells_x && row[x] == value) x++;
+      out[len++] = fhd_hog_cell_range{x0, y, x, y + 1};
+    }
+  }
+
+  return len;
+}
+
+fhd_cascade* fhd_cascade_create(const char* file) {
+  FILE* f = fopen(file, "r");
+  if (!f) return NULL;
+
+  const int blocks_len = FHD_HOG_BLOCKS_X * FHD_HOG_BLOCKS_Y;
+  fhd_cascade* cascade = (fhd_cascade*)calloc(1, sizeof(fhd_cascade));
+  bool ok = fscanf(f, "fhd_hog_cascade %d %f %f", &cascade->num_blocks,
+                   &cascade->bias, &cascade->threshold) == 3 &&
+            cascade->num_blocks > 0 && cascade->num_blocks <= blocks_len;
+  if (ok) {
+    cascade->blocks = (int*)calloc(cascade->num_blocks, sizeof(int));
+    cascade->weights = (float*)calloc(
+        cascade->num_blocks * FHD_HOG_BLOCK_LEN, sizeof(float));
+  }
+
+  for (int b = 0; ok && b < cascade->num_blocks; b++) {
+    ok = fscanf(f, "%d", &cascade->blocks[b]) == 1 &&
+         cascade->blocks[b] >= 0 && cascade->blocks[b] < blocks_len;
+    float* w = &cascade->weights[b * FHD_HOG_BLOCK_LEN];
+    for (int i = 0; ok && i < FHD_HOG_BLOCK_LEN; i++) {
+      ok = fscanf(f, "%f", &w[i]) == 1;
+    }
+  }
+  fclose(f);
+
+  if (!ok) {
+    fhd_cascade_destroy(cascade);
+    return NULL;
+  }
+
+  double weights_sum = 0.0;
+  for (int i = 0; i < cascade->num_blocks * FHD_HOG_BLOCK_LEN; i++) {
+    weights_sum += cascade->weights[i];
+  }
+  cascade->cells_bias = float(double(cascade->bias) - weights_sum);
+
+  bool covered[fhd_cascade_cells_x * fhd_cascade_cells_y] = {};
+  for (int b = 0; b < cascade->num_blocks; b++) {
+    const int x = cascade->blocks[b] % FHD_HOG_BLOCKS_X;
+    const int y = cascade->blocks[b] / FHD_HOG_BLOCKS_X;
+    for (int cy = 0; cy < FHD_HOG_BLOCK_SIZE; cy++) {
+      for (int cx = 0; cx < FHD_HOG_BLOCK_SIZE; cx++) {
+        covered[(y + cy) * fhd_cascade_cells_x + x + cx] = true;
+      }
+    }
+  }
+
+  // Every run has a cell, so there are at most as many as cells
+  const int max_runs = fhd_cascade_cells_x * fhd_cascade_cells_y;
+  cascade->stage_ranges =
+      (fhd_hog_cell_range*)calloc(max_runs, sizeof(fhd_hog_cell_range));
+  cascade->rest_ranges =
+      (fhd_hog_cell_range*)calloc(max_runs, sizeof(fhd_hog_cell_range));
+  cascade->stage_ranges_len =
+      fhd_cascade_runs(covered, true, cascade->stage_ranges);
+  cascade->rest_ranges_len =
+      fhd_cascade_runs(covered, false, cascade->rest_ranges);
+  cascade->kernels = fhd_default_kernels();
+  return cascade;
+}
+
+bool fhd_cascade_save(const char* file, const int* blocks, int num_blocks,
+                      const float* weights, float bias, float threshold) {
+  FILE* f = fopen(file, "w");
+  if (!f) return false;
+
+  fprintf(f, "fhd_hog_cascade %d %.9g %.9g\n", num_blocks, bias, threshold);
+  for (int b = 0; b < num_blocks; b++) {
+    fprintf(f, "%d", blocks[b]);
+    for (int i = 0; i < FHD_HOG_BLOCK_LEN; i++) {
+      fprintf(f, " %.9g", weights[b * FHD_HOG_BLOCK_LEN + i]);
+    }
+    fprintf(f, "\n");
+  }
+
+  return fclose(f) == 0;
+}
+
+float fhd_cascade_score(const fhd_cascade* cascade,
+                        const fhd_hog_cell* cells) {
+  return cascade->cells_bias +
+         cascade->kernels->hog_blocks_score(cells, cascade->blocks,
+                                            cascade->num_blocks,
+                                            cascade->weights);
+}
+
+void fhd_cascade_destroy(fhd_cascade* cascade) {
+  if (!cascade) return;
+  free(cascade->blocks);
+  free(cascade->weights);
+  free(cascade->stage_ranges);
+  free(cascade->rest_ranges);
+  free(cascade);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "fhd_candidate.h"
+
+struct fhd_kernels;
+
+// Early rejection in front of the classifier: a linear model over a few HOG
+// blocks. fhd_calculate_hog_cells calculates the cells of the blocks first and
+// skips the rest of a candidate scoring below threshold. From
+// fhd_train_cascade.
+struct fhd_cascade {
+  int num_blocks;
+  int* blocks;
+  // FHD_HOG_BLOCK_LEN weights per block over the features of the block
+  float* weights;
+  float bias;
+  float threshold;
+  // bias - sum(weights), see fhd_hog_score
+  float cells_bias;
+  // Runs of cells in a row, the ones the blocks cover and the others
+  int stage_ranges_len;
+  fhd_hog_cell_range* stage_ranges;
+  int rest_ranges_len;
+  fhd_hog_cell_range* rest_ranges;
+  // fhd_default_kernels() when created
+  const fhd_kernels* kernels;
+};
+
+fhd_cascade* fhd_cascade_create(const char* file);
+bool fhd_cascade_save(const char* file, const int* blocks, int num_blocks,
+                      const float* weights, float bias, float threshold);
+// bias plus the weights dotted with the features of the blocks, from the
+// cells the blocks cover, through kernels->hog_blocks_score
+float fhd_cascade_score(const fhd_cascade* cascade, const fhd_hog_cell* cells);
+void fhd_cascade_destroy(fhd_cascade* cascade);
@@ -1,30 +1,590 @@
 #include "fhd_classifier.h"
 #include "fhd_candidate.h"
+#include "fhd_config.h"
+#include "fhd_simd.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <fann.h>
 
-struct fhd_classifier {
+// A fully connected layer, missing connections have weight 0
+struct fhd_nn_layer {
+  int num_inputs;
+  int num_outputs;
+  // Row r holds the weights of output r, num_inputs of them starting on a
+  // cache line
+  const float** rows;
+  float* biases;
+  float steepness;
+  fann_activationfunc_enum activation;
+};
+
+struct fhd_fann_classifier {
+  fhd_classifier base;
   fann* nn;
+  const fhd_kernels* kernels;
+
+  // Layered networks whose neurons use activations below are run without
+  // FANN, layers is NULL for everything else.
+  int num_inputs;
+  int num_layers;
+  fhd_nn_layer* layers;
+  // All the weight rows, one block for the whole network
+  float* weights_storage;
+  // Two buffers of FHD_CLASSIFY_BATCH * max_outputs values the layers write
+  // their outputs to in turn
+  float* activations[2];
+  int max_outputs;
+  // bias minus the sum of the weights of a network with a single output
+  // neuron and no hidden layers, features are 2 * v - 1 of the normalized
+  // cells v
+  float cells_bias;
+
+  // int8 mode of those networks, quant_weights is NULL until it is
+  // calibrated and int8 is only used once fhd_classifier_use_int8 turns it
+  // on. Features f are stored as v = (f + 1) / 2 in [0, 127] steps of
+  // feature_max / 127 for their group, weights as [-127, 127] steps of their
+  // group's largest weight / 127.
+  bool use_int8;
+  int quant_groups;
+  float* feature_max;
+  float* quant_feature_scales;
+  // quant_feature_scales of each input
+  float* quant_input_scales;
+  int8_t* quant_weights;
+  float* quant_scales;
+  // FHD_CLASSIFY_BATCH quantized feature vectors
+  uint8_t* quant_features;
 };
 
-fhd_classifier* fhd_classifier_create(const char* nn_file) {
+static bool fhd_nn_supported(fann_activationfunc_enum activation) {
+  switch (activation) {
+    case FANN_LINEAR:
+    case FANN_LINEAR_PIECE:
+    case FANN_LINEAR_PIECE_SYMMETRIC:
+    case FANN_SIGMOID:
+    case FANN_SIGMOID_SYMMETRIC:
+    case FANN_THRESHOLD:
+    case FANN_THRESHOLD_SYMMETRIC:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Same clamping and activations as fann_run
+static float fhd_nn_activate(const fhd_nn_layer* layer, float sum) {
+  const float steepness = layer->steepness;
+  const float max_sum = 150.f / steepness;
+  sum *= steepness;
+  if (sum > max_sum) {
+    sum = max_sum;
+  } else if (sum < -max_sum) {
+    sum = -max_sum;
+  }
+
+  switch (layer->activation) {
+    case FANN_LINEAR_PIECE:
+      return sum < 0.f ? 0.f : sum > 1.f ? 1.f : sum;
+    case FANN_LINEAR_PIECE_SYMMETRIC:
+      return sum < -1.f ? -1.f : sum > 1.f ? 1.f : sum;
+    case FANN_SIGMOID:
+      return float(1.0f / (1.0f + exp(-2.0f * sum)));
+    case FANN_SIGMOID_SYMMETRIC:
+      return float(2.0f / (1.0f + exp(-2.0f * sum)) - 1.0f);
+    case FANN_THRESHOLD:
+      return sum < 0.f ? 0.f : 1.f;
+    case FANN_THRESHOLD_SYMMETRIC:
+      return sum < 0.f ? -1.f : 1.f;
+    default:
+      return sum;
+  }
+}
+
+static bool fhd_nn_check_layers(fann* nn, const unsigned int* counts,
+                                int num_layers, fhd_nn_layer* layers) {
+  for (int l = 1; l < num_layers; l++) {
+    fhd_nn_layer* layer = &layers[l - 1];
+    layer->num_inputs = int(counts[l - 1]);
+    layer->num_outputs = int(counts[l]);
+    layer->activation = fann_get_activation_function(nn, l, 0);
+    layer->steepness = fann_get_activation_steepness(nn, l, 0);
+    if (!fhd_nn_supported(layer->activation)) return false;
+
+    for (int n = 1; n < layer->num_outputs; n++) {
+      if (fann_get_activation_function(nn, l, n) != layer->activation ||
+          fann_get_activation_steepness(nn, l, n) != layer->steepness) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// NULL for classifiers of other backends
+static fhd_fann_classifier* fhd_fann_cast(const fhd_classifier* classifier) {
+  return classifier->backend == &fhd_fann_backend
+             ? (fhd_fann_classifier*)classifier
+             : NULL;
+}
+
+static bool fhd_classifier_is_linear(const fhd_fann_classifier* classifier) {
+  return classifier->layers && classifier->num_layers == 1 &&
+         classifier->layers[0].num_outputs == 1;
+}
+
+// Copies the weights out of FANN's connection array into rows, FANN numbers
+// the neurons of all layers in order with each layer's bias neuron last.
+static bool fhd_classifier_load_layers(fhd_fann_classifier* classifier) {
+  fann* nn = classifier->nn;
+  const int num_layers = int(fann_get_num_layers(nn));
+  if (fann_get_network_type(nn) != FANN_NETTYPE_LAYER || num_layers < 2) {
+    return false;
+  }
+
+  unsigned int* counts = (unsigned int*)calloc(num_layers, sizeof(int));
+  unsigned int* biases = (unsigned int*)calloc(num_layers, sizeof(int));
+  int* first_neuron = (int*)calloc(num_layers, sizeof(int));
+  fann_get_layer_array(nn, counts);
+  fann_get_bias_array(nn, biases);
+  for (int l = 1; l < num_layers; l++) {
+    first_neuron[l] = first_neuron[l - 1] + int(counts[l - 1] + biases[l - 1]);
+  }
+
+  fhd_nn_layer* layers =
+      (fhd_nn_layer*)calloc(num_layers - 1, sizeof(fhd_nn_layer));
+  if (!fhd_nn_check_layers(nn, counts, num_layers, layers)) {
+    free(layers);
+    free(counts);
+    free(biases);
+    free(first_neuron);
+    return false;
+  }
+
+  // Rows padded to whole cache lines
+  const int line_floats = 64 / sizeof(float);
+  int storage_len = line_floats;
+  int max_outputs = 0;
+  for (int l = 0; l < num_layers - 1; l++) {
+    const int stride =
+        (layers[l].num_inputs + line_floats - 1) / line_floats * line_floats;
+    storage_len += stride * layers[l].num_outputs;
+    max_outputs = std::max(max_outputs, layers[l].num_outputs);
+  }
+
+  float* storage = (float*)calloc(storage_len, sizeof(float));
+  float* row = (float*)(((uintptr_t)storage + 63) & ~(uintptr_t)63);
+  for (int l = 0; l < num_layers - 1; l++) {
+    fhd_nn_layer* layer = &layers[l];
+    const int stride =
+        (layer->num_inputs + line_floats - 1) / line_floats * line_floats;
+    layer->rows = (const float**)calloc(layer->num_outputs, sizeof(float*));
+    layer->biases = (float*)calloc(layer->num_outputs, sizeof(float));
+    for (int r = 0; r < layer->num_outputs; r++) {
+      layer->rows[r] = row;
+      row += stride;
+    }
+  }
+
+  const unsigned int num_connections = fann_get_total_connections(nn);
+  fann_connection* connections =
+      (fann_connection*)calloc(num_connections, sizeof(fann_connection));
+  fann_get_connection_array(nn, connections);
+  for (unsigned int i = 0; i < num_connections; i++) {
+    const fann_connection* c = &connections[i];
+    int l = num_layers - 1;
+    while (int(c->to_neuron) < first_neuron[l]) l--;
+
+    fhd_nn_layer* layer = &layers[l - 1];
+    const int output = int(c->to_neuron) - first_neuron[l];
+    const int input = int(c->from_neuron) - first_neuron[l - 1];
+    if (input < layer->num_inputs) {
+      ((float*)layer->rows[output])[input] = c->weight;
+    } else {
+      layer->biases[output] = c->weight;
+    }
+  }
+
+  classifier->num_inputs = int(counts[0]);
+  classifier->num_layers = num_layers - 1;
+  classifier->layers = layers;
+  classifier->weights_storage = storage;
+  classifier->max_outputs = max_outputs;
+  for (int i = 0; i < 2; i++) {
+    classifier->activations[i] =
+        (float*)calloc(FHD_CLASSIFY_BATCH * max_outputs, sizeof(float));
+  }
+
+  if (fhd_classifier_is_linear(classifier)) {
+    double weights_sum = 0.0;
+    for (int i = 0; i < layers[0].num_inputs; i++) {
+      weights_sum += layers[0].rows[0][i];
+    }
+    classifier->cells_bias = float(double(layers[0].biases[0]) - weights_sum);
+  }
+
+  free(connections);
+  free(counts);
+  free(biases);
+  free(first_neuron);
+  return true;
+}
+
+// Quantizes the weights for the features' largest values in each group
+static void fhd_classifier_quantize(fhd_fann_classifier* classifier,
+                                    const float* feature_max) {
+  const int groups = classifier->quant_groups;
+  const int len = groups * FHD_QUANT_GROUP;
+  if (!classifier->quant_weights) {
+    classifier->feature_max = (float*)calloc(groups, sizeof(float));
+    classifier->quant_feature_scales = (float*)calloc(groups, sizeof(float));
+    classifier->quant_input_scales = (float*)calloc(len, sizeof(float));
+    classifier->quant_weights = (int8_t*)calloc(len, sizeof(int8_t));
+    classifier->quant_scales = (float*)calloc(groups, sizeof(float));
+    classifier->quant_features =
+        (uint8_t*)calloc(FHD_CLASSIFY_BATCH * len, sizeof(uint8_t));
+  }
+
+  const float* weights = classifier->layers[0].rows[0];
+  const int num_inputs = classifier->num_inputs;
+  for (int g = 0; g < groups; g++) {
+    const int start = g * FHD_QUANT_GROUP;
+    const int end = std::min(start + FHD_QUANT_GROUP, num_inputs);
+    float weight_max = 0.f;
+    for (int i = start; i < end; i++) {
+      weight_max = std::max(weight_max, fabsf(weights[i]));
+    }
+    if (weight_max == 0.f) weight_max = 1.f;
+
+    const float weight_step = weight_max / 127.f;
+    for (int i = start; i < end; i++) {
+      classifier->quant_weights[i] = int8_t(lrintf(weights[i] / weight_step));
+    }
+
+    const float feature_step = feature_max[g] / 127.f;
+    classifier->feature_max[g] = feature_max[g];
+    classifier->quant_feature_scales[g] = 0.5f / feature_step;
+    for (int i = start; i < end; i++) {
+      classifier->quant_input_scales[i] = classifier->quant_feature_scales[g];
+    }
+    // f = 2 v - 1, the -1s are in cells_bias
+    classifier->quant_scales[g] = 2.f * weight_step * feature_step;
+  }
+}
+
+bool fhd_classifier_calibrate(fhd_classifier* base,
+                              const float* const* features, int len) {
+  fhd_fann_classifier* classifier = fhd_fann_cast(base);
+  if (!classifier || !fhd_classifier_is_linear(classifier)) return false;
+
+  const int num_inputs = classifier->num_inputs;
+  const int groups = (num_inputs + FHD_QUANT_GROUP - 1) / FHD_QUANT_GROUP;
+  float* feature_max = (float*)calloc(groups, sizeof(float));
+  for (int i = 0; i < len; i++) {
+    for (int j = 0; j < num_inputs; j++) {
+      float* max = &feature_max[j / FHD_QUANT_GROUP];
+      *max = std::max(*max, (features[i][j] + 1.f) * 0.5f);
+    }
+  }
+
+  for (int g = 0; g < groups; g++) {
+    if (feature_max[g] == 0.f) feature_max[g] = 1.f;
+  }
+
+  classifier->quant_groups = groups;
+  fhd_classifier_quantize(classifier, feature_max);
+  free(feature_max);
+  return true;
+}
+
+bool fhd_classifier_save_calibration(const fhd_classifier* base,
+                                     const char* file) {
+  const fhd_fann_classifier* classifier = fhd_fann_cast(base);
+  if (!classifier || !classifier->quant_weights) return false;
+
+  FILE* f = fopen(file, "w");
+  if (!f) return false;
+
+  fprintf(f, "fhd_int8_calibration %d %d\n", classifier->num_inputs,
+          classifier->quant_groups);
+  for (int g = 0; g < classifier->quant_groups; g++) {
+    fprintf(f, "%.9g\n", classifier->feature_max[g]);
+  }
+
+  fclose(f);
+  return true;
+}
+
+bool fhd_classifier_load_calibration(fhd_classifier* base,
+                                     const char* file) {
+  fhd_fann_classifier* classifier = fhd_fann_cast(base);
+  if (!classifier || !fhd_classifier_is_linear(classifier)) return false;
+
+  FILE* f = fopen(file, "r");
+  if (!f) return false;
+
+  int num_inputs = 0;
+  int groups = 0;
+  bool ok =
+      fscanf(f, "fhd_int8_calibration %d %d", &num_inputs, &groups) == 2 &&
+      num_inputs == classifier->num_inputs &&
+      groups == (num_inputs + FHD_QUANT_GROUP - 1) / FHD_QUANT_GROUP;
+  float* feature_max = (float*)calloc(ok ? groups : 0, sizeof(float));
+  for (int g = 0; ok && g < groups; g++) {
+    ok = fscanf(f, "%f", &feature_max[g]) == 1 && feature_max[g] > 0.f;
+  }
+
+  if (ok) {
+    classifier->quant_groups = groups;
+    fhd_classifier_quantize(classifier, feature_max);
+  }
+
+  free(feature_max);
+  fclose(f);
+  return ok;
+}
+
+bool fhd_classifier_use_int8(fhd_classifier* base, bool enabled) {
+  fhd_fann_classifier* classifier = fhd_fann_cast(base);
+  if (!classifier || !classifier->quant_weights) return !enabled;
+
+  classifier->use_int8 = enabled;
+  return true;
+}
+
+static fhd_classifier* fhd_fann_create(const char* nn_file) {
   fann* nn = fann_create_from_file(nn_file);
   if (nn) {
-    fhd_classifier* classifier = (fhd_classifier*)calloc(1, sizeof(fhd_classifier));
+    fhd_fann_classifier* classifier =
+        (fhd_fann_classifier*)calloc(1, sizeof(fhd_fann_classifier));
+    classifier->base.backend = &fhd_fann_backend;
     classifier->nn = nn;
-    return classifier;
+    classifier->kernels = fhd_default_kernels();
+    fhd_classifier_load_layers(classifier);
+    return &classifier->base;
   }
 
   return NULL;
 }
 
-float fhd_classify(const fhd_classifier* classifier, const fhd_candidate* candidate) {
-  float* output = fann_run(classifier->nn, candidate->features);
+// First output for up to FHD_CLASSIFY_BATCH inputs. Every layer is one dot
+// product per output and input with the activation applied as each lands,
+// the weight rows are read once per few inputs or the other way around.
+static void fhd_nn_run(const fhd_fann_classifier* classifier,
+                       const float* const* inputs, int len, float* scores) {
+  const float* layer_inputs[FHD_CLASSIFY_BATCH];
+  float sums[FHD_CLASSIFY_BATCH];
+  for (int i = 0; i < len; i++) {
+    layer_inputs[i] = inputs[i];
+  }
+
+  const fhd_kernels* kernels = classifier->kernels;
+  for (int l = 0; l < classifier->num_layers; l++) {
+    const fhd_nn_layer* layer = &classifier->layers[l];
+    float* outputs = classifier->activations[l & 1];
+    const int width = layer->num_outputs;
+    if (width >= len) {
+      for (int i = 0; i < len; i++) {
+        float* out = &outputs[i * width];
+        kernels->dot_batch(layer_inputs[i], layer->rows, width,
+                           layer->num_inputs, out);
+        for (int r = 0; r < width; r++) {
+          out[r] = fhd_nn_activate(layer, out[r] + layer->biases[r]);
+        }
+      }
+    } else {
+      for (int r = 0; r < width; r++) {
+        kernels->dot_batch(layer->rows[r], layer_inputs, len,
+                           layer->num_inputs, sums);
+        for (int i = 0; i < len; i++) {
+          outputs[i * width + r] =
+              fhd_nn_activate(layer, sums[i] + layer->biases[r]);
+        }
+      }
+    }
+
+    for (int i = 0; i < len; i++) {
+      layer_inputs[i] = &outputs[i * width];
+    }
+  }
+
+  for (int i = 0; i < len; i++) {
+    scores[i] = layer_inputs[i][0];
+  }
+}
+
+static float fhd_classify_quantized(const fhd_fann_classifier* classifier,
+                                   const uint8_t* features) {
+  const float sum =
+      classifier->cells_bias +
+      classifier->kernels->dot_u8s8(features, classifier->quant_weights,
+                                    classifier->quant_scales,
+                                    classifier->quant_groups);
+  return fhd_nn_activate(&classifier->layers[0], sum);
+}
+
+// Quantizes up to FHD_CLASSIFY_BATCH feature vectors and scores them with one
+// pass over the weights
+static void fhd_classify_quantized_batch(const fhd_fann_classifier* classifier,
+                                         const float* const* features,
+                                         int len, float* scores) {
+  const fhd_kernels* kernels = classifier->kernels;
+  const int stride = classifier->quant_groups * FHD_QUANT_GROUP;
+  const uint8_t* quantized[FHD_CLASSIFY_BATCH];
+  for (int i = 0; i < len; i++) {
+    uint8_t* out = &classifier->quant_features[i * stride];
+    kernels->quantize_u8(features[i], classifier->quant_feature_scales,
+                         classifier->num_inputs, out);
+    quantized[i] = out;
+  }
+
+  kernels->dot_u8s8_batch(quantized, len, classifier->quant_weights,
+                          classifier->quant_scales, classifier->quant_groups,
+                          scores);
+  for (int i = 0; i < len; i++) {
+    scores[i] = fhd_nn_activate(&classifier->layers[0],
+                                classifier->cells_bias + scores[i]);
+  }
+}
+
+static float fhd_fann_score(const fhd_classifier* base,
+                            const float* features, int num_features) {
+  const fhd_fann_classifier* classifier = (const fhd_fann_classifier*)base;
+  const bool native = num_features == classifier->num_inputs;
+  if (classifier->use_int8 && native) {
+    float score;
+    fhd_classify_quantized_batch(classifier, &features, 1, &score);
+    return score;
+  }
+
+  if (classifier->layers && native) {
+    float score;
+    fhd_nn_run(classifier, &features, 1, &score);
+    return score;
+  }
+
+  float* output = fann_run(classifier->nn, (fann_type*)features);
   return output[0];
 }
 
+static void fhd_fann_score_batch(const fhd_classifier* base,
+                                 const float* const* features, int len,
+                                 float* scores) {
+  const fhd_fann_classifier* classifier = (const fhd_fann_classifier*)base;
+  if (!classifier->layers) {
+    for (int i = 0; i < len; i++) {
+      scores[i] = fann_run(classifier->nn, (fann_type*)features[i])[0];
+    }
+    return;
+  }
+
+  for (int i = 0; i < len; i += FHD_CLASSIFY_BATCH) {
+    const int batch_len = std::min(len - i, FHD_CLASSIFY_BATCH);
+    if (classifier->use_int8) {
+      fhd_classify_quantized_batch(classifier, &features[i], batch_len,
+                                   &scores[i]);
+    } else {
+      fhd_nn_run(classifier, &features[i], batch_len, &scores[i]);
+    }
+  }
+}
+
+static float fhd_fann_score_cells(const fhd_classifier* base,
+                                 const fhd_hog_cell* cells) {
+  const fhd_fann_classifier* classifier = (const fhd_fann_classifier*)base;
+  const int blocks_len = FHD_HOG_BLOCKS_X * FHD_HOG_BLOCKS_Y;
+  const int num_features = blocks_len * FHD_HOG_BLOCK_LEN;
+  const fhd_nn_layer* layer = classifier->layers;
+  if (!fhd_classifier_is_linear(classifier) ||
+      layer->num_inputs != num_features) {
+    float features[num_features];
+    fhd_hog_create_features(cells, features);
+    return fhd_fann_score(base, features, num_features);
+  }
+
+  if (classifier->use_int8) {
+    classifier->kernels->hog_features_u8(cells,
+                                         classifier->quant_input_scales,
+                                         classifier->quant_features);
+    return fhd_classify_quantized(classifier, classifier->quant_features);
+  }
+
+  const float sum = classifier->cells_bias +
+                    classifier->kernels->hog_score(cells, layer->rows[0]);
+  return fhd_nn_activate(layer, sum);
+}
+
+static void fhd_fann_destroy(fhd_classifier* base) {
+  fhd_fann_classifier* classifier = (fhd_fann_classifier*)base;
+  fann_destroy(classifier->nn);
+  for (int l = 0; l < classifier->num_layers; l++) {
+    free(classifier->layers[l].rows);
+    free(classifier->layers[l].biases);
+  }
+  free(classifier->layers);
+  free(classifier->weights_storage);
+  free(classifier->activations[0]);
+  free(classifier->activations[1]);
+  free(classifier->feature_max);
+  free(classifier->quant_feature_scales);
+  free(classifier->quant_input_scales);
+  free(classifier->quant_weights);
+  free(classifier->quant_scales);
+  free(classifier->quant_features);
+  free(classifier);
+}
+
+const fhd_classifier_backend fhd_fann_backend = {
+    "fann", fhd_fann_create, fhd_fann_score, fhd_fann_score_batch,
+    fhd_fann_score_cells, fhd_fann_destroy};
+
+static const fhd_classifier_backend* const fhd_backends[] = {
+    &fhd_linear_svm_backend, &fhd_fann_backend};
+
+fhd_classifier* fhd_classifier_create(const char* file) {
+  // FANN complains about files it can't read, so it goes last
+  for (const fhd_classifier_backend* backend : fhd_backends) {
+    fhd_classifier* classifier = fhd_classifier_create_with(backend, file);
+    if (classifier) return classifier;
+  }
+
+  return NULL;
+}
+
+fhd_classifier* fhd_classifier_create_with(
+    const fhd_classifier_backend* backend, const char* file) {
+  return backend->create(file);
+}
+
+const fhd_classifier_backend* fhd_classifier_find_backend(const char* name) {
+  for (const fhd_classifier_backend* backend : fhd_backends) {
+    if (strcmp(backend->name, name) == 0) return backend;
+  }
+
+  return NULL;
+}
+
+float fhd_classify(const fhd_classifier* classifier,
+                   const fhd_candidate* candidate) {
+  return classifier->backend->score(classifier, candidate->features,
+                                    candidate->num_features);
+}
+
+void fhd_classify_batch(const fhd_classifier* classifier,
+                        const float* const* features, int len, float* scores) {
+  classifier->backend->score_batch(classifier, features, len, scores);
+}
+
+float fhd_classify_cells(const fhd_classifier* classifier,
+                         const fhd_hog_cell* cells) {
+  return classifier->backend->score_cells(classifier, cells);
+}
+
 void fhd_classifier_destroy(fhd_classifier* classifier) {
   if (classifier) {
-    fann_destroy(classifier->nn);
-    free(classifier);
+    classifier->backend->destroy(classifier);
   }
 }
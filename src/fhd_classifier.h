@@ -2,7 +2,77 @@
 
 struct fhd_candidate;
 struct fhd_classifier;
+struct fhd_hog_cell;
 
-fhd_classifier* fhd_classifier_create(const char* nn_file);
+// A kind of model. Backends embed fhd_classifier as the first member of their
+// own classifier struct.
+struct fhd_classifier_backend {
+  const char* name;
+  // NULL when file isn't a model of this backend
+  fhd_classifier* (*create)(const char* file);
+  float (*score)(const fhd_classifier* classifier, const float* features,
+                 int num_features);
+  void (*score_batch)(const fhd_classifier* classifier,
+                      const float* const* features, int len, float* scores);
+  float (*score_cells)(const fhd_classifier* classifier,
+                       const fhd_hog_cell* cells);
+  void (*destroy)(fhd_classifier* classifier);
+};
+
+struct fhd_classifier {
+  const fhd_classifier_backend* backend;
+};
+
+// FANN networks. Layered ones are copied into cache aligned weight rows and
+// run without FANN, others go through fann_run. Either way a classifier keeps
+// per-run buffers, so threads need one each.
+extern const fhd_classifier_backend fhd_fann_backend;
+// Linear SVMs from fhd_train_svm, the margin goes through the same symmetric
+// sigmoid as the FANN output neuron so scores stay in [-1, 1]
+extern const fhd_classifier_backend fhd_linear_svm_backend;
+
+// Picks the backend from the file
+fhd_classifier* fhd_classifier_create(const char* file);
+fhd_classifier* fhd_classifier_create_with(
+    const fhd_classifier_backend* backend, const char* file);
+// "fann" or "linear_svm", NULL for anything else
+const fhd_classifier_backend* fhd_classifier_find_backend(const char* name);
 float fhd_classify(const fhd_classifier* classifier, const fhd_candidate* candidate);
+// scores[i] = the score of features[i], which all have as many values as the
+// model has inputs. Linear models read their weights once for every few
+// feature vectors.
+void fhd_classify_batch(const fhd_classifier* classifier,
+                        const float* const* features, int len, float* scores);
+// Same score from the HOG cells of a window. Linear models normalize each
+// block and add its dot product with the weights as they go, without writing
+// the features.
+float fhd_classify_cells(const fhd_classifier* classifier,
+                         const fhd_hog_cell* cells);
+// int8 mode for FANN networks with no hidden layers and one output.
+// Calibration picks each feature group's scale from the largest values in
+// features (len vectors of the network's inputs). Returns false for other
+// models.
+bool fhd_classifier_calibrate(fhd_classifier* classifier,
+                              const float* const* features, int len);
+bool fhd_classifier_save_calibration(const fhd_classifier* classifier,
+                                     const char* file);
+// Calibrates with the scales of fhd_classifier_save_calibration
+bool fhd_classifier_load_calibration(fhd_classifier* classifier,
+                                     const char* file);
+// Makes fhd_classify, fhd_classify_batch and fhd_classify_cells use int8
+// weights and features once calibrated. Off by default, fhd_bench int8 shows
+// whether it pays off. Returns false when turning it on for a classifier
+// without a calibration.
+bool fhd_classifier_use_int8(fhd_classifier* classifier, bool enabled);
 void fhd_classifier_destroy(fhd_classifier* classifier);
+
+// Writes a model fhd_linear_svm_backend reads, score = weights . features +
+// bias before the sigmoid
+bool fhd_linear_svm_save(const char* file, const float* weights,
+                         int num_features, float bias);
+// Trains weights (num_features of them) and bias for fhd_linear_svm_save by
+// dual coordinate descent on the hinge loss with cost c. labels[i] is 1 for
+// humans. Returns the number of epochs it took.
+int fhd_linear_svm_train(const float* const* features, const int* labels,
+                         int len, int num_features, float c, float* weights,
+                         float* bias);
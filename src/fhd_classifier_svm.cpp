@@ -0,0 +1,184 @@
+#include "fhd_classifier.h"
+#include "fhd_candidate.h"
+#include "fhd_config.h"
+#include "fhd_simd.h"
+#include "pcg/pcg_basic.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+// File format: "fhd_linear_svm <num_features>", the bias and then one weight
+// per line
+struct fhd_linear_svm {
+  fhd_classifier base;
+  const fhd_kernels* kernels;
+  int num_features;
+  float* weights;
+  float bias;
+  // See fhd_hog_score
+  float cells_bias;
+};
+
+static float fhd_linear_svm_activate(float margin) {
+  return float(2.0f / (1.0f + exp(-2.0f * margin)) - 1.0f);
+}
+
+static fhd_classifier* fhd_linear_svm_create(const char* file) {
+  FILE* f = fopen(file, "r");
+  if (!f) return NULL;
+
+  int num_features = 0;
+  float bias = 0.f;
+  bool ok = fscanf(f, "fhd_linear_svm %d %f", &num_features, &bias) == 2 &&
+            num_features > 0;
+  float* weights = (float*)calloc(ok ? num_features : 0, sizeof(float));
+  for (int i = 0; ok && i < num_features; i++) {
+    ok = fscanf(f, "%f", &weights[i]) == 1;
+  }
+  fclose(f);
+
+  if (!ok) {
+    free(weights);
+    return NULL;
+  }
+
+  fhd_linear_svm* svm = (fhd_linear_svm*)calloc(1, sizeof(fhd_linear_svm));
+  svm->base.backend = &fhd_linear_svm_backend;
+  svm->kernels = fhd_default_kernels();
+  svm->num_features = num_features;
+  svm->weights = weights;
+  svm->bias = bias;
+
+  double weights_sum = 0.0;
+  for (int i = 0; i < num_features; i++) {
+    weights_sum += weights[i];
+  }
+  svm->cells_bias = float(double(bias) - weights_sum);
+  return &svm->base;
+}
+
+// Features of the wrong length score as not human
+static float fhd_linear_svm_score(const fhd_classifier* classifier,
+                                  const float* features, int num_features) {
+  const fhd_linear_svm* svm = (const fhd_linear_svm*)classifier;
+  if (num_features != svm->num_features) return -1.f;
+
+  const float margin =
+      svm->kernels->dot(svm->weights, features, svm->num_features) + svm->bias;
+  return fhd_linear_svm_activate(margin);
+}
+
+static void fhd_linear_svm_score_batch(const fhd_classifier* classifier,
+                                       const float* const* features, int len,
+                                       float* scores) {
+  const fhd_linear_svm* svm = (const fhd_linear_svm*)classifier;
+  svm->kernels->dot_batch(svm->weights, features, len, svm->num_features,
+                          scores);
+  for (int i = 0; i < len; i++) {
+    scores[i] = fhd_linear_svm_activate(scores[i] + svm->bias);
+  }
+}
+
+static float fhd_linear_svm_score_cells(const fhd_classifier* classifier,
+                                        const fhd_hog_cell* cells) {
+  const fhd_linear_svm* svm = (const fhd_linear_svm*)classifier;
+  const int blocks_len = FHD_HOG_BLOCKS_X * FHD_HOG_BLOCKS_Y;
+  const int num_features = blocks_len * FHD_HOG_BLOCK_LEN;
+  if (svm->num_features != num_features) {
+    float features[num_features];
+    fhd_hog_create_features(cells, features);
+    return fhd_linear_svm_score(classifier, features, num_features);
+  }
+
+  const float margin =
+      svm->cells_bias + svm->kernels->hog_score(cells, svm->weights);
+  return fhd_linear_svm_activate(margin);
+}
+
+static void fhd_linear_svm_destroy(fhd_classifier* classifier) {
+  fhd_linear_svm* svm = (fhd_linear_svm*)classifier;
+  free(svm->weights);
+  free(svm);
+}
+
+const fhd_classifier_backend fhd_linear_svm_backend = {
+    "linear_svm", fhd_linear_svm_create, fhd_linear_svm_score,
+    fhd_linear_svm_score_batch, fhd_linear_svm_score_cells,
+    fhd_linear_svm_destroy};
+
+bool fhd_linear_svm_save(const char* file, const float* weights,
+                         int num_features, float bias) {
+  FILE* f = fopen(file, "w");
+  if (!f) return false;
+
+  fprintf(f, "fhd_linear_svm %d\n%.9g\n", num_features, bias);
+  for (int i = 0; i < num_features; i++) {
+    fprintf(f, "%.9g\n", weights[i]);
+  }
+
+  return fclose(f) == 0;
+}
+
+int fhd_linear_svm_train(const float* const* features, const int* labels,
+                         int len, int num_features, float c, float* weights,
+                         float* bias) {
+  const int max_epochs = 1000;
+  const float tolerance = 0.1f;
+  const fhd_kernels* kernels = fhd_default_kernels();
+
+  float* alpha = (float*)calloc(len, sizeof(float));
+  float* diag = (float*)calloc(len, sizeof(float));
+  int* order = (int*)calloc(len, sizeof(int));
+  for (int i = 0; i < len; i++) {
+    // The bias is the weight of an extra feature that is always 1
+    diag[i] = 1.f + kernels->dot(features[i], features[i], num_features);
+    order[i] = i;
+  }
+
+  for (int j = 0; j < num_features; j++) {
+    weights[j] = 0.f;
+  }
+  *bias = 0.f;
+
+  pcg32_random_t rng;
+  pcg32_srandom_r(&rng, 42u, 54u);
+  int epoch = 1;
+  for (; epoch <= max_epochs; epoch++) {
+    for (int i = len - 1; i > 0; i--) {
+      std::swap(order[i], order[pcg32_boundedrand_r(&rng, i + 1)]);
+    }
+
+    // Spread of the projected gradient, 0 at the optimum
+    float max_pg = -1e30f;
+    float min_pg = 1e30f;
+    for (int k = 0; k < len; k++) {
+      const int i = order[k];
+      const float* x = features[i];
+      const float y = labels[i] ? 1.f : -1.f;
+      const float g =
+          y * (kernels->dot(weights, x, num_features) + *bias) - 1.f;
+      float pg = g;
+      if (alpha[i] == 0.f) pg = std::min(g, 0.f);
+      if (alpha[i] == c) pg = std::max(g, 0.f);
+      max_pg = std::max(max_pg, pg);
+      min_pg = std::min(min_pg, pg);
+      if (pg == 0.f) continue;
+
+      const float old_alpha = alpha[i];
+      alpha[i] = std::min(std::max(old_alpha - g / diag[i], 0.f), c);
+      const float step = (alpha[i] - old_alpha) * y;
+      for (int j = 0; j < num_features; j++) {
+        weights[j] += step * x[j];
+      }
+      *bias += step;
+    }
+
+    if (max_pg - min_pg < tolerance) break;
+  }
+
+  free(order);
+  free(diag);
+  free(alpha);
+  return std::min(epoch, max_epochs);
+}
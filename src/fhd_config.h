@@ -1,12 +1,24 @@
 #pragma once
 
 #define FHD_DEBUG_GRADIENTS 0
-#define FHD_PLANAR_REGIONS 0
 
 #ifndef FHD_NUM_THREADS
 #define FHD_NUM_THREADS 4
 #endif
 
+// Readings outside [FHD_DEPTH_MIN, FHD_DEPTH_MAX] mm are treated as invalid
+const int FHD_DEPTH_MIN = 500;
+const int FHD_DEPTH_MAX = 4500;
+
+// Region points are stored in chains of fixed size chunks
+const int FHD_POINT_CHUNK_CAPACITY = 128;
+// Points scored per inlier count before checking for early termination
+const int FHD_RANSAC_BLOCK = 256;
+// Feature vectors scored per pass over the classifier weights
+const int FHD_CLASSIFY_BATCH = 32;
+// Features sharing a scale in the int8 classifier
+const int FHD_QUANT_GROUP = 32;
+
 const int FHD_HOG_WIDTH = 64;
 const int FHD_HOG_HEIGHT = 128;
 const int FHD_HOG_BLOCK_SIZE = 2;  // 2x2 cells per block
@@ -1,9 +1,14 @@
 #pragma once
 
+#include "fhd_camera.h"
 #include "fhd_math.h"
 
 const float FHD_KINECT_W = 512.f;
 const float FHD_KINECT_H = 424.f;
 
+// Kinect v2 depth camera, the default for fhd_context_init
+const fhd_camera FHD_KINECT_CAMERA = {
+    FHD_KINECT_W, FHD_KINECT_H, 364.7f, 366.1f, 255.8f, 203.7f};
+
 fhd_vec2 fhd_kinect_coord_to_depth(fhd_vec3 p);
 fhd_vec3 fhd_depth_to_3d(float depth, float x, float y);
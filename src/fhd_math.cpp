@@ -1,4 +1,5 @@
 #include "fhd_math.h"
+#include "fhd_simd_kernels.h"
 #include <math.h>
 #include <float.h>
 #include <assert.h>
@@ -157,3 +158,131 @@ fhd_vec3 fhd_pcl_normal(const fhd_vec3* points, int len) {
   Eigen::Vector3f solution = A.llt().solve(b);
   return fhd_vec3_normalize(fhd_vec3{solution(0), solution(1), solution(2)});
 }
+
+void fhd_plane_moments_add(fhd_plane_moments* m, fhd_vec3 p) {
+  m->n += 1.0;
+  m->x += p.x;
+  m->y += p.y;
+  m->z += p.z;
+  m->xx += double(p.x) * p.x;
+  m->xy += double(p.x) * p.y;
+  m->yy += double(p.y) * p.y;
+  m->xz += double(p.x) * p.z;
+  m->yz += double(p.y) * p.z;
+}
+
+bool fhd_plane_moments_normal(const fhd_plane_moments* m, fhd_vec3* normal) {
+  // Cofactors of the symmetric normal equation matrix
+  // | xx xy x |
+  // | xy yy y |
+  // | x  y  n |
+  const double c00 = m->yy * m->n - m->y * m->y;
+  const double c01 = m->x * m->y - m->xy * m->n;
+  const double c02 = m->xy * m->y - m->yy * m->x;
+  const double c11 = m->xx * m->n - m->x * m->x;
+  const double c12 = m->xy * m->x - m->xx * m->y;
+  const double c22 = m->xx * m->yy - m->xy * m->xy;
+  const double det = m->xx * c00 + m->xy * c01 + m->x * c02;
+  if (m->n < 3.0 || det <= 1e-9 * m->xx * m->yy * m->n) return false;
+
+  // det > 0, the solution only needs normalizing
+  const double a = c00 * m->xz + c01 * m->yz + c02 * m->z;
+  const double b = c01 * m->xz + c11 * m->yz + c12 * m->z;
+  const double c = c02 * m->xz + c12 * m->yz + c22 * m->z;
+  const double inv_len = 1.0 / sqrt(a * a + b * b + c * c);
+  *normal =
+      fhd_vec3{float(a * inv_len), float(b * inv_len), float(c * inv_len)};
+  return true;
+}
+
+fhd_vec3 fhd_plane_normal_fallback(const fhd_vec3* points,
+                                   const int* components, int cells_x,
+                                   int idx) {
+  fhd_vec3 neighbours[9];
+  int len = 0;
+  neighbours[len++] = points[idx];
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      const int j = idx + dy * cells_x + dx;
+      if (j == idx || points[j].z <= 0.f) continue;
+      if (components[j] == components[idx]) neighbours[len++] = points[j];
+    }
+  }
+
+  return fhd_pcl_normal(neighbours, len);
+}
+
+// Same closed form as fhd_plane_moments_normal in float, with the points
+// relative to the center cell to keep the moments small. The AVX2 kernel
+// repeats these operations in the same order.
+void fhd_plane_normals_span(const fhd_vec3* points, const int* components,
+                            int cells_x, int idx, int len, fhd_vec3* normals) {
+  for (int i = idx; i < idx + len; i++) {
+    const fhd_vec3 center = points[i];
+    if (center.z <= 0.f) continue;
+
+    float n = 0.f, x = 0.f, y = 0.f, z = 0.f;
+    float xx = 0.f, xy = 0.f, yy = 0.f, xz = 0.f, yz = 0.f;
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        const int j = i + dy * cells_x + dx;
+        const bool in = points[j].z > 0.f && components[j] == components[i];
+        const float px = in ? points[j].x - center.x : 0.f;
+        const float py = in ? points[j].y - center.y : 0.f;
+        const float pz = in ? points[j].z - center.z : 0.f;
+        n += in ? 1.f : 0.f;
+        x += px;
+        y += py;
+        z += pz;
+        xx += px * px;
+        xy += px * py;
+        yy += py * py;
+        xz += px * pz;
+        yz += py * pz;
+      }
+    }
+
+    if (n < 2.f) continue;
+
+    const float c00 = yy * n - y * y;
+    const float c01 = x * y - xy * n;
+    const float c02 = xy * y - yy * x;
+    const float c11 = xx * n - x * x;
+    const float c12 = xy * x - xx * y;
+    const float c22 = xx * yy - xy * xy;
+    const float det = xx * c00 + xy * c01 + x * c02;
+    const float spread = xx + yy;
+    if (n < 3.f || !(det > FHD_PLANE_DET_EPSILON * spread * spread * n)) {
+      normals[i] = fhd_plane_normal_fallback(points, components, cells_x, i);
+      continue;
+    }
+
+    const float inv_det = 1.f / det;
+    const float a = (c00 * xz + c01 * yz + c02 * z) * inv_det;
+    const float b = (c01 * xz + c11 * yz + c12 * z) * inv_det;
+    const float c = (c02 * xz + c12 * yz + c22 * z) * inv_det + center.z -
+                    a * center.x - b * center.y;
+    const float length = sqrtf(a * a + b * b + c * c);
+    normals[i] = fhd_vec3{a / length, b / length, c / length};
+  }
+}
+
+void fhd_plane_normals_scalar(const fhd_vec3* points, const int* components,
+                              int cells_x, int cells_y, fhd_vec3* normals) {
+  for (int y = 1; y < cells_y - 1; y++) {
+    fhd_plane_normals_span(points, components, cells_x, y * cells_x + 1,
+                           cells_x - 2, normals);
+  }
+}
+
+int fhd_plane_inliers_scalar(const float* xs, const float* ys, const float* zs,
+                             int len, const fhd_plane* plane,
+                             float max_distance) {
+  int inliers = 0;
+  for (int i = 0; i < len; i++) {
+    const fhd_vec3 q = {xs[i], ys[i], zs[i]};
+    inliers += fabsf(fhd_plane_point_dist(*plane, q)) < max_distance;
+  }
+
+  return inliers;
+}
@@ -62,3 +62,22 @@ T fhd_clamp(T v, T min, T max) {
 float fhd_fast_atan2(float y, float x);
 
 fhd_vec3 fhd_pcl_normal(const fhd_vec3* points, int len);
+
+// Sums over points for the least squares fit z = ax + by + c that
+// fhd_pcl_normal solves
+struct fhd_plane_moments {
+  double n;
+  double x;
+  double y;
+  double z;
+  double xx;
+  double xy;
+  double yy;
+  double xz;
+  double yz;
+};
+
+void fhd_plane_moments_add(fhd_plane_moments* m, fhd_vec3 p);
+// Same normal as fhd_pcl_normal through a closed form solve, false when the
+// system is close to singular
+bool fhd_plane_moments_normal(const fhd_plane_moments* m, fhd_vec3* normal);
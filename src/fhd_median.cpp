@@ -0,0 +1,35 @@
+#include "fhd_median.h"
+#include "fhd_config.h"
+#include "fhd_simd_kernels.h"
+
+struct fhd_u16x1 {
+  typedef uint16_t vec;
+  static const int lanes = 1;
+  static vec load(const uint16_t* p) { return *p; }
+  static void store(uint16_t* p, vec v) { *p = v; }
+  static vec mask_range(vec v) {
+    return v >= FHD_DEPTH_MIN && v <= FHD_DEPTH_MAX ? v : 0;
+  }
+  static vec min(vec a, vec b) { return a < b ? a : b; }
+  static vec max(vec a, vec b) { return a < b ? b : a; }
+};
+
+void fhd_median16_cells_scalar(const uint16_t* src, int src_w,
+                               const fhd_index_2d* sampler, int cell_w,
+                               int cell_h, int x_begin, int x_end, int y,
+                               uint16_t* out_row) {
+  for (int x = x_begin; x < x_end; x++) {
+    fhd_median16_cells<fhd_u16x1>(src, src_w, sampler, cell_w, cell_h, x, y,
+                                  &out_row[x]);
+  }
+}
+
+void fhd_downsample_median16_scalar(const uint16_t* src, int src_w,
+                                    const fhd_index_2d* sampler, int cell_w,
+                                    int cell_h, int cells_x, int cells_y,
+                                    uint16_t* out) {
+  for (int y = 0; y < cells_y; y++) {
+    fhd_median16_cells_scalar(src, src_w, sampler, cell_w, cell_h, 0, cells_x,
+                              y, &out[y * cells_x]);
+  }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include "fhd_sampler.h"
+
+// Median of the 16 sampler positions of every cell, selected with a sorting
+// network over a row of cells at a time. Samples outside the valid depth
+// range count as 0, so src can be either a raw or a normalized frame. Gives
+// the same result as std::nth_element at index 8.
+//
+// K is a lane type with load, store, mask_range, min and max over K::lanes
+// 16 bit depth values. Each instruction set defines its own in the
+// translation unit built for it, and the templates below are static so they
+// never get shared between those units.
+
+template <typename K>
+static inline void fhd_cmp_swap(typename K::vec& a, typename K::vec& b) {
+  const typename K::vec t = K::min(a, b);
+  b = K::max(a, b);
+  a = t;
+}
+
+// 60 comparator sorting network for 16 inputs, pruned down to the comparators
+// that element 8 depends on.
+template <typename K>
+static inline typename K::vec fhd_median16_network(typename K::vec* v) {
+  fhd_cmp_swap<K>(v[0], v[13]);
+  fhd_cmp_swap<K>(v[1], v[12]);
+  fhd_cmp_swap<K>(v[2], v[15]);
+  fhd_cmp_swap<K>(v[3], v[14]);
+  fhd_cmp_swap<K>(v[4], v[8]);
+  fhd_cmp_swap<K>(v[5], v[6]);
+  fhd_cmp_swap<K>(v[7], v[11]);
+  fhd_cmp_swap<K>(v[9], v[10]);
+  fhd_cmp_swap<K>(v[0], v[5]);
+  fhd_cmp_swap<K>(v[1], v[7]);
+  fhd_cmp_swap<K>(v[2], v[9]);
+  fhd_cmp_swap<K>(v[3], v[4]);
+  fhd_cmp_swap<K>(v[6], v[13]);
+  fhd_cmp_swap<K>(v[8], v[14]);
+  fhd_cmp_swap<K>(v[10], v[15]);
+  fhd_cmp_swap<K>(v[11], v[12]);
+  fhd_cmp_swap<K>(v[0], v[1]);
+  fhd_cmp_swap<K>(v[2], v[3]);
+  fhd_cmp_swap<K>(v[4], v[5]);
+  fhd_cmp_swap<K>(v[6], v[8]);
+  fhd_cmp_swap<K>(v[7], v[9]);
+  fhd_cmp_swap<K>(v[10], v[11]);
+  fhd_cmp_swap<K>(v[12], v[13]);
+  fhd_cmp_swap<K>(v[14], v[15]);
+  v[2] = K::max(v[0], v[2]);
+  fhd_cmp_swap<K>(v[1], v[3]);
+  fhd_cmp_swap<K>(v[4], v[10]);
+  fhd_cmp_swap<K>(v[5], v[11]);
+  fhd_cmp_swap<K>(v[6], v[7]);
+  fhd_cmp_swap<K>(v[8], v[9]);
+  fhd_cmp_swap<K>(v[12], v[14]);
+  v[13] = K::min(v[13], v[15]);
+  v[2] = K::max(v[1], v[2]);
+  fhd_cmp_swap<K>(v[3], v[12]);
+  v[6] = K::max(v[4], v[6]);
+  fhd_cmp_swap<K>(v[5], v[7]);
+  fhd_cmp_swap<K>(v[8], v[10]);
+  v[9] = K::min(v[9], v[11]);
+  v[13] = K::min(v[13], v[14]);
+  v[6] = K::max(v[2], v[6]);
+  v[8] = K::max(v[5], v[8]);
+  fhd_cmp_swap<K>(v[7], v[10]);
+  v[9] = K::min(v[9], v[13]);
+  v[6] = K::max(v[3], v[6]);
+  fhd_cmp_swap<K>(v[9], v[12]);
+  v[8] = K::max(v[6], v[8]);
+  fhd_cmp_swap<K>(v[7], v[9]);
+  v[10] = K::min(v[10], v[12]);
+  v[8] = K::max(v[7], v[8]);
+  v[9] = K::min(v[9], v[10]);
+  v[8] = K::min(v[8], v[9]);
+  return v[8];
+}
+
+// Median of cells [x, x + K::lanes) in row y
+template <typename K>
+static inline void fhd_median16_cells(const uint16_t* src, int src_w,
+                                      const fhd_index_2d* sampler, int cell_w,
+                                      int cell_h, int x, int y, uint16_t* out) {
+  alignas(64) uint16_t lanes[16][K::lanes];
+  for (int s = 0; s < 16; s++) {
+    const fhd_index_2d p = sampler[s];
+    const uint16_t* row = &src[(y * cell_h + p.y) * src_w + x * cell_w + p.x];
+    for (int c = 0; c < K::lanes; c++) {
+      lanes[s][c] = row[c * cell_w];
+    }
+  }
+
+  typename K::vec v[16];
+  for (int s = 0; s < 16; s++) {
+    v[s] = K::mask_range(K::load(lanes[s]));
+  }
+
+  K::store(out, fhd_median16_network<K>(v));
+}
+
+// Cells [x_begin, x_end) of row y, one at a time
+void fhd_median16_cells_scalar(const uint16_t* src, int src_w,
+                               const fhd_index_2d* sampler, int cell_w,
+                               int cell_h, int x_begin, int x_end, int y,
+                               uint16_t* out_row);
+
+template <typename K>
+static void fhd_downsample_median16_lanes(const uint16_t* src, int src_w,
+                                          const fhd_index_2d* sampler,
+                                          int cell_w, int cell_h, int cells_x,
+                                          int cells_y, uint16_t* out) {
+  for (int y = 0; y < cells_y; y++) {
+    uint16_t* out_row = &out[y * cells_x];
+    int x = 0;
+    for (; x + K::lanes <= cells_x; x += K::lanes) {
+      fhd_median16_cells<K>(src, src_w, sampler, cell_w, cell_h, x, y,
+                            &out_row[x]);
+    }
+
+    if (x < cells_x) {
+      fhd_median16_cells_scalar(src, src_w, sampler, cell_w, cell_h, x,
+                                cells_x, y, out_row);
+    }
+  }
+}
@@ -0,0 +1,116 @@
+#include "fhd_pipeline.h"
+#include "fhd.h"
+#include "fhd_block_allocator.h"
+#include "fhd_worker_pool.h"
+#include <stdlib.h>
+#include <algorithm>
+
+struct fhd_pipeline_step {
+  fhd_pipeline* p;
+  const uint16_t* source;
+  const fhd_classifier* classifier;
+};
+
+static void fhd_pipeline_swap(fhd_pipeline* p) {
+  fhd_context* fhd = p->fhd;
+  fhd_pipeline_frame* frame = &p->frame;
+  std::swap(fhd->normalized_source, frame->normalized_source);
+  std::swap(fhd->point_allocator, frame->point_allocator);
+  std::swap(fhd->filtered_regions_len, frame->filtered_regions_len);
+  std::swap(fhd->filtered_regions, frame->filtered_regions);
+}
+
+static void fhd_pipeline_finish_frame(fhd_pipeline* p,
+                                      const fhd_classifier* classifier) {
+  fhd_pipeline_frame* frame = &p->frame;
+  fhd_run_candidate_stages(p->fhd, frame->normalized_source.data,
+                           frame->filtered_regions,
+                           frame->filtered_regions_len);
+  if (classifier) {
+    fhd_run_classifier(p->fhd, classifier);
+  }
+}
+
+// The caller may reuse source once push returns, so the frame in flight always
+// keeps its own normalized copy
+static void fhd_pipeline_start_frame(fhd_pipeline* p, const uint16_t* source) {
+  fhd_run_region_stages(p->fhd, source);
+  if (p->fhd->fuse_depth_normalization) {
+    fhd_copy_depth(p->fhd, source);
+  }
+}
+
+static void fhd_pipeline_record_latency(fhd_pipeline* p) {
+  const uint64_t cycles = fhd_rdtsc() - p->frame.start_cycles;
+  p->last_latency = cycles;
+  p->max_latency = std::max(p->max_latency, cycles);
+  p->latency.cycles += cycles;
+  p->latency.count += 1;
+  p->latency.avg_cycles = p->latency.cycles / p->latency.count;
+}
+
+void fhd_pipeline_init(fhd_pipeline* p, fhd_context* fhd,
+                       fhd_worker_pool* pool) {
+  p->fhd = fhd;
+  p->pool = pool;
+  p->in_flight = false;
+
+  fhd_pipeline_frame* frame = &p->frame;
+  fhd_image_init(&frame->normalized_source, fhd->source_w, fhd->source_h);
+  frame->point_allocator = fhd_block_allocator_create(
+      sizeof(fhd_point_chunk), fhd->point_chunks_capacity);
+  frame->filtered_regions_len = 0;
+  frame->filtered_regions =
+      (fhd_region*)calloc(fhd->filtered_regions_capacity, sizeof(fhd_region));
+  frame->start_cycles = 0;
+
+  p->latency = fhd_perf_record{0, 0, 0};
+  p->last_latency = 0;
+  p->max_latency = 0;
+}
+
+bool fhd_pipeline_push(fhd_pipeline* p, const uint16_t* source,
+                       const fhd_classifier* classifier) {
+  const uint64_t start = fhd_rdtsc();
+
+  if (!p->in_flight) {
+    fhd_pipeline_start_frame(p, source);
+    fhd_pipeline_swap(p);
+    p->frame.start_cycles = start;
+    p->in_flight = true;
+    return false;
+  }
+
+  fhd_pipeline_step step = {p, source, classifier};
+  fhd_worker_pool_run(p->pool,
+                      [](void* user, int stage) {
+                        fhd_pipeline_step* s = (fhd_pipeline_step*)user;
+                        if (stage == 0) {
+                          fhd_pipeline_start_frame(s->p, s->source);
+                        } else {
+                          fhd_pipeline_finish_frame(s->p, s->classifier);
+                        }
+                      },
+                      &step, 2);
+
+  fhd_pipeline_record_latency(p);
+  fhd_pipeline_swap(p);
+  p->frame.start_cycles = start;
+  return true;
+}
+
+bool fhd_pipeline_flush(fhd_pipeline* p, const fhd_classifier* classifier) {
+  if (!p->in_flight) return false;
+
+  fhd_pipeline_finish_frame(p, classifier);
+  fhd_pipeline_record_latency(p);
+  fhd_pipeline_swap(p);
+  p->in_flight = false;
+  return true;
+}
+
+void fhd_pipeline_destroy(fhd_pipeline* p) {
+  fhd_image_destroy(&p->frame.normalized_source);
+  fhd_block_allocator_destroy(p->frame.point_allocator);
+  free(p->frame.filtered_regions);
+}
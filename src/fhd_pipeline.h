@@ -0,0 +1,45 @@
+#pragma once
+
+#include "fhd_image.h"
+#include "fhd_perf.h"
+
+struct fhd_context;
+struct fhd_region;
+struct fhd_classifier;
+struct fhd_worker_pool;
+struct fhd_block_allocator;
+
+// Buffers handed from the region stages to the candidate stages
+struct fhd_pipeline_frame {
+  fhd_image normalized_source;
+  fhd_block_allocator* point_allocator;
+  int filtered_regions_len;
+  fhd_region* filtered_regions;
+  uint64_t start_cycles;
+};
+
+// Pipelined detection: the region stages of frame N+1 run concurrently with
+// the candidate stages (and classification) of frame N. The context's region
+// buffers are double buffered with the frame in flight.
+struct fhd_pipeline {
+  fhd_context* fhd;
+  fhd_worker_pool* pool;
+  bool in_flight;
+  fhd_pipeline_frame frame;
+
+  // cycles from pushing a frame to its candidates being ready
+  fhd_perf_record latency;
+  uint64_t last_latency;
+  uint64_t max_latency;
+};
+
+void fhd_pipeline_init(fhd_pipeline* p, fhd_context* fhd,
+                       fhd_worker_pool* pool);
+// Starts on source and completes the previously pushed frame. Returns true
+// when fhd->candidates and the region buffers hold that previous frame.
+// classifier can be NULL.
+bool fhd_pipeline_push(fhd_pipeline* p, const uint16_t* source,
+                       const fhd_classifier* classifier);
+// Completes the frame in flight, returns false if there was none
+bool fhd_pipeline_flush(fhd_pipeline* p, const fhd_classifier* classifier);
+void fhd_pipeline_destroy(fhd_pipeline* p);
@@ -1,4 +1,7 @@
 #include "fhd_segmentation.h"
+#include "fhd_worker_pool.h"
+#include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 
 // Efficient Graph Based Image Segmentation
@@ -7,92 +10,379 @@
 
 inline float threshold_value(float size, float c) { return c / size; }
 
+// Path halving, every other node on the way points at its grandparent
 int fhd_segmentation_find(fhd_segmentation* u, int x) {
-  int y = x;
-  while (y != u->nodes[y].p) {
-    y = u->nodes[y].p;
+  int* parent = u->parent;
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
   }
 
-  u->nodes[x].p = y;
-  return y;
+  return x;
+}
+
+void fhd_segmentation_find_all(fhd_segmentation* u, int* components) {
+  int* parent = u->parent;
+  for (int i = 0; i < u->num_initial_nodes; i++) {
+    const int p = parent[i];
+    // Lower nodes already point at their root
+    int root = i;
+    if (p != i) root = p < i ? parent[p] : fhd_segmentation_find(u, p);
+    parent[i] = root;
+    components[i] = root;
+  }
 }
 
 void fhd_segmentation_reset(fhd_segmentation* u) {
   u->num_nodes = u->num_initial_nodes;
   for (int i = 0; i < u->num_initial_nodes; i++) {
-    u->nodes[i].size = 1;
-    u->nodes[i].p = i;
+    u->parent[i] = i;
+    u->roots[i].size = 1;
   }
 }
 
-void fhd_segmentation_init(fhd_segmentation* u, int num_elements) {
+void fhd_segmentation_init(fhd_segmentation* u, int num_elements,
+                           int max_edges) {
   u->num_initial_nodes = num_elements;
-  u->threshold = (float*)calloc(num_elements, sizeof(float));
-  u->nodes = (fhd_seg_node*)calloc(num_elements, sizeof(fhd_seg_node));
+  u->parent = (int*)calloc(num_elements, sizeof(int));
+  u->roots = (fhd_seg_root*)calloc(num_elements, sizeof(fhd_seg_root));
+  u->edge_sort = fhd_edge_sort_radix;
+  u->edges_capacity = max_edges;
+  // fhd_edge is the larger of the two edge types
+  u->edges_scratch = calloc(max_edges, sizeof(fhd_edge));
 
   fhd_segmentation_reset(u);
 }
 
 void fhd_segmentation_destroy(fhd_segmentation* u) {
-  free(u->nodes);
-  free(u->threshold);
+  free(u->parent);
+  free(u->roots);
+  free(u->edges_scratch);
   free(u);
 }
 
-void fhd_segmentation_join(fhd_segmentation* u, int x, int y) {
-  fhd_seg_node* nodes = u->nodes;
-  if (nodes[x].rank > nodes[y].rank) {
-    nodes[y].p = x;
-    nodes[x].size += nodes[y].size;
-  } else {
-    nodes[x].p = y;
-    nodes[y].size += nodes[x].size;
+// Union by size of two roots, returns the new root. Doesn't count the join,
+// for tiles running concurrently.
+static int fhd_segmentation_link(fhd_segmentation* u, int x, int y) {
+  fhd_seg_root* roots = u->roots;
+  if (roots[x].size < roots[y].size) std::swap(x, y);
 
-    if (nodes[x].rank == nodes[y].rank) {
-      nodes[y].rank++;
-    }
-  }
+  u->parent[y] = x;
+  roots[x].size += roots[y].size;
+  return x;
+}
 
+void fhd_segmentation_join(fhd_segmentation* u, int x, int y) {
+  fhd_segmentation_link(u, x, y);
   u->num_nodes--;
 }
 
 int fhd_segmentation_size(const fhd_segmentation* u, int x) {
-  return u->nodes[x].size;
+  return u->roots[x].size;
 }
 
-void fhd_segment_graph(fhd_segmentation* u, fhd_edge* edges, int num_edges,
-                       float c, int min_size) {
-  std::sort(edges, edges + num_edges, [](const fhd_edge& a, const fhd_edge& b) {
-    return a.weight < b.weight;
-  });
+// Float bits flipped so they order like the floats as unsigned integers. NaN
+// weights (acos of normals slightly off unit length) never pass a threshold,
+// they go last.
+static uint32_t fhd_weight_key(float weight) {
+  uint32_t bits;
+  memcpy(&bits, &weight, sizeof(bits));
+  if ((bits & 0x7fffffffu) > 0x7f800000u) return 0xffffffffu;
 
-  for (int i = 0; i < u->num_initial_nodes; i++) {
-    u->threshold[i] = threshold_value(1.f, c);
-  }
+  const uint32_t mask = uint32_t(-int32_t(bits >> 31)) | 0x80000000u;
+  return bits ^ mask;
+}
 
+template <typename T>
+static void fhd_radix_sort_edges(T* edges, T* scratch, int num_edges) {
+  const int digits = 3;
+  const int radix_bits = 11;
+  const int radix = 1 << radix_bits;
+  int counts[digits][radix];
+  memset(counts, 0, sizeof(counts));
   for (int i = 0; i < num_edges; i++) {
-    fhd_edge* e = &edges[i];
+    const uint32_t key = fhd_weight_key(edges[i].weight);
+    for (int d = 0; d < digits; d++) {
+      counts[d][(key >> (radix_bits * d)) & (radix - 1)]++;
+    }
+  }
+
+  T* src = edges;
+  T* dst = scratch;
+  for (int d = 0; d < digits; d++) {
+    const int shift = radix_bits * d;
+    int* offsets = counts[d];
+
+    // Weights are small and often equal, skip digits that are the same for
+    // every edge
+    const uint32_t first = fhd_weight_key(src[0].weight);
+    if (offsets[(first >> shift) & (radix - 1)] == num_edges) continue;
+
+    int sum = 0;
+    for (int i = 0; i < radix; i++) {
+      const int count = offsets[i];
+      offsets[i] = sum;
+      sum += count;
+    }
 
-    int a = fhd_segmentation_find(u, e->a);
-    int b = fhd_segmentation_find(u, e->b);
+    for (int i = 0; i < num_edges; i++) {
+      const int digit = (fhd_weight_key(src[i].weight) >> shift) & (radix - 1);
+      dst[offsets[digit]++] = src[i];
+    }
+
+    std::swap(src, dst);
+  }
+
+  if (src != edges) {
+    memcpy(edges, src, num_edges * sizeof(T));
+  }
+}
+
+template <typename T>
+static void fhd_sort_edges(T* edges, void* scratch, int num_edges,
+                           fhd_edge_sort method) {
+  if (num_edges < 2) return;
+
+  if (method == fhd_edge_sort_radix) {
+    fhd_radix_sort_edges(edges, (T*)scratch, num_edges);
+  } else {
+    std::sort(edges, edges + num_edges, [](const T& a, const T& b) {
+      return a.weight < b.weight;
+    });
+  }
+}
+
+void fhd_sort_edges(fhd_edge* edges, fhd_edge* scratch, int num_edges,
+                    fhd_edge_sort method) {
+  fhd_sort_edges<fhd_edge>(edges, scratch, num_edges, method);
+}
+
+// Felzenszwalb over edges sorted by weight, endpoints(e, &a, &b) gives the
+// nodes of an edge. Returns the number of joins.
+template <typename T, typename F>
+static int fhd_join_below_threshold(fhd_segmentation* u, const T* edges,
+                                    int num_edges, float c, F endpoints) {
+  fhd_seg_root* roots = u->roots;
+  int joins = 0;
+  for (int i = 0; i < num_edges; i++) {
+    const T* e = &edges[i];
+    int a, b;
+    endpoints(*e, &a, &b);
+    a = fhd_segmentation_find(u, a);
+    b = fhd_segmentation_find(u, b);
 
     if (a != b) {
-      if (e->weight <= u->threshold[a] && e->weight <= u->threshold[b]) {
-        fhd_segmentation_join(u, a, b);
-        a = fhd_segmentation_find(u, a);
-        u->threshold[a] =
-            e->weight + threshold_value(float(fhd_segmentation_size(u, a)), c);
+      if (e->weight <= roots[a].threshold && e->weight <= roots[b].threshold) {
+        a = fhd_segmentation_link(u, a, b);
+        joins++;
+        roots[a].threshold =
+            e->weight + threshold_value(float(roots[a].size), c);
       }
     }
   }
 
+  return joins;
+}
+
+template <typename T, typename F>
+static void fhd_join_small(fhd_segmentation* u, const T* edges, int num_edges,
+                           int min_size, F endpoints) {
   for (int i = 0; i < num_edges; i++) {
-    fhd_edge* e = &edges[i];
-    int a = fhd_segmentation_find(u, e->a);
-    int b = fhd_segmentation_find(u, e->b);
+    int a, b;
+    endpoints(edges[i], &a, &b);
+    a = fhd_segmentation_find(u, a);
+    b = fhd_segmentation_find(u, b);
     if (a != b && (fhd_segmentation_size(u, a) < min_size ||
                    fhd_segmentation_size(u, b) < min_size)) {
       fhd_segmentation_join(u, a, b);
     }
   }
 }
+
+template <typename T, typename F>
+static void fhd_segment_sorted(fhd_segmentation* u, const T* edges,
+                               int num_edges, float c, int min_size,
+                               F endpoints) {
+  for (int i = 0; i < u->num_initial_nodes; i++) {
+    u->roots[i].threshold = threshold_value(1.f, c);
+  }
+
+  u->num_nodes -= fhd_join_below_threshold(u, edges, num_edges, c, endpoints);
+  fhd_join_small(u, edges, num_edges, min_size, endpoints);
+}
+
+// A band of rows, nodes [node_begin, node_end). Its edges are
+// [edge_begin, edge_end), the ones leading out of the band are moved to
+// [edge_mid, edge_end).
+struct fhd_seg_tile {
+  int node_begin;
+  int node_end;
+  int edge_begin;
+  int edge_mid;
+  int edge_end;
+  int joins;
+};
+
+template <typename T, typename F>
+struct fhd_tiled_segmentation {
+  fhd_segmentation* u;
+  T* edges;
+  T* scratch;
+  fhd_edge_sort method;
+  float c;
+  F endpoints;
+  fhd_seg_tile* tiles;
+
+  static void run_tile(void* user, int t) {
+    fhd_tiled_segmentation* s = (fhd_tiled_segmentation*)user;
+    fhd_seg_tile* tile = &s->tiles[t];
+    fhd_segmentation* u = s->u;
+    T* edges = s->edges;
+    T* scratch = s->scratch;
+
+    // Split the edges leaving the band off to the end, in order
+    int internal = tile->edge_begin;
+    int outgoing = tile->edge_begin;
+    for (int i = tile->edge_begin; i < tile->edge_end; i++) {
+      int a, b;
+      s->endpoints(edges[i], &a, &b);
+      if (b < tile->node_end) {
+        edges[internal++] = edges[i];
+      } else {
+        scratch[outgoing++] = edges[i];
+      }
+    }
+    tile->edge_mid = internal;
+    memcpy(&edges[internal], &scratch[tile->edge_begin],
+           (outgoing - tile->edge_begin) * sizeof(T));
+
+    fhd_sort_edges(&edges[tile->edge_begin], &scratch[tile->edge_begin],
+                   tile->edge_mid - tile->edge_begin, s->method);
+
+    for (int i = tile->node_begin; i < tile->node_end; i++) {
+      u->roots[i].threshold = threshold_value(1.f, s->c);
+    }
+
+    tile->joins = fhd_join_below_threshold(
+        u, &edges[tile->edge_begin], tile->edge_mid - tile->edge_begin, s->c,
+        s->endpoints);
+  }
+};
+
+// Bands of at least this many rows, fewer rows leave most of the work to the
+// stitching
+static const int FHD_SEG_TILE_MIN_ROWS = 8;
+static const int FHD_SEG_MAX_TILES = 64;
+
+template <typename T, typename F>
+static void fhd_segment_tiled(fhd_segmentation* u, fhd_worker_pool* pool,
+                              T* edges, int num_edges, int grid_w, float c,
+                              int min_size, F endpoints) {
+  const int grid_h = u->num_initial_nodes / grid_w;
+  int num_tiles = std::min(fhd_worker_pool_num_threads(pool),
+                           grid_h / FHD_SEG_TILE_MIN_ROWS);
+  num_tiles = std::min(num_tiles, FHD_SEG_MAX_TILES);
+  const bool fits = num_edges <= u->edges_capacity;
+  if (num_tiles < 2 || !fits) {
+    fhd_edge_sort method = fits ? u->edge_sort : fhd_edge_sort_comparison;
+    fhd_sort_edges(edges, u->edges_scratch, num_edges, method);
+    fhd_segment_sorted(u, edges, num_edges, c, min_size, endpoints);
+    return;
+  }
+
+  const int tile_rows = (grid_h + num_tiles - 1) / num_tiles;
+  num_tiles = (grid_h + tile_rows - 1) / tile_rows;
+  fhd_seg_tile tiles[FHD_SEG_MAX_TILES];
+  int edge = 0;
+  for (int t = 0; t < num_tiles; t++) {
+    fhd_seg_tile* tile = &tiles[t];
+    tile->node_begin = t * tile_rows * grid_w;
+    tile->node_end = std::min((t + 1) * tile_rows, grid_h) * grid_w;
+    tile->edge_begin = edge;
+    while (edge < num_edges) {
+      int a, b;
+      endpoints(edges[edge], &a, &b);
+      if (a >= tile->node_end) break;
+      edge++;
+    }
+    tile->edge_end = edge;
+  }
+
+  fhd_tiled_segmentation<T, F> s = {
+      u, edges, (T*)u->edges_scratch, u->edge_sort, c, endpoints, tiles};
+  fhd_worker_pool_run(pool, fhd_tiled_segmentation<T, F>::run_tile, &s,
+                      num_tiles);
+
+  // Stitch the bands together with the edges between them, the thresholds of
+  // the components on either side carry over from the bands
+  T* outgoing = (T*)u->edges_scratch;
+  int num_outgoing = 0;
+  for (int t = 0; t < num_tiles; t++) {
+    const fhd_seg_tile* tile = &tiles[t];
+    u->num_nodes -= tile->joins;
+    const int len = tile->edge_end - tile->edge_mid;
+    memcpy(&outgoing[num_outgoing], &edges[tile->edge_mid], len * sizeof(T));
+    num_outgoing += len;
+  }
+
+  const bool outgoing_fits = 2 * num_outgoing <= u->edges_capacity;
+  fhd_sort_edges(outgoing, outgoing + num_outgoing, num_outgoing,
+                 outgoing_fits ? u->edge_sort : fhd_edge_sort_comparison);
+  u->num_nodes -=
+      fhd_join_below_threshold(u, outgoing, num_outgoing, c, endpoints);
+
+  for (int t = 0; t < num_tiles; t++) {
+    const fhd_seg_tile* tile = &tiles[t];
+    fhd_join_small(u, &edges[tile->edge_begin],
+                   tile->edge_mid - tile->edge_begin, min_size, endpoints);
+  }
+  fhd_join_small(u, outgoing, num_outgoing, min_size, endpoints);
+}
+
+struct fhd_edge_endpoints {
+  void operator()(const fhd_edge& e, int* a, int* b) const {
+    *a = e.a;
+    *b = e.b;
+  }
+};
+
+struct fhd_grid_edge_endpoints {
+  int grid_w;
+  void operator()(const fhd_grid_edge& e, int* a, int* b) const {
+    *a = e.id >> 1;
+    *b = *a + ((e.id & 1) ? grid_w : 1);
+  }
+};
+
+void fhd_segment_graph(fhd_segmentation* u, fhd_edge* edges, int num_edges,
+                       float c, int min_size) {
+  fhd_edge_sort method = u->edge_sort;
+  if (num_edges > u->edges_capacity) method = fhd_edge_sort_comparison;
+  fhd_sort_edges(edges, u->edges_scratch, num_edges, method);
+
+  fhd_segment_sorted(u, edges, num_edges, c, min_size, fhd_edge_endpoints());
+}
+
+void fhd_segment_grid(fhd_segmentation* u, fhd_grid_edge* edges, int num_edges,
+                      int grid_w, float c, int min_size) {
+  fhd_edge_sort method = u->edge_sort;
+  if (num_edges > u->edges_capacity) method = fhd_edge_sort_comparison;
+  fhd_sort_edges(edges, u->edges_scratch, num_edges, method);
+
+  fhd_segment_sorted(u, edges, num_edges, c, min_size,
+                     fhd_grid_edge_endpoints{grid_w});
+}
+
+void fhd_segment_graph_tiled(fhd_segmentation* u, fhd_worker_pool* pool,
+                             fhd_edge* edges, int num_edges, int grid_w,
+                             float c, int min_size) {
+  fhd_segment_tiled(u, pool, edges, num_edges, grid_w, c, min_size,
+                    fhd_edge_endpoints());
+}
+
+void fhd_segment_grid_tiled(fhd_segmentation* u, fhd_worker_pool* pool,
+                            fhd_grid_edge* edges, int num_edges, int grid_w,
+                            float c, int min_size) {
+  fhd_segment_tiled(u, pool, edges, num_edges, grid_w, c, min_size,
+                    fhd_grid_edge_endpoints{grid_w});
+}
@@ -1,29 +1,69 @@
 #pragma once
 
+#include <stdint.h>
+
+struct fhd_worker_pool;
+
 struct fhd_edge {
   int a;
   int b;
   float weight;
 };
 
-struct fhd_seg_node {
-  int rank;
-  int p;
+// Edge of a 4-connected grid of cells, to the right of cell id / 2 for even
+// ids and below it for odd ones
+struct fhd_grid_edge {
+  int id;
+  float weight;
+};
+
+// Only valid for the root of a component
+struct fhd_seg_root {
   int size;
+  float threshold;
+};
+
+enum fhd_edge_sort {
+  fhd_edge_sort_comparison,  // std::sort, reference
+  fhd_edge_sort_radix        // LSD radix sort on the weight bits
 };
 
 struct fhd_segmentation {
   int num_initial_nodes;
   int num_nodes;
-  float* threshold;
-  fhd_seg_node* nodes;
+  int* parent;
+  fhd_seg_root* roots;
+
+  fhd_edge_sort edge_sort;
+  int edges_capacity;
+  void* edges_scratch;
 };
 
 int fhd_segmentation_find(fhd_segmentation* u, int x);
+// The component of every node, and points every node straight at it
+void fhd_segmentation_find_all(fhd_segmentation* u, int* components);
 void fhd_segmentation_reset(fhd_segmentation* u);
-void fhd_segmentation_init(fhd_segmentation* u, int num_elements);
+void fhd_segmentation_init(fhd_segmentation* u, int num_elements,
+                           int max_edges);
 void fhd_segmentation_destroy(fhd_segmentation* u);
 void fhd_segmentation_join(fhd_segmentation* u, int x, int y);
 int fhd_segmentation_size(const fhd_segmentation* u, int x);
+// Sorts by weight, scratch must hold num_edges. The radix sort is stable and
+// puts NaN weights last, std::sort leaves equal weights in any order.
+void fhd_sort_edges(fhd_edge* edges, fhd_edge* scratch, int num_edges,
+                    fhd_edge_sort method);
 void fhd_segment_graph(fhd_segmentation* u, fhd_edge* edges, int num_edges,
                        float c, int min_size);
+// Same as fhd_segment_graph, cells without edges stay on their own
+void fhd_segment_grid(fhd_segmentation* u, fhd_grid_edge* edges, int num_edges,
+                      int grid_w, float c, int min_size);
+// Segments bands of rows of a grid_w wide grid in parallel, then joins the
+// bands over the edges between them with the same threshold rule and merges
+// small components over the whole grid. Edges must be ordered by their first
+// node, as the graphs are built, and end up sorted per band.
+void fhd_segment_graph_tiled(fhd_segmentation* u, fhd_worker_pool* pool,
+                             fhd_edge* edges, int num_edges, int grid_w,
+                             float c, int min_size);
+void fhd_segment_grid_tiled(fhd_segmentation* u, fhd_worker_pool* pool,
+                            fhd_grid_edge* edges, int num_edges, int grid_w,
+                            float c, int min_size);
@@ -0,0 +1,170 @@
+#include "fhd_simd.h"
+#include "fhd_simd_kernels.h"
+#include "fhd_candidate.h"
+#include "fhd_config.h"
+#include <math.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void fhd_cpuid(int leaf, int subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int*)regs, leaf, subleaf);
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Which register states the OS saves on context switches
+static uint64_t fhd_xgetbv() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return (uint64_t(hi) << 32) | lo;
+#endif
+}
+
+static fhd_isa fhd_detect_isa() {
+  uint32_t regs[4];
+  fhd_cpuid(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+
+  fhd_cpuid(1, 0, regs);
+  const bool sse2 = (regs[3] & (1u << 26)) != 0;
+  const bool osxsave = (regs[2] & (1u << 27)) != 0;
+  const bool avx = (regs[2] & (1u << 28)) != 0;
+  if (!sse2) return fhd_isa_scalar;
+  if (!osxsave || !avx || max_leaf < 7) return fhd_isa_sse2;
+
+  const uint64_t xcr0 = fhd_xgetbv();
+  // xmm and ymm state
+  if ((xcr0 & 0x6) != 0x6) return fhd_isa_sse2;
+
+  fhd_cpuid(7, 0, regs);
+  const bool avx2 = (regs[1] & (1u << 5)) != 0;
+  const bool avx512f = (regs[1] & (1u << 16)) != 0;
+  const bool avx512bw = (regs[1] & (1u << 30)) != 0;
+  if (!avx2) return fhd_isa_sse2;
+
+  // opmask and zmm state
+  if (avx512f && avx512bw && (xcr0 & 0xe0) == 0xe0) return fhd_isa_avx512;
+
+  return fhd_isa_avx2;
+}
+
+void fhd_mask_depth_scalar(const uint16_t* src, uint16_t* dst, int len) {
+  for (int i = 0; i < len; i++) {
+    const uint16_t v = src[i];
+    dst[i] = v >= FHD_DEPTH_MIN && v <= FHD_DEPTH_MAX ? v : 0;
+  }
+}
+
+float fhd_dot_scalar(const float* a, const float* b, int len) {
+  float sum = 0.f;
+  for (int i = 0; i < len; i++) {
+    sum += a[i] * b[i];
+  }
+
+  return sum;
+}
+
+void fhd_dot_batch_scalar(const float* a, const float* const* bs, int bs_len,
+                          int len, float* out) {
+  for (int i = 0; i < bs_len; i++) {
+    out[i] = fhd_dot_scalar(a, bs[i], len);
+  }
+}
+
+void fhd_quantize_u8_scalar(const float* in, const float* scales, int len,
+                            uint8_t* out) {
+  for (int i = 0; i < len; i++) {
+    const float v = (in[i] + 1.f) * scales[i / FHD_QUANT_GROUP];
+    // NaN goes to 0 as in the SIMD conversions
+    out[i] = v > 0.f ? uint8_t(lrintf(v < 127.f ? v : 127.f)) : 0;
+  }
+}
+
+float fhd_dot_u8s8_scalar(const uint8_t* a, const int8_t* b,
+                          const float* scales, int groups) {
+  float sum = 0.f;
+  for (int g = 0; g < groups; g++) {
+    int group_sum = 0;
+    for (int i = g * FHD_QUANT_GROUP; i < (g + 1) * FHD_QUANT_GROUP; i++) {
+      group_sum += int(a[i]) * int(b[i]);
+    }
+    sum += float(group_sum) * scales[g];
+  }
+
+  return sum;
+}
+
+void fhd_dot_u8s8_batch_scalar(const uint8_t* const* as, int as_len,
+                               const int8_t* b, const float* scales,
+                               int groups, float* out) {
+  for (int i = 0; i < as_len; i++) {
+    out[i] = fhd_dot_u8s8_scalar(as[i], b, scales, groups);
+  }
+}
+
+static const fhd_kernels fhd_kernel_sets[] = {
+    {fhd_isa_scalar, fhd_mask_depth_scalar, fhd_downsample_median16_scalar,
+     fhd_hog_calculate_cells, fhd_dot_scalar, fhd_dot_batch_scalar,
+     fhd_quantize_u8_scalar, fhd_dot_u8s8_scalar, fhd_dot_u8s8_batch_scalar,
+     fhd_hog_create_features_u8, fhd_hog_score, fhd_hog_blocks_score,
+     fhd_plane_normals_scalar, fhd_plane_inliers_scalar},
+    {fhd_isa_sse2, fhd_mask_depth_sse2, fhd_downsample_median16_sse2,
+     fhd_hog_calculate_cells, fhd_dot_sse2, fhd_dot_batch_sse2,
+     fhd_quantize_u8_sse2, fhd_dot_u8s8_sse2, fhd_dot_u8s8_batch_sse2,
+     fhd_hog_create_features_u8, fhd_hog_score, fhd_hog_blocks_score,
+     fhd_plane_normals_scalar, fhd_plane_inliers_scalar},
+    {fhd_isa_avx2, fhd_mask_depth_avx2, fhd_downsample_median16_avx2,
+     fhd_hog_calculate_cells_avx2, fhd_dot_avx2, fhd_dot_batch_avx2,
+     fhd_quantize_u8_avx2, fhd_dot_u8s8_avx2, fhd_dot_u8s8_batch_avx2,
+     fhd_hog_create_features_u8_avx2, fhd_hog_score_avx2,
+     fhd_hog_blocks_score_avx2, fhd_plane_normals_avx2,
+     fhd_plane_inliers_avx2},
+    {fhd_isa_avx512, fhd_mask_depth_avx512, fhd_downsample_median16_avx512,
+     fhd_hog_calculate_cells_avx2, fhd_dot_avx512, fhd_dot_batch_avx512,
+     fhd_quantize_u8_avx2, fhd_dot_u8s8_avx512, fhd_dot_u8s8_batch_avx512,
+     fhd_hog_create_features_u8_avx2, fhd_hog_score_avx2,
+     fhd_hog_blocks_score_avx2, fhd_plane_normals_avx2,
+     fhd_plane_inliers_avx2},
+};
+
+static fhd_isa fhd_max_isa = fhd_isa_avx512;
+
+fhd_isa fhd_cpu_isa() {
+  static const fhd_isa isa = fhd_detect_isa();
+  return isa;
+}
+
+void fhd_set_max_isa(fhd_isa isa) { fhd_max_isa = isa; }
+
+const fhd_kernels* fhd_get_kernels(fhd_isa isa) {
+  const fhd_isa cpu = fhd_cpu_isa();
+  return &fhd_kernel_sets[isa < cpu ? isa : cpu];
+}
+
+const fhd_kernels* fhd_default_kernels() {
+  return fhd_get_kernels(fhd_max_isa);
+}
+
+const char* fhd_isa_name(fhd_isa isa) {
+  switch (isa) {
+    case fhd_isa_scalar:
+      return "scalar";
+    case fhd_isa_sse2:
+      return "sse2";
+    case fhd_isa_avx2:
+      return "avx2";
+    case fhd_isa_avx512:
+      return "avx512";
+  }
+
+  return "unknown";
+}
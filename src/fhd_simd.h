@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+struct fhd_image;
+struct fhd_hog_cell;
+struct fhd_hog_cell_range;
+struct fhd_index_2d;
+struct fhd_vec3;
+struct fhd_plane;
+
+enum fhd_isa { fhd_isa_scalar, fhd_isa_sse2, fhd_isa_avx2, fhd_isa_avx512 };
+
+// The hot loops of a pass, one set per instruction set. Every set gives the
+// same results as the scalar one, except dot, dot_batch, dot_u8s8,
+// dot_u8s8_batch and hog_cells which may sum in another order.
+struct fhd_kernels {
+  fhd_isa isa;
+  // dst[i] = src[i] for readings in the valid depth range, 0 otherwise
+  void (*mask_depth)(const uint16_t* src, uint16_t* dst, int len);
+  // See fhd_median.h
+  void (*median16)(const uint16_t* src, int src_w, const fhd_index_2d* sampler,
+                   int cell_w, int cell_h, int cells_x, int cells_y,
+                   uint16_t* out);
+  // Same as fhd_hog_calculate_cells
+  void (*hog_cells)(const fhd_image* img, const fhd_hog_cell_range* range,
+                    fhd_hog_cell* out);
+  float (*dot)(const float* a, const float* b, int len);
+  // out[i] = dot(a, bs[i], len), a is read once for every few bs
+  void (*dot_batch)(const float* a, const float* const* bs, int bs_len,
+                    int len, float* out);
+  // out[i] = (in[i] + 1) * scales[i / FHD_QUANT_GROUP] rounded to nearest
+  // and clamped to [0, 127]
+  void (*quantize_u8)(const float* in, const float* scales, int len,
+                      uint8_t* out);
+  // Sum over groups of FHD_QUANT_GROUP of the group's integer dot product
+  // times scales[group]
+  float (*dot_u8s8)(const uint8_t* a, const int8_t* b, const float* scales,
+                    int groups);
+  // out[i] = dot_u8s8(as[i], b, scales, groups), b is read once for every
+  // few as
+  void (*dot_u8s8_batch)(const uint8_t* const* as, int as_len,
+                         const int8_t* b, const float* scales, int groups,
+                         float* out);
+  // Same as fhd_hog_create_features_u8, may sum the block norms in another
+  // order and round a value to the other neighbouring step
+  void (*hog_features_u8)(const fhd_hog_cell* cells, const float* scales,
+                          uint8_t* out);
+  // Same as fhd_hog_score, may sum in another order
+  float (*hog_score)(const fhd_hog_cell* cells, const float* weights);
+  // Same as fhd_hog_blocks_score, may sum in another order
+  float (*hog_blocks_score)(const fhd_hog_cell* cells, const int* blocks,
+                            int num_blocks, const float* weights);
+  // Normals of the interior cells with depth, fitted to the valid cells of
+  // their 3x3 neighbourhood in the same component. Cells without a fit are
+  // left untouched.
+  void (*plane_normals)(const fhd_vec3* points, const int* components,
+                        int cells_x, int cells_y, fhd_vec3* normals);
+  // Points with |fhd_plane_point_dist| < max_distance, given as x, y and z
+  // arrays
+  int (*plane_inliers)(const float* xs, const float* ys, const float* zs,
+                       int len, const fhd_plane* plane, float max_distance);
+};
+
+// Highest level both the CPU and the OS support
+fhd_isa fhd_cpu_isa();
+// Caps the level fhd_default_kernels picks, fhd_isa_avx512 by default
+void fhd_set_max_isa(fhd_isa isa);
+// Kernels for the highest supported level up to isa
+const fhd_kernels* fhd_get_kernels(fhd_isa isa);
+// Kernels used by fhd_context_init and fhd_classifier_create
+const fhd_kernels* fhd_default_kernels();
+const char* fhd_isa_name(fhd_isa isa);
@@ -0,0 +1,596 @@
+#include "fhd_simd_kernels.h"
+#include "fhd_candidate.h"
+#include "fhd_config.h"
+#include "fhd_median.h"
+#include "fhd_math.h"
+#include <float.h>
+#include <math.h>
+#include <immintrin.h>
+
+// Built with AVX2 but not FMA, so the float math below rounds exactly like the
+// scalar code it mirrors.
+
+struct fhd_u16x16 {
+  typedef __m256i vec;
+  static const int lanes = 16;
+  static vec load(const uint16_t* p) {
+    return _mm256_load_si256((const vec*)p);
+  }
+  static void store(uint16_t* p, vec v) { _mm256_storeu_si256((vec*)p, v); }
+  static vec mask_range(vec v) {
+    const vec above =
+        _mm256_cmpgt_epi16(v, _mm256_set1_epi16(FHD_DEPTH_MIN - 1));
+    const vec below =
+        _mm256_cmpgt_epi16(_mm256_set1_epi16(FHD_DEPTH_MAX + 1), v);
+    return _mm256_and_si256(v, _mm256_and_si256(above, below));
+  }
+  static vec min(vec a, vec b) { return _mm256_min_epi16(a, b); }
+  static vec max(vec a, vec b) { return _mm256_max_epi16(a, b); }
+};
+
+void fhd_mask_depth_avx2(const uint16_t* src, uint16_t* dst, int len) {
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*)&src[i]);
+    _mm256_storeu_si256((__m256i*)&dst[i], fhd_u16x16::mask_range(v));
+  }
+
+  fhd_mask_depth_scalar(&src[i], &dst[i], len - i);
+}
+
+void fhd_downsample_median16_avx2(const uint16_t* src, int src_w,
+                                  const fhd_index_2d* sampler, int cell_w,
+                                  int cell_h, int cells_x, int cells_y,
+                                  uint16_t* out) {
+  fhd_downsample_median16_lanes<fhd_u16x16>(src, src_w, sampler, cell_w,
+                                            cell_h, cells_x, cells_y, out);
+}
+
+// Central difference in mm, 0 where either neighbour is missing
+static inline __m256 fhd_gradient8(const uint16_t* prev, const uint16_t* next) {
+  const __m256i p = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)prev));
+  const __m256i n = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)next));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i missing = _mm256_or_si256(_mm256_cmpeq_epi32(p, zero),
+                                          _mm256_cmpeq_epi32(n, zero));
+  return _mm256_cvtepi32_ps(
+      _mm256_andnot_si256(missing, _mm256_sub_epi32(n, p)));
+}
+
+// Sum of each vector in the matching lane
+static inline __m256 fhd_hsum8(const __m256* v) {
+  const __m256 s01 = _mm256_hadd_ps(v[0], v[1]);
+  const __m256 s23 = _mm256_hadd_ps(v[2], v[3]);
+  const __m256 s45 = _mm256_hadd_ps(v[4], v[5]);
+  const __m256 s67 = _mm256_hadd_ps(v[6], v[7]);
+  const __m256 s0123 = _mm256_hadd_ps(s01, s23);
+  const __m256 s4567 = _mm256_hadd_ps(s45, s67);
+  return _mm256_add_ps(_mm256_permute2f128_ps(s0123, s4567, 0x20),
+                       _mm256_permute2f128_ps(s0123, s4567, 0x31));
+}
+
+// One cell at a time, 8 pixels per step. Bins come from comparing the gradient
+// against the fhd_hog_boundaries directions instead of an arctangent, and each
+// lane keeps its own histogram with one vector per bin until the cell is done.
+// Magnitudes are summed in another order than the scalar version.
+void fhd_hog_calculate_cells_avx2(const fhd_image* img,
+                                  const fhd_hog_cell_range* range,
+                                  fhd_hog_cell* out) {
+  static_assert(FHD_HOG_CELL_SIZE == 8 && FHD_HOG_BINS == 9,
+                "8 wide cells with 9 bins expected");
+  const fhd_hog_boundaries* boundaries = fhd_hog_get_boundaries();
+  const int width = img->width;
+  const int cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+  const int half = FHD_HOG_BINS / 2;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 sign_bit = _mm256_set1_ps(-0.f);
+  const __m256 mm_per_m = _mm256_set1_ps(1000.f);
+  const __m256i half_bins = _mm256_set1_epi32(half);
+  __m256 cos_b[half];
+  __m256 sin_b[half];
+  for (int k = 0; k < half; k++) {
+    cos_b[k] = _mm256_set1_ps(boundaries->cos[k]);
+    sin_b[k] = _mm256_set1_ps(boundaries->sin[k]);
+  }
+
+  for (int cell_y = range->y0; cell_y < range->y1; cell_y++) {
+    for (int cell_x = range->x0; cell_x < range->x1; cell_x++) {
+      __m256 hist[FHD_HOG_BINS];
+      for (int b = 0; b < FHD_HOG_BINS; b++) {
+        hist[b] = zero;
+      }
+
+      for (int i = 0; i < FHD_HOG_CELL_SIZE; i++) {
+        const int y = cell_y * FHD_HOG_CELL_SIZE + i;
+        const int x = cell_x * FHD_HOG_CELL_SIZE;
+        const uint16_t* row = &img->data[(y + 1) * width + (x + 1)];
+        const __m256 dx = fhd_gradient8(row - 1, row + 1);
+        const __m256 dy = fhd_gradient8(row - width, row + width);
+
+        const __m256 grad_x = _mm256_div_ps(dx, mm_per_m);
+        const __m256 grad_y = _mm256_div_ps(dy, mm_per_m);
+        const __m256 magnitude = _mm256_sqrt_ps(_mm256_add_ps(
+            _mm256_mul_ps(grad_x, grad_x), _mm256_mul_ps(grad_y, grad_y)));
+
+        // Boundaries passed by the gradient mirrored above the x axis
+        const __m256 abs_dy = _mm256_andnot_ps(sign_bit, dy);
+        __m256i passed = _mm256_setzero_si256();
+        for (int k = 0; k < half; k++) {
+          const __m256 cross = _mm256_sub_ps(_mm256_mul_ps(cos_b[k], abs_dy),
+                                             _mm256_mul_ps(sin_b[k], dx));
+          const __m256 past = _mm256_cmp_ps(cross, zero, _CMP_GE_OQ);
+          passed = _mm256_sub_epi32(passed, _mm256_castps_si256(past));
+        }
+
+        const __m256 down = _mm256_cmp_ps(dy, zero, _CMP_LT_OQ);
+        __m256i bin = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(_mm256_add_epi32(half_bins, passed)),
+            _mm256_castsi256_ps(_mm256_sub_epi32(half_bins, passed)), down));
+        // Straight left wraps around to bin 0
+        const __m256 left = _mm256_and_ps(_mm256_cmp_ps(dy, zero, _CMP_EQ_OQ),
+                                          _mm256_cmp_ps(dx, zero, _CMP_LT_OQ));
+        bin = _mm256_andnot_si256(_mm256_castps_si256(left), bin);
+
+        for (int b = 0; b < FHD_HOG_BINS; b++) {
+          const __m256i in_bin = _mm256_cmpeq_epi32(bin, _mm256_set1_epi32(b));
+          hist[b] = _mm256_add_ps(
+              hist[b], _mm256_and_ps(_mm256_castsi256_ps(in_bin), magnitude));
+        }
+      }
+
+      float* bins = out[cell_y * cells_x + cell_x].bins;
+      _mm256_storeu_ps(bins,
+                       _mm256_add_ps(_mm256_loadu_ps(bins), fhd_hsum8(hist)));
+      alignas(32) float last[8];
+      _mm256_store_ps(last, hist[8]);
+      bins[8] += ((last[0] + last[1]) + (last[2] + last[3])) +
+                 ((last[4] + last[5]) + (last[6] + last[7]));
+    }
+  }
+}
+
+// fhd_plane_normals_span for 8 cells of a row at a time, the 3x3
+// neighbourhoods are gathered from the interleaved points
+void fhd_plane_normals_avx2(const fhd_vec3* points, const int* components,
+                            int cells_x, int cells_y, fhd_vec3* normals) {
+  const __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 epsilon = _mm256_set1_ps(FHD_PLANE_DET_EPSILON);
+
+  alignas(32) float out_x[8];
+  alignas(32) float out_y[8];
+  alignas(32) float out_z[8];
+  alignas(32) float counts[8];
+  for (int y = 1; y < cells_y - 1; y++) {
+    int x = 1;
+    for (; x + 8 <= cells_x - 1; x += 8) {
+      const int idx = y * cells_x + x;
+      const float* center = &points[idx].x;
+      const __m256 cz = _mm256_i32gather_ps(center + 2, offsets, 4);
+      const int valid =
+          _mm256_movemask_ps(_mm256_cmp_ps(cz, zero, _CMP_GT_OQ));
+      if (!valid) continue;
+
+      const __m256 cx = _mm256_i32gather_ps(center, offsets, 4);
+      const __m256 cy = _mm256_i32gather_ps(center + 1, offsets, 4);
+      const __m256i component =
+          _mm256_loadu_si256((const __m256i*)&components[idx]);
+
+      __m256 n = zero, sx = zero, sy = zero, sz = zero;
+      __m256 xx = zero, xy = zero, yy = zero, xz = zero, yz = zero;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          const int j = idx + dy * cells_x + dx;
+          const float* p = &points[j].x;
+          const __m256 qz = _mm256_i32gather_ps(p + 2, offsets, 4);
+          const __m256i same = _mm256_cmpeq_epi32(
+              _mm256_loadu_si256((const __m256i*)&components[j]), component);
+          const __m256 in = _mm256_and_ps(_mm256_cmp_ps(qz, zero, _CMP_GT_OQ),
+                                          _mm256_castsi256_ps(same));
+          const __m256 px = _mm256_and_ps(
+              in, _mm256_sub_ps(_mm256_i32gather_ps(p, offsets, 4), cx));
+          const __m256 py = _mm256_and_ps(
+              in, _mm256_sub_ps(_mm256_i32gather_ps(p + 1, offsets, 4), cy));
+          const __m256 pz = _mm256_and_ps(in, _mm256_sub_ps(qz, cz));
+          n = _mm256_add_ps(n, _mm256_and_ps(in, one));
+          sx = _mm256_add_ps(sx, px);
+          sy = _mm256_add_ps(sy, py);
+          sz = _mm256_add_ps(sz, pz);
+          xx = _mm256_add_ps(xx, _mm256_mul_ps(px, px));
+          xy = _mm256_add_ps(xy, _mm256_mul_ps(px, py));
+          yy = _mm256_add_ps(yy, _mm256_mul_ps(py, py));
+          xz = _mm256_add_ps(xz, _mm256_mul_ps(px, pz));
+          yz = _mm256_add_ps(yz, _mm256_mul_ps(py, pz));
+        }
+      }
+
+      const __m256 c00 = _mm256_sub_ps(_mm256_mul_ps(yy, n),
+                                       _mm256_mul_ps(sy, sy));
+      const __m256 c01 = _mm256_sub_ps(_mm256_mul_ps(sx, sy),
+                                       _mm256_mul_ps(xy, n));
+      const __m256 c02 = _mm256_sub_ps(_mm256_mul_ps(xy, sy),
+                                       _mm256_mul_ps(yy, sx));
+      const __m256 c11 = _mm256_sub_ps(_mm256_mul_ps(xx, n),
+                                       _mm256_mul_ps(sx, sx));
+      const __m256 c12 = _mm256_sub_ps(_mm256_mul_ps(xy, sx),
+                                       _mm256_mul_ps(xx, sy));
+      const __m256 c22 = _mm256_sub_ps(_mm256_mul_ps(xx, yy),
+                                       _mm256_mul_ps(xy, xy));
+      const __m256 det = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(xx, c00), _mm256_mul_ps(xy, c01)),
+          _mm256_mul_ps(sx, c02));
+      const __m256 spread = _mm256_add_ps(xx, yy);
+      const __m256 min_det = _mm256_mul_ps(
+          _mm256_mul_ps(_mm256_mul_ps(epsilon, spread), spread), n);
+      const int solved = _mm256_movemask_ps(
+          _mm256_and_ps(_mm256_cmp_ps(n, _mm256_set1_ps(3.f), _CMP_GE_OQ),
+                        _mm256_cmp_ps(det, min_det, _CMP_GT_OQ)));
+
+      const __m256 inv_det = _mm256_div_ps(one, det);
+      const __m256 a = _mm256_mul_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(c00, xz), _mm256_mul_ps(c01, yz)),
+              _mm256_mul_ps(c02, sz)),
+          inv_det);
+      const __m256 b = _mm256_mul_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(c01, xz), _mm256_mul_ps(c11, yz)),
+              _mm256_mul_ps(c12, sz)),
+          inv_det);
+      __m256 c = _mm256_mul_ps(
+          _mm256_add_ps(
+              _mm256_add_ps(_mm256_mul_ps(c02, xz), _mm256_mul_ps(c12, yz)),
+              _mm256_mul_ps(c22, sz)),
+          inv_det);
+      c = _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(c, cz),
+                                      _mm256_mul_ps(a, cx)),
+                        _mm256_mul_ps(b, cy));
+      const __m256 length = _mm256_sqrt_ps(_mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b)),
+          _mm256_mul_ps(c, c)));
+
+      _mm256_store_ps(out_x, _mm256_div_ps(a, length));
+      _mm256_store_ps(out_y, _mm256_div_ps(b, length));
+      _mm256_store_ps(out_z, _mm256_div_ps(c, length));
+      _mm256_store_ps(counts, n);
+      for (int i = 0; i < 8; i++) {
+        if (!(valid & (1 << i)) || counts[i] < 2.f) continue;
+
+        if (solved & (1 << i)) {
+          normals[idx + i] = fhd_vec3{out_x[i], out_y[i], out_z[i]};
+        } else {
+          normals[idx + i] =
+              fhd_plane_normal_fallback(points, components, cells_x, idx + i);
+        }
+      }
+    }
+
+    fhd_plane_normals_span(points, components, cells_x, y * cells_x + x,
+                           cells_x - 1 - x, normals);
+  }
+}
+
+int fhd_plane_inliers_avx2(const float* xs, const float* ys, const float* zs,
+                           int len, const fhd_plane* plane,
+                           float max_distance) {
+  const fhd_vec3 n = plane->n;
+  const __m256 nx = _mm256_set1_ps(n.x);
+  const __m256 ny = _mm256_set1_ps(n.y);
+  const __m256 nz = _mm256_set1_ps(n.z);
+  const __m256 d = _mm256_set1_ps(plane->d);
+  const __m256 nn = _mm256_set1_ps(fhd_vec3_dot(n, n));
+  const __m256 max_dist = _mm256_set1_ps(max_distance);
+  const __m256 sign_bit = _mm256_set1_ps(-0.f);
+
+  // Matching lanes are -1
+  __m256i counts = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    const __m256 dot = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(&xs[i])),
+                      _mm256_mul_ps(ny, _mm256_loadu_ps(&ys[i]))),
+        _mm256_mul_ps(nz, _mm256_loadu_ps(&zs[i])));
+    const __m256 dist = _mm256_div_ps(_mm256_sub_ps(dot, d), nn);
+    const __m256 inlier =
+        _mm256_cmp_ps(_mm256_andnot_ps(sign_bit, dist), max_dist, _CMP_LT_OQ);
+    counts = _mm256_sub_epi32(counts, _mm256_castps_si256(inlier));
+  }
+
+  alignas(32) int lanes[8];
+  _mm256_store_si256((__m256i*)lanes, counts);
+  int inliers = fhd_plane_inliers_scalar(&xs[i], &ys[i], &zs[i], len - i,
+                                         plane, max_distance);
+  for (int l = 0; l < 8; l++) {
+    inliers += lanes[l];
+  }
+
+  return inliers;
+}
+
+// A block row is 2 cells, 16 bins in two vectors and the last 2 bins of each
+// row paired up in a third
+static float fhd_hog_block_score_avx2(const fhd_hog_cell* cells, int x, int y,
+                                      const float* w) {
+  static_assert(FHD_HOG_BLOCK_SIZE == 2 && FHD_HOG_BINS == 9 &&
+                    sizeof(fhd_hog_cell) == FHD_HOG_BINS * sizeof(float),
+                "2x2 blocks of packed 9 bin cells expected");
+  const int cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+  const int row_len = 2 * FHD_HOG_BINS;
+  const float* top = cells[y * cells_x + x].bins;
+  const float* bottom = cells[(y + 1) * cells_x + x].bins;
+
+  const __m256 t0 = _mm256_loadu_ps(top);
+  const __m256 t1 = _mm256_loadu_ps(top + 8);
+  const __m256 b0 = _mm256_loadu_ps(bottom);
+  const __m256 b1 = _mm256_loadu_ps(bottom + 8);
+  const __m128 tail = _mm_setr_ps(top[16], top[17], bottom[16], bottom[17]);
+  const __m128 w_tail =
+      _mm_setr_ps(w[16], w[17], w[row_len + 16], w[row_len + 17]);
+
+  const __m256 squares = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(t0, t0), _mm256_mul_ps(t1, t1)),
+      _mm256_add_ps(_mm256_mul_ps(b0, b0), _mm256_mul_ps(b1, b1)));
+  const __m256 dots = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(w), t0),
+                    _mm256_mul_ps(_mm256_loadu_ps(w + 8), t1)),
+      _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(w + row_len), b0),
+                    _mm256_mul_ps(_mm256_loadu_ps(w + row_len + 8), b1)));
+
+  // Both sums at once, squares first and dots second in each step
+  const __m256 halves = _mm256_hadd_ps(squares, dots);
+  __m128 sums = _mm_add_ps(_mm256_castps256_ps128(halves),
+                           _mm256_extractf128_ps(halves, 1));
+  sums = _mm_add_ps(sums, _mm_hadd_ps(_mm_mul_ps(tail, tail),
+                                      _mm_mul_ps(w_tail, tail)));
+  sums = _mm_hadd_ps(sums, sums);
+
+  const float squared_sum = 1.f + _mm_cvtss_f32(sums);
+  const float dot = _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, 1));
+  return dot * (2.f / sqrtf(squared_sum));
+}
+
+// v * factor * scale to 8 16 bit values, the feature 2 v' - 1 of the
+// normalized value v' is shifted back by the 1 instead of adding it
+static inline __m128i fhd_feature_u8x8(__m256 v, __m256 factor,
+                                       const float* scales) {
+  const __m256 q = _mm256_mul_ps(_mm256_mul_ps(v, factor),
+                                 _mm256_loadu_ps(scales));
+  const __m256i i =
+      _mm256_cvtps_epi32(_mm256_min_ps(_mm256_set1_ps(127.f), q));
+  return _mm_packs_epi32(_mm256_castsi256_si128(i),
+                         _mm256_extracti128_si256(i, 1));
+}
+
+// Every block is the 18 bins of its top cells followed by the 18 of the
+// bottom ones, each half written as 16 bytes and 2 from the tail vector
+void fhd_hog_create_features_u8_avx2(const fhd_hog_cell* cells,
+                                     const float* scales, uint8_t* out) {
+  static_assert(FHD_HOG_BLOCK_SIZE == 2 && FHD_HOG_BINS == 9 &&
+                    sizeof(fhd_hog_cell) == FHD_HOG_BINS * sizeof(float),
+                "2x2 blocks of packed 9 bin cells expected");
+  const int cells_x = FHD_HOG_WIDTH / FHD_HOG_CELL_SIZE;
+  const int row_len = 2 * FHD_HOG_BINS;
+  for (int y = 0; y < FHD_HOG_BLOCKS_Y; y++) {
+    for (int x = 0; x < FHD_HOG_BLOCKS_X; x++) {
+      const int offset = (y * FHD_HOG_BLOCKS_X + x) * FHD_HOG_BLOCK_LEN;
+      const float* s = &scales[offset];
+      uint8_t* o = &out[offset];
+      const float* top = cells[y * cells_x + x].bins;
+      const float* bottom = cells[(y + 1) * cells_x + x].bins;
+
+      const __m256 t0 = _mm256_loadu_ps(top);
+      const __m256 t1 = _mm256_loadu_ps(top + 8);
+      const __m256 b0 = _mm256_loadu_ps(bottom);
+      const __m256 b1 = _mm256_loadu_ps(bottom + 8);
+      const __m128 tail = _mm_setr_ps(top[16], top[17], bottom[16], bottom[17]);
+
+      const __m256 squares = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(t0, t0), _mm256_mul_ps(t1, t1)),
+          _mm256_add_ps(_mm256_mul_ps(b0, b0), _mm256_mul_ps(b1, b1)));
+      __m128 sum = _mm_add_ps(_mm256_castps256_ps128(squares),
+                              _mm256_extractf128_ps(squares, 1));
+      sum = _mm_add_ps(sum, _mm_mul_ps(tail, tail));
+      sum = _mm_hadd_ps(sum, sum);
+      sum = _mm_hadd_ps(sum, sum);
+      const __m128 norm = _mm_sqrt_ss(_mm_add_ss(_mm_set_ss(1.f), sum));
+      const __m256 factor = _mm256_broadcastss_ps(
+          _mm_div_ss(_mm_set_ss(2.f), norm));
+
+      _mm_storeu_si128((__m128i*)o,
+                       _mm_packus_epi16(fhd_feature_u8x8(t0, factor, s),
+                                        fhd_feature_u8x8(t1, factor, s + 8)));
+      _mm_storeu_si128(
+          (__m128i*)(o + row_len),
+          _mm_packus_epi16(fhd_feature_u8x8(b0, factor, s + row_len),
+                           fhd_feature_u8x8(b1, factor, s + row_len + 8)));
+
+      const __m128 tail_scales =
+          _mm_setr_ps(s[16], s[17], s[row_len + 16], s[row_len + 17]);
+      const __m128 q = _mm_mul_ps(
+          _mm_mul_ps(tail, _mm256_castps256_ps128(factor)), tail_scales);
+      const __m128i i = _mm_cvtps_epi32(_mm_min_ps(_mm_set1_ps(127.f), q));
+      const uint32_t bytes = uint32_t(_mm_cvtsi128_si32(
+          _mm_packus_epi16(_mm_packs_epi32(i, i), _mm_setzero_si128())));
+      o[16] = uint8_t(bytes);
+      o[17] = uint8_t(bytes >> 8);
+      o[row_len + 16] = uint8_t(bytes >> 16);
+      o[row_len + 17] = uint8_t(bytes >> 24);
+    }
+  }
+}
+
+float fhd_hog_score_avx2(const fhd_hog_cell* cells, const float* weights) {
+  float score = 0.f;
+  for (int y = 0; y < FHD_HOG_BLOCKS_Y; y++) {
+    for (int x = 0; x < FHD_HOG_BLOCKS_X; x++) {
+      const float* w = &weights[(y * FHD_HOG_BLOCKS_X + x) * FHD_HOG_BLOCK_LEN];
+      score += fhd_hog_block_score_avx2(cells, x, y, w);
+    }
+  }
+
+  return score;
+}
+
+float fhd_hog_blocks_score_avx2(const fhd_hog_cell* cells, const int* blocks,
+                                int num_blocks, const float* weights) {
+  float score = 0.f;
+  for (int b = 0; b < num_blocks; b++) {
+    score += fhd_hog_block_score_avx2(cells, blocks[b] % FHD_HOG_BLOCKS_X,
+                                      blocks[b] / FHD_HOG_BLOCKS_X,
+                                      &weights[b * FHD_HOG_BLOCK_LEN]);
+  }
+
+  return score;
+}
+
+static float fhd_dot_reduce(__m256 sum) {
+  __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum),
+                           _mm256_extractf128_ps(sum, 1));
+  sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+  sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+  return _mm_cvtss_f32(sum4);
+}
+
+float fhd_dot_avx2(const float* a, const float* b, int len) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= len; i += 16) {
+    sum0 = _mm256_add_ps(
+        sum0, _mm256_mul_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i])));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(&a[i + 8]),
+                                             _mm256_loadu_ps(&b[i + 8])));
+  }
+
+  return fhd_dot_reduce(_mm256_add_ps(sum0, sum1)) +
+         fhd_dot_scalar(&a[i], &b[i], len - i);
+}
+
+// The two sums of fhd_dot_avx2 for one of the bs of fhd_dot_batch_avx2
+struct fhd_dot_sums_avx2 {
+  __m256 sum0;
+  __m256 sum1;
+
+  fhd_dot_sums_avx2() : sum0(_mm256_setzero_ps()), sum1(_mm256_setzero_ps()) {}
+  void add(__m256 a0, __m256 a1, const float* b) {
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(a0, _mm256_loadu_ps(b)));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(a1, _mm256_loadu_ps(b + 8)));
+  }
+  float finish(const float* a, const float* b, int len) const {
+    return fhd_dot_reduce(_mm256_add_ps(sum0, sum1)) +
+           fhd_dot_scalar(a, b, len);
+  }
+};
+
+void fhd_dot_batch_avx2(const float* a, const float* const* bs, int bs_len,
+                        int len, float* out) {
+  int j = 0;
+  for (; j + 4 <= bs_len; j += 4) {
+    const float* b0 = bs[j];
+    const float* b1 = bs[j + 1];
+    const float* b2 = bs[j + 2];
+    const float* b3 = bs[j + 3];
+    fhd_dot_sums_avx2 s0, s1, s2, s3;
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+      const __m256 a0 = _mm256_loadu_ps(&a[i]);
+      const __m256 a1 = _mm256_loadu_ps(&a[i + 8]);
+      s0.add(a0, a1, &b0[i]);
+      s1.add(a0, a1, &b1[i]);
+      s2.add(a0, a1, &b2[i]);
+      s3.add(a0, a1, &b3[i]);
+    }
+
+    out[j] = s0.finish(&a[i], &b0[i], len - i);
+    out[j + 1] = s1.finish(&a[i], &b1[i], len - i);
+    out[j + 2] = s2.finish(&a[i], &b2[i], len - i);
+    out[j + 3] = s3.finish(&a[i], &b3[i], len - i);
+  }
+
+  for (; j < bs_len; j++) {
+    out[j] = fhd_dot_avx2(a, bs[j], len);
+  }
+}
+
+// NaN passes min and converts to 0x80000000, which packs to 0 as in the
+// scalar code
+static __m256i fhd_quantize8(const float* in, __m256 one, __m256 scale,
+                             __m256 max) {
+  const __m256 v = _mm256_add_ps(_mm256_loadu_ps(in), one);
+  return _mm256_cvtps_epi32(_mm256_min_ps(max, _mm256_mul_ps(v, scale)));
+}
+
+void fhd_quantize_u8_avx2(const float* in, const float* scales, int len,
+                          uint8_t* out) {
+  static_assert(FHD_QUANT_GROUP == 32, "one vector of bytes per group");
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 max = _mm256_set1_ps(127.f);
+  // packs and packus interleave the 128 bit lanes
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int i = 0;
+  for (; i + FHD_QUANT_GROUP <= len; i += FHD_QUANT_GROUP) {
+    const __m256 scale = _mm256_set1_ps(scales[i / FHD_QUANT_GROUP]);
+    const __m256i q0 = fhd_quantize8(&in[i], one, scale, max);
+    const __m256i q1 = fhd_quantize8(&in[i + 8], one, scale, max);
+    const __m256i q2 = fhd_quantize8(&in[i + 16], one, scale, max);
+    const __m256i q3 = fhd_quantize8(&in[i + 24], one, scale, max);
+    const __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(q0, q1),
+                                              _mm256_packs_epi32(q2, q3));
+    _mm256_storeu_si256((__m256i*)&out[i],
+                        _mm256_permutevar8x32_epi32(bytes, order));
+  }
+
+  fhd_quantize_u8_scalar(&in[i], &scales[i / FHD_QUANT_GROUP], len - i,
+                         &out[i]);
+}
+
+float fhd_dot_u8s8_avx2(const uint8_t* a, const int8_t* b,
+                        const float* scales, int groups) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256 sum = _mm256_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    // a is at most 127, so pairs of products fit in 16 bits
+    const __m256i pairs = _mm256_maddubs_epi16(
+        _mm256_loadu_si256((const __m256i*)&a[g * FHD_QUANT_GROUP]),
+        _mm256_loadu_si256((const __m256i*)&b[g * FHD_QUANT_GROUP]));
+    const __m256 group = _mm256_cvtepi32_ps(_mm256_madd_epi16(pairs, ones));
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(group, _mm256_set1_ps(scales[g])));
+  }
+
+  return fhd_dot_reduce(sum);
+}
+
+void fhd_dot_u8s8_batch_avx2(const uint8_t* const* as, int as_len,
+                             const int8_t* b, const float* scales, int groups,
+                             float* out) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  int j = 0;
+  for (; j + 4 <= as_len; j += 4) {
+    __m256 sums[4];
+    for (int k = 0; k < 4; k++) {
+      sums[k] = _mm256_setzero_ps();
+    }
+
+    for (int g = 0; g < groups; g++) {
+      const int i = g * FHD_QUANT_GROUP;
+      const __m256i bv = _mm256_loadu_si256((const __m256i*)&b[i]);
+      const __m256 scale = _mm256_set1_ps(scales[g]);
+      for (int k = 0; k < 4; k++) {
+        const __m256i pairs = _mm256_maddubs_epi16(
+            _mm256_loadu_si256((const __m256i*)&as[j + k][i]), bv);
+        const __m256 group =
+            _mm256_cvtepi32_ps(_mm256_madd_epi16(pairs, ones));
+        sums[k] = _mm256_add_ps(sums[k], _mm256_mul_ps(group, scale));
+      }
+    }
+
+    for (int k = 0; k < 4; k++) {
+      out[j + k] = fhd_dot_reduce(sums[k]);
+    }
+  }
+
+  for (; j < as_len; j++) {
+    out[j] = fhd_dot_u8s8_avx2(as[j], b, scales, groups);
+  }
+}
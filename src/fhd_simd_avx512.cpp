@@ -0,0 +1,193 @@
+#include "fhd_simd_kernels.h"
+#include "fhd_config.h"
+#include "fhd_median.h"
+#include <immintrin.h>
+
+// Needs AVX-512F and AVX-512BW for the 16 bit lanes
+
+struct fhd_u16x32 {
+  typedef __m512i vec;
+  static const int lanes = 32;
+  static vec load(const uint16_t* p) { return _mm512_load_si512(p); }
+  static void store(uint16_t* p, vec v) { _mm512_storeu_si512(p, v); }
+  static vec mask_range(vec v) {
+    const __mmask32 above =
+        _mm512_cmpgt_epi16_mask(v, _mm512_set1_epi16(FHD_DEPTH_MIN - 1));
+    const __mmask32 below =
+        _mm512_cmplt_epi16_mask(v, _mm512_set1_epi16(FHD_DEPTH_MAX + 1));
+    return _mm512_maskz_mov_epi16(above & below, v);
+  }
+  static vec min(vec a, vec b) { return _mm512_min_epi16(a, b); }
+  static vec max(vec a, vec b) { return _mm512_max_epi16(a, b); }
+};
+
+void fhd_mask_depth_avx512(const uint16_t* src, uint16_t* dst, int len) {
+  int i = 0;
+  for (; i + 32 <= len; i += 32) {
+    const __m512i v = _mm512_loadu_si512(&src[i]);
+    _mm512_storeu_si512(&dst[i], fhd_u16x32::mask_range(v));
+  }
+
+  fhd_mask_depth_scalar(&src[i], &dst[i], len - i);
+}
+
+void fhd_downsample_median16_avx512(const uint16_t* src, int src_w,
+                                    const fhd_index_2d* sampler, int cell_w,
+                                    int cell_h, int cells_x, int cells_y,
+                                    uint16_t* out) {
+  fhd_downsample_median16_lanes<fhd_u16x32>(src, src_w, sampler, cell_w,
+                                            cell_h, cells_x, cells_y, out);
+}
+
+float fhd_dot_avx512(const float* a, const float* b, int len) {
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 32 <= len; i += 32) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(&a[i]), _mm512_loadu_ps(&b[i]),
+                           sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(&a[i + 16]),
+                           _mm512_loadu_ps(&b[i + 16]), sum1);
+  }
+
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, _mm512_add_ps(sum0, sum1));
+  float sum = fhd_dot_scalar(&a[i], &b[i], len - i);
+  for (int l = 0; l < 16; l++) {
+    sum += lanes[l];
+  }
+
+  return sum;
+}
+
+// The two sums of fhd_dot_avx512 for one of the bs of fhd_dot_batch_avx512
+struct fhd_dot_sums_avx512 {
+  __m512 sum0;
+  __m512 sum1;
+
+  fhd_dot_sums_avx512()
+      : sum0(_mm512_setzero_ps()), sum1(_mm512_setzero_ps()) {}
+  void add(__m512 a0, __m512 a1, const float* b) {
+    sum0 = _mm512_fmadd_ps(a0, _mm512_loadu_ps(b), sum0);
+    sum1 = _mm512_fmadd_ps(a1, _mm512_loadu_ps(b + 16), sum1);
+  }
+  float finish(const float* a, const float* b, int len) const {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(sum0, sum1));
+    float sum = fhd_dot_scalar(a, b, len);
+    for (int l = 0; l < 16; l++) {
+      sum += lanes[l];
+    }
+
+    return sum;
+  }
+};
+
+void fhd_dot_batch_avx512(const float* a, const float* const* bs, int bs_len,
+                          int len, float* out) {
+  int j = 0;
+  for (; j + 4 <= bs_len; j += 4) {
+    const float* b0 = bs[j];
+    const float* b1 = bs[j + 1];
+    const float* b2 = bs[j + 2];
+    const float* b3 = bs[j + 3];
+    fhd_dot_sums_avx512 s0, s1, s2, s3;
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+      const __m512 a0 = _mm512_loadu_ps(&a[i]);
+      const __m512 a1 = _mm512_loadu_ps(&a[i + 16]);
+      s0.add(a0, a1, &b0[i]);
+      s1.add(a0, a1, &b1[i]);
+      s2.add(a0, a1, &b2[i]);
+      s3.add(a0, a1, &b3[i]);
+    }
+
+    out[j] = s0.finish(&a[i], &b0[i], len - i);
+    out[j + 1] = s1.finish(&a[i], &b1[i], len - i);
+    out[j + 2] = s2.finish(&a[i], &b2[i], len - i);
+    out[j + 3] = s3.finish(&a[i], &b3[i], len - i);
+  }
+
+  for (; j < bs_len; j++) {
+    out[j] = fhd_dot_avx512(a, bs[j], len);
+  }
+}
+
+// Scales of groups g and g + 1 in the low and high halves
+static inline __m512 fhd_scale_pair(const float* scales, int g) {
+  return _mm512_mask_broadcastss_ps(_mm512_set1_ps(scales[g]), 0xff00,
+                                    _mm_set_ss(scales[g + 1]));
+}
+
+// Two groups per vector, an odd last group takes a 256 bit step
+float fhd_dot_u8s8_avx512(const uint8_t* a, const int8_t* b,
+                          const float* scales, int groups) {
+  static_assert(FHD_QUANT_GROUP == 32, "two groups per vector of bytes");
+  const __m512i ones = _mm512_set1_epi16(1);
+  __m512 sum = _mm512_setzero_ps();
+  int g = 0;
+  for (; g + 2 <= groups; g += 2) {
+    const int i = g * FHD_QUANT_GROUP;
+    // a is at most 127, so pairs of products fit in 16 bits
+    const __m512i pairs = _mm512_maddubs_epi16(_mm512_loadu_si512(&a[i]),
+                                               _mm512_loadu_si512(&b[i]));
+    const __m512 group = _mm512_cvtepi32_ps(_mm512_madd_epi16(pairs, ones));
+    sum = _mm512_fmadd_ps(group, fhd_scale_pair(scales, g), sum);
+  }
+
+  float total = _mm512_reduce_add_ps(sum);
+  if (g < groups) {
+    const int i = g * FHD_QUANT_GROUP;
+    const __m256i pairs = _mm256_maddubs_epi16(
+        _mm256_loadu_si256((const __m256i*)&a[i]),
+        _mm256_loadu_si256((const __m256i*)&b[i]));
+    const __m256i group = _mm256_madd_epi16(pairs, _mm256_set1_epi16(1));
+    alignas(32) int lanes[8];
+    _mm256_store_si256((__m256i*)lanes, group);
+    int group_sum = 0;
+    for (int l = 0; l < 8; l++) {
+      group_sum += lanes[l];
+    }
+    total += float(group_sum) * scales[g];
+  }
+
+  return total;
+}
+
+void fhd_dot_u8s8_batch_avx512(const uint8_t* const* as, int as_len,
+                               const int8_t* b, const float* scales,
+                               int groups, float* out) {
+  const __m512i ones = _mm512_set1_epi16(1);
+  const int pairs_len = groups & ~1;
+  int j = 0;
+  for (; j + 4 <= as_len; j += 4) {
+    __m512 sums[4];
+    for (int k = 0; k < 4; k++) {
+      sums[k] = _mm512_setzero_ps();
+    }
+
+    for (int g = 0; g < pairs_len; g += 2) {
+      const int i = g * FHD_QUANT_GROUP;
+      const __m512i bv = _mm512_loadu_si512(&b[i]);
+      const __m512 scale = fhd_scale_pair(scales, g);
+      for (int k = 0; k < 4; k++) {
+        const __m512i pairs =
+            _mm512_maddubs_epi16(_mm512_loadu_si512(&as[j + k][i]), bv);
+        const __m512 group =
+            _mm512_cvtepi32_ps(_mm512_madd_epi16(pairs, ones));
+        sums[k] = _mm512_fmadd_ps(group, scale, sums[k]);
+      }
+    }
+
+    for (int k = 0; k < 4; k++) {
+      const int i = pairs_len * FHD_QUANT_GROUP;
+      out[j + k] = _mm512_reduce_add_ps(sums[k]) +
+                   fhd_dot_u8s8_avx512(&as[j + k][i], &b[i],
+                                       &scales[pairs_len], groups - pairs_len);
+    }
+  }
+
+  for (; j < as_len; j++) {
+    out[j] = fhd_dot_u8s8_avx512(as[j], b, scales, groups);
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "fhd_simd.h"
+#include "fhd_config.h"
+
+// Implementations behind fhd_kernels. Each instruction set lives in its own
+// translation unit built with that instruction set enabled, so nothing here
+// may be called before checking fhd_cpu_isa.
+
+void fhd_mask_depth_scalar(const uint16_t* src, uint16_t* dst, int len);
+void fhd_mask_depth_sse2(const uint16_t* src, uint16_t* dst, int len);
+void fhd_mask_depth_avx2(const uint16_t* src, uint16_t* dst, int len);
+void fhd_mask_depth_avx512(const uint16_t* src, uint16_t* dst, int len);
+
+void fhd_downsample_median16_scalar(const uint16_t* src, int src_w,
+                                    const fhd_index_2d* sampler, int cell_w,
+                                    int cell_h, int cells_x, int cells_y,
+                                    uint16_t* out);
+void fhd_downsample_median16_sse2(const uint16_t* src, int src_w,
+                                  const fhd_index_2d* sampler, int cell_w,
+                                  int cell_h, int cells_x, int cells_y,
+                                  uint16_t* out);
+void fhd_downsample_median16_avx2(const uint16_t* src, int src_w,
+                                  const fhd_index_2d* sampler, int cell_w,
+                                  int cell_h, int cells_x, int cells_y,
+                                  uint16_t* out);
+void fhd_downsample_median16_avx512(const uint16_t* src, int src_w,
+                                    const fhd_index_2d* sampler, int cell_w,
+                                    int cell_h, int cells_x, int cells_y,
+                                    uint16_t* out);
+
+// Directions (cos, sin) above the x axis where the fhd_hog_calculate_cells bin
+// steps up from FHD_HOG_BINS / 2. A gradient pointing up lands in bin
+// FHD_HOG_BINS / 2 plus the number of boundaries it is at or past, one
+// pointing down in FHD_HOG_BINS / 2 minus the number its mirror image is past.
+struct fhd_hog_boundaries {
+  float cos[FHD_HOG_BINS / 2];
+  float sin[FHD_HOG_BINS / 2];
+};
+const fhd_hog_boundaries* fhd_hog_get_boundaries();
+
+void fhd_hog_calculate_cells_avx2(const fhd_image* img,
+                                  const fhd_hog_cell_range* range,
+                                  fhd_hog_cell* out);
+
+// Nearly collinear neighbourhoods, det <= FHD_PLANE_DET_EPSILON *
+// (xx + yy)^2 * n, go through fhd_pcl_normal
+const float FHD_PLANE_DET_EPSILON = 1e-3f;
+
+// Scalar plane_normals over len cells from idx, and the fhd_pcl_normal fit
+// used when the closed form is singular
+void fhd_plane_normals_span(const fhd_vec3* points, const int* components,
+                            int cells_x, int idx, int len, fhd_vec3* normals);
+fhd_vec3 fhd_plane_normal_fallback(const fhd_vec3* points,
+                                   const int* components, int cells_x,
+                                   int idx);
+void fhd_plane_normals_scalar(const fhd_vec3* points, const int* components,
+                              int cells_x, int cells_y, fhd_vec3* normals);
+void fhd_plane_normals_avx2(const fhd_vec3* points, const int* components,
+                            int cells_x, int cells_y, fhd_vec3* normals);
+
+int fhd_plane_inliers_scalar(const float* xs, const float* ys, const float* zs,
+                             int len, const fhd_plane* plane,
+                             float max_distance);
+int fhd_plane_inliers_avx2(const float* xs, const float* ys, const float* zs,
+                           int len, const fhd_plane* plane,
+                           float max_distance);
+
+void fhd_hog_create_features_u8_avx2(const fhd_hog_cell* cells,
+                                     const float* scales, uint8_t* out);
+float fhd_hog_score_avx2(const fhd_hog_cell* cells, const float* weights);
+float fhd_hog_blocks_score_avx2(const fhd_hog_cell* cells, const int* blocks,
+                                int num_blocks, const float* weights);
+
+float fhd_dot_scalar(const float* a, const float* b, int len);
+float fhd_dot_sse2(const float* a, const float* b, int len);
+float fhd_dot_avx2(const float* a, const float* b, int len);
+float fhd_dot_avx512(const float* a, const float* b, int len);
+
+void fhd_quantize_u8_scalar(const float* in, const float* scales, int len,
+                            uint8_t* out);
+void fhd_quantize_u8_sse2(const float* in, const float* scales, int len,
+                          uint8_t* out);
+void fhd_quantize_u8_avx2(const float* in, const float* scales, int len,
+                          uint8_t* out);
+float fhd_dot_u8s8_scalar(const uint8_t* a, const int8_t* b,
+                          const float* scales, int groups);
+float fhd_dot_u8s8_sse2(const uint8_t* a, const int8_t* b,
+                        const float* scales, int groups);
+float fhd_dot_u8s8_avx2(const uint8_t* a, const int8_t* b,
+                        const float* scales, int groups);
+float fhd_dot_u8s8_avx512(const uint8_t* a, const int8_t* b,
+                          const float* scales, int groups);
+void fhd_dot_u8s8_batch_scalar(const uint8_t* const* as, int as_len,
+                               const int8_t* b, const float* scales,
+                               int groups, float* out);
+void fhd_dot_u8s8_batch_sse2(const uint8_t* const* as, int as_len,
+                             const int8_t* b, const float* scales, int groups,
+                             float* out);
+void fhd_dot_u8s8_batch_avx2(const uint8_t* const* as, int as_len,
+                             const int8_t* b, const float* scales, int groups,
+                             float* out);
+void fhd_dot_u8s8_batch_avx512(const uint8_t* const* as, int as_len,
+                               const int8_t* b, const float* scales,
+                               int groups, float* out);
+
+void fhd_dot_batch_scalar(const float* a, const float* const* bs, int bs_len,
+                          int len, float* out);
+void fhd_dot_batch_sse2(const float* a, const float* const* bs, int bs_len,
+                        int len, float* out);
+void fhd_dot_batch_avx2(const float* a, const float* const* bs, int bs_len,
+                        int len, float* out);
+void fhd_dot_batch_avx512(const float* a, const float* const* bs, int bs_len,
+                          int len, float* out);
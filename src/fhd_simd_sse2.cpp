@@ -0,0 +1,220 @@
+#include "fhd_simd_kernels.h"
+#include "fhd_config.h"
+#include "fhd_median.h"
+#include <emmintrin.h>
+
+// Depth values are compared as signed 16 bit, raw readings above 32767 compare
+// as negative and get masked along with the rest of the invalid range.
+
+struct fhd_u16x8 {
+  typedef __m128i vec;
+  static const int lanes = 8;
+  static vec load(const uint16_t* p) { return _mm_load_si128((const vec*)p); }
+  static void store(uint16_t* p, vec v) { _mm_storeu_si128((vec*)p, v); }
+  static vec mask_range(vec v) {
+    const vec above = _mm_cmpgt_epi16(v, _mm_set1_epi16(FHD_DEPTH_MIN - 1));
+    const vec below = _mm_cmplt_epi16(v, _mm_set1_epi16(FHD_DEPTH_MAX + 1));
+    return _mm_and_si128(v, _mm_and_si128(above, below));
+  }
+  static vec min(vec a, vec b) { return _mm_min_epi16(a, b); }
+  static vec max(vec a, vec b) { return _mm_max_epi16(a, b); }
+};
+
+void fhd_mask_depth_sse2(const uint16_t* src, uint16_t* dst, int len) {
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)&src[i]);
+    _mm_storeu_si128((__m128i*)&dst[i], fhd_u16x8::mask_range(v));
+  }
+
+  fhd_mask_depth_scalar(&src[i], &dst[i], len - i);
+}
+
+void fhd_downsample_median16_sse2(const uint16_t* src, int src_w,
+                                  const fhd_index_2d* sampler, int cell_w,
+                                  int cell_h, int cells_x, int cells_y,
+                                  uint16_t* out) {
+  fhd_downsample_median16_lanes<fhd_u16x8>(src, src_w, sampler, cell_w, cell_h,
+                                           cells_x, cells_y, out);
+}
+
+float fhd_dot_sse2(const float* a, const float* b, int len) {
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(&a[i]),
+                                       _mm_loadu_ps(&b[i])));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(&a[i + 4]),
+                                       _mm_loadu_ps(&b[i + 4])));
+  }
+
+  alignas(16) float lanes[4];
+  _mm_store_ps(lanes, _mm_add_ps(sum0, sum1));
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         fhd_dot_scalar(&a[i], &b[i], len - i);
+}
+
+// The two sums of fhd_dot_sse2 for one of the bs of fhd_dot_batch_sse2
+struct fhd_dot_sums_sse2 {
+  __m128 sum0;
+  __m128 sum1;
+
+  fhd_dot_sums_sse2() : sum0(_mm_setzero_ps()), sum1(_mm_setzero_ps()) {}
+  void add(__m128 a0, __m128 a1, const float* b) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(a0, _mm_loadu_ps(b)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(a1, _mm_loadu_ps(b + 4)));
+  }
+  float finish(const float* a, const float* b, int len) const {
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, _mm_add_ps(sum0, sum1));
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+           fhd_dot_scalar(a, b, len);
+  }
+};
+
+void fhd_dot_batch_sse2(const float* a, const float* const* bs, int bs_len,
+                        int len, float* out) {
+  int j = 0;
+  for (; j + 4 <= bs_len; j += 4) {
+    const float* b0 = bs[j];
+    const float* b1 = bs[j + 1];
+    const float* b2 = bs[j + 2];
+    const float* b3 = bs[j + 3];
+    fhd_dot_sums_sse2 s0, s1, s2, s3;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+      const __m128 a0 = _mm_loadu_ps(&a[i]);
+      const __m128 a1 = _mm_loadu_ps(&a[i + 4]);
+      s0.add(a0, a1, &b0[i]);
+      s1.add(a0, a1, &b1[i]);
+      s2.add(a0, a1, &b2[i]);
+      s3.add(a0, a1, &b3[i]);
+    }
+
+    out[j] = s0.finish(&a[i], &b0[i], len - i);
+    out[j + 1] = s1.finish(&a[i], &b1[i], len - i);
+    out[j + 2] = s2.finish(&a[i], &b2[i], len - i);
+    out[j + 3] = s3.finish(&a[i], &b3[i], len - i);
+  }
+
+  for (; j < bs_len; j++) {
+    out[j] = fhd_dot_sse2(a, bs[j], len);
+  }
+}
+
+// min returns its second operand for NaN, which converts to 0x80000000 and
+// packs to 0 like the scalar code. Infinities clamp to 127.
+static __m128i fhd_quantize4(const float* in, __m128 one, __m128 scale,
+                             __m128 max) {
+  const __m128 v = _mm_add_ps(_mm_loadu_ps(in), one);
+  return _mm_cvtps_epi32(_mm_min_ps(max, _mm_mul_ps(v, scale)));
+}
+
+void fhd_quantize_u8_sse2(const float* in, const float* scales, int len,
+                          uint8_t* out) {
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 max = _mm_set1_ps(127.f);
+  int i = 0;
+  for (; i + FHD_QUANT_GROUP <= len; i += FHD_QUANT_GROUP) {
+    const __m128 scale = _mm_set1_ps(scales[i / FHD_QUANT_GROUP]);
+    for (int k = i; k < i + FHD_QUANT_GROUP; k += 16) {
+      const __m128i q0 = fhd_quantize4(&in[k], one, scale, max);
+      const __m128i q1 = fhd_quantize4(&in[k + 4], one, scale, max);
+      const __m128i q2 = fhd_quantize4(&in[k + 8], one, scale, max);
+      const __m128i q3 = fhd_quantize4(&in[k + 12], one, scale, max);
+      const __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q0, q1),
+                                             _mm_packs_epi32(q2, q3));
+      _mm_storeu_si128((__m128i*)&out[k], bytes);
+    }
+  }
+
+  fhd_quantize_u8_scalar(&in[i], &scales[i / FHD_QUANT_GROUP], len - i,
+                         &out[i]);
+}
+
+// No maddubs before SSSE3, both sides are widened to 16 bits instead
+float fhd_dot_u8s8_sse2(const uint8_t* a, const int8_t* b,
+                        const float* scales, int groups) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128 sum = _mm_setzero_ps();
+  for (int g = 0; g < groups; g++) {
+    __m128i group = _mm_setzero_si128();
+    for (int k = 0; k < FHD_QUANT_GROUP; k += 16) {
+      const int i = g * FHD_QUANT_GROUP + k;
+      const __m128i av = _mm_loadu_si128((const __m128i*)&a[i]);
+      const __m128i bv = _mm_loadu_si128((const __m128i*)&b[i]);
+      const __m128i b_lo = _mm_srai_epi16(_mm_unpacklo_epi8(bv, bv), 8);
+      const __m128i b_hi = _mm_srai_epi16(_mm_unpackhi_epi8(bv, bv), 8);
+      group = _mm_add_epi32(
+          group, _mm_madd_epi16(_mm_unpacklo_epi8(av, zero), b_lo));
+      group = _mm_add_epi32(
+          group, _mm_madd_epi16(_mm_unpackhi_epi8(av, zero), b_hi));
+    }
+
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(group),
+                                     _mm_set1_ps(scales[g])));
+  }
+
+  alignas(16) float lanes[4];
+  _mm_store_ps(lanes, sum);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+// Group sums of fhd_dot_u8s8_sse2 for one of the as of
+// fhd_dot_u8s8_batch_sse2, b comes widened
+struct fhd_u8s8_sums_sse2 {
+  __m128 sum;
+
+  fhd_u8s8_sums_sse2() : sum(_mm_setzero_ps()) {}
+  void add(const uint8_t* a, const __m128i* b, __m128 scale) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i group = _mm_setzero_si128();
+    for (int k = 0; k < FHD_QUANT_GROUP / 16; k++) {
+      const __m128i av = _mm_loadu_si128((const __m128i*)&a[k * 16]);
+      group = _mm_add_epi32(
+          group, _mm_madd_epi16(_mm_unpacklo_epi8(av, zero), b[2 * k]));
+      group = _mm_add_epi32(
+          group, _mm_madd_epi16(_mm_unpackhi_epi8(av, zero), b[2 * k + 1]));
+    }
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(group), scale));
+  }
+  float finish() const {
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, sum);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  }
+};
+
+void fhd_dot_u8s8_batch_sse2(const uint8_t* const* as, int as_len,
+                             const int8_t* b, const float* scales, int groups,
+                             float* out) {
+  int j = 0;
+  for (; j + 4 <= as_len; j += 4) {
+    fhd_u8s8_sums_sse2 s0, s1, s2, s3;
+    for (int g = 0; g < groups; g++) {
+      const int i = g * FHD_QUANT_GROUP;
+      __m128i bw[FHD_QUANT_GROUP / 8];
+      for (int k = 0; k < FHD_QUANT_GROUP / 16; k++) {
+        const __m128i bv = _mm_loadu_si128((const __m128i*)&b[i + k * 16]);
+        bw[2 * k] = _mm_srai_epi16(_mm_unpacklo_epi8(bv, bv), 8);
+        bw[2 * k + 1] = _mm_srai_epi16(_mm_unpackhi_epi8(bv, bv), 8);
+      }
+
+      const __m128 scale = _mm_set1_ps(scales[g]);
+      s0.add(&as[j][i], bw, scale);
+      s1.add(&as[j + 1][i], bw, scale);
+      s2.add(&as[j + 2][i], bw, scale);
+      s3.add(&as[j + 3][i], bw, scale);
+    }
+
+    out[j] = s0.finish();
+    out[j + 1] = s1.finish();
+    out[j + 2] = s2.finish();
+    out[j + 3] = s3.finish();
+  }
+
+  for (; j < as_len; j++) {
+    out[j] = fhd_dot_u8s8_sse2(as[j], b, scales, groups);
+  }
+}
@@ -0,0 +1,161 @@
+#include "fhd_worker_pool.h"
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Each participant starts with a contiguous range of task indices. Owners pop
+// from the front of their own range, idle participants steal from the back of
+// the others.
+struct fhd_task_queue {
+  std::mutex lock;
+  int begin = 0;
+  int end = 0;
+};
+
+struct fhd_worker_pool {
+  int num_workers = 0;
+  std::vector<std::thread> workers;
+  // num_workers + 1 queues, the last one belongs to the calling thread
+  std::vector<fhd_task_queue> queues;
+
+  std::mutex run_lock;
+  std::mutex lock;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+  uint64_t generation = 0;
+  int active = 0;
+  bool quit = false;
+
+  fhd_task_fn fn = nullptr;
+  void* user = nullptr;
+
+  fhd_worker_pool(int n) : num_workers(n), queues(n + 1) {}
+};
+
+static thread_local bool fhd_on_worker = false;
+
+static bool fhd_pop_task(fhd_worker_pool* pool, int self, int* task) {
+  fhd_task_queue* own = &pool->queues[self];
+  {
+    std::lock_guard<std::mutex> lock(own->lock);
+    if (own->begin < own->end) {
+      *task = own->begin++;
+      return true;
+    }
+  }
+
+  const int num_queues = pool->num_workers + 1;
+  for (int i = 1; i < num_queues; i++) {
+    fhd_task_queue* victim = &pool->queues[(self + i) % num_queues];
+    std::lock_guard<std::mutex> lock(victim->lock);
+    if (victim->begin < victim->end) {
+      *task = --victim->end;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void fhd_participate(fhd_worker_pool* pool, int self) {
+  int task;
+  while (fhd_pop_task(pool, self, &task)) {
+    pool->fn(pool->user, task);
+  }
+}
+
+static void fhd_worker_main(fhd_worker_pool* pool, int self) {
+  fhd_on_worker = true;
+  uint64_t seen_generation = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(pool->lock);
+      pool->work_ready.wait(lock, [=] {
+        return pool->quit || pool->generation != seen_generation;
+      });
+      if (pool->quit) return;
+      seen_generation = pool->generation;
+    }
+
+    fhd_participate(pool, self);
+
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if (--pool->active == 0) pool->work_done.notify_one();
+  }
+}
+
+fhd_worker_pool* fhd_worker_pool_create(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = int(std::thread::hardware_concurrency());
+    if (num_threads <= 0) num_threads = 1;
+  }
+
+  fhd_worker_pool* pool = new fhd_worker_pool(num_threads - 1);
+  for (int i = 0; i < pool->num_workers; i++) {
+    pool->workers.push_back(std::thread(fhd_worker_main, pool, i));
+  }
+
+  return pool;
+}
+
+void fhd_worker_pool_destroy(fhd_worker_pool* pool) {
+  if (!pool) return;
+
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    pool->quit = true;
+  }
+  pool->work_ready.notify_all();
+
+  for (std::thread& worker : pool->workers) {
+    worker.join();
+  }
+
+  delete pool;
+}
+
+int fhd_worker_pool_num_threads(const fhd_worker_pool* pool) {
+  return pool ? pool->num_workers + 1 : 1;
+}
+
+void fhd_worker_pool_run(fhd_worker_pool* pool, fhd_task_fn fn, void* user,
+                         int num_tasks) {
+  if (num_tasks <= 0) return;
+
+  if (!pool || pool->num_workers == 0 || num_tasks == 1 || fhd_on_worker) {
+    for (int i = 0; i < num_tasks; i++) {
+      fn(user, i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> run_lock(pool->run_lock);
+
+  const int num_queues = pool->num_workers + 1;
+  for (int i = 0; i < num_queues; i++) {
+    fhd_task_queue* q = &pool->queues[i];
+    std::lock_guard<std::mutex> lock(q->lock);
+    q->begin = int(int64_t(num_tasks) * i / num_queues);
+    q->end = int(int64_t(num_tasks) * (i + 1) / num_queues);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    pool->fn = fn;
+    pool->user = user;
+    pool->active = pool->num_workers;
+    pool->generation++;
+  }
+  pool->work_ready.notify_all();
+
+  fhd_on_worker = true;
+  fhd_participate(pool, pool->num_workers);
+  fhd_on_worker = false;
+
+  std::unique_lock<std::mutex> lock(pool->lock);
+  pool->work_done.wait(lock, [=] { return pool->active == 0; });
+}
+
+bool fhd_worker_pool_on_worker() { return fhd_on_worker; }
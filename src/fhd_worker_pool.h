@@ -0,0 +1,16 @@
+#pragma once
+
+struct fhd_worker_pool;
+
+typedef void (*fhd_task_fn)(void* user, int task);
+
+// num_threads includes the calling thread, <= 0 uses all hardware threads
+fhd_worker_pool* fhd_worker_pool_create(int num_threads);
+void fhd_worker_pool_destroy(fhd_worker_pool* pool);
+int fhd_worker_pool_num_threads(const fhd_worker_pool* pool);
+// Runs fn(user, i) for i in [0, num_tasks) on the pool and the calling thread
+// and returns once every task has finished. Calls made from inside a task run
+// inline on that thread.
+void fhd_worker_pool_run(fhd_worker_pool* pool, fhd_task_fn fn, void* user,
+                         int num_tasks);
+bool fhd_worker_pool_on_worker();
@@ -0,0 +1,1145 @@
+#include "../fhd.h"
+#include "../fhd_block_allocator.h"
+#include "../fhd_candidate_db.h"
+#include "../fhd_cascade.h"
+#include "../fhd_classifier.h"
+#include "../fhd_pipeline.h"
+#include "../fhd_segmentation.h"
+#include "../fhd_simd.h"
+#include "../fhd_sqlite_source.h"
+#include "../fhd_worker_pool.h"
+#include "../pcg/pcg_basic.h"
+#include "fhd_debug_frame_source.h"
+#include <fann.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock fhd_clock;
+
+struct fhd_bench_options {
+  const char* db_file = NULL;
+  const char* classifier_file = NULL;
+  const char* svm_file = NULL;
+  const char* test_file = NULL;
+  const char* cascade_file = NULL;
+  int num_frames = 50;
+  int num_threads = 0;
+  int max_streams = 16;
+  fhd_isa isa = fhd_isa_avx512;
+};
+
+struct fhd_bench_frames {
+  int len = 0;
+  std::vector<uint16_t*> frames;
+
+  ~fhd_bench_frames() {
+    for (uint16_t* frame : frames) free(frame);
+  }
+};
+
+static double fhd_seconds_since(fhd_clock::time_point start) {
+  auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+      fhd_clock::now() - start);
+  return double(duration.count()) / 1000000.0;
+}
+
+// Frames are copied up front so the benchmarks don't measure sqlite
+static void fhd_load_frames(const fhd_bench_options* opts,
+                            fhd_bench_frames* out) {
+  std::unique_ptr<fhd_frame_source> source;
+  if (opts->db_file) {
+    source.reset(new fhd_sqlite_source(opts->db_file));
+  } else {
+    source.reset(new fhd_debug_frame_source());
+  }
+
+  const int frame_len = 512 * 424;
+  for (int i = 0; i < opts->num_frames; i++) {
+    const uint16_t* frame = source->get_frame();
+    if (!frame) break;
+
+    uint16_t* copy = (uint16_t*)calloc(frame_len, sizeof(uint16_t));
+    memcpy(copy, frame, frame_len * sizeof(uint16_t));
+    out->frames.push_back(copy);
+  }
+
+  out->len = int(out->frames.size());
+}
+
+static void fhd_print_perf_records(const fhd_context* fhd) {
+  for (int i = 0; i < PERF_RECORD_COUNT; i++) {
+    const fhd_perf_record* record = &fhd->perf_records[i];
+    if (record->count == 0) continue;
+    printf("%-22s %10llu cycles\n", fhd_perf_record_names[i],
+           (unsigned long long)record->avg_cycles);
+  }
+}
+
+static void fhd_bench_stages(const fhd_bench_options* opts,
+                             const fhd_bench_frames* frames) {
+  fhd_classifier* classifier = NULL;
+  if (opts->classifier_file) {
+    classifier = fhd_classifier_create(opts->classifier_file);
+  }
+
+  fhd_context fhd;
+  fhd_context_init(&fhd, 512, 424, 8, 8);
+
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&fhd, frames->frames[f]);
+    if (classifier) fhd_run_classifier(&fhd, classifier);
+  }
+
+  fhd_print_perf_records(&fhd);
+
+  const fhd_block_allocator_stats points =
+      fhd_block_allocator_get_stats(fhd.point_allocator);
+  printf("point chunks: %d of %d used at most (%d bytes each)\n",
+         points.max_used_blocks, points.num_blocks, points.block_size);
+
+  fhd_context_destroy(&fhd);
+  fhd_classifier_destroy(classifier);
+}
+
+static void fhd_bench_streams(const fhd_bench_options* opts,
+                              const fhd_bench_frames* frames) {
+  fhd_worker_pool* pool = fhd_worker_pool_create(opts->num_threads);
+  printf("worker threads: %d\n", fhd_worker_pool_num_threads(pool));
+
+  for (int n = 1; n <= opts->max_streams; n *= 2) {
+    std::vector<fhd_context> contexts(n);
+    std::vector<fhd_context*> context_ptrs(n);
+    std::vector<fhd_classifier*> classifiers(n, (fhd_classifier*)NULL);
+    std::vector<const uint16_t*> sources(n);
+
+    for (int i = 0; i < n; i++) {
+      fhd_context_init(&contexts[i], 512, 424, 8, 8);
+      context_ptrs[i] = &contexts[i];
+      if (opts->classifier_file) {
+        classifiers[i] = fhd_classifier_create(opts->classifier_file);
+      }
+    }
+
+    auto start = fhd_clock::now();
+    for (int f = 0; f < frames->len; f++) {
+      for (int i = 0; i < n; i++) {
+        sources[i] = frames->frames[(f + i) % frames->len];
+      }
+
+      fhd_run_pass_batch(pool, context_ptrs.data(), sources.data(), n);
+      if (opts->classifier_file) {
+        fhd_run_classifier_batch(pool, context_ptrs.data(), classifiers.data(),
+                                 n);
+      }
+    }
+    const double seconds = fhd_seconds_since(start);
+    const double fps = double(frames->len * n) / seconds;
+
+    printf("streams %2d: %8.1f frames/s (%.1f per stream)\n", n, fps,
+           fps / double(n));
+
+    for (int i = 0; i < n; i++) {
+      fhd_classifier_destroy(classifiers[i]);
+      fhd_context_destroy(&contexts[i]);
+    }
+  }
+
+  fhd_worker_pool_destroy(pool);
+}
+
+static void fhd_bench_pipeline(const fhd_bench_options* opts,
+                               const fhd_bench_frames* frames) {
+  fhd_worker_pool* pool = fhd_worker_pool_create(opts->num_threads);
+  fhd_classifier* classifier = NULL;
+  if (opts->classifier_file) {
+    classifier = fhd_classifier_create(opts->classifier_file);
+  }
+
+  fhd_context fhd;
+  fhd_context_init(&fhd, 512, 424, 8, 8);
+
+  auto start = fhd_clock::now();
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&fhd, frames->frames[f]);
+    if (classifier) fhd_run_classifier(&fhd, classifier);
+  }
+  double seconds = fhd_seconds_since(start);
+  printf("sequential: %8.1f frames/s\n", double(frames->len) / seconds);
+
+  fhd_pipeline pipeline;
+  fhd_pipeline_init(&pipeline, &fhd, pool);
+
+  start = fhd_clock::now();
+  const uint64_t start_cycles = fhd_rdtsc();
+  for (int f = 0; f < frames->len; f++) {
+    fhd_pipeline_push(&pipeline, frames->frames[f], classifier);
+  }
+  fhd_pipeline_flush(&pipeline, classifier);
+  seconds = fhd_seconds_since(start);
+  const double cycles_per_ms =
+      double(fhd_rdtsc() - start_cycles) / (seconds * 1000.0);
+
+  printf("pipelined:  %8.1f frames/s, latency avg %.2f ms max %.2f ms\n",
+         double(frames->len) / seconds,
+         double(pipeline.latency.avg_cycles) / cycles_per_ms,
+         double(pipeline.max_latency) / cycles_per_ms);
+
+  fhd_pipeline_destroy(&pipeline);
+  fhd_context_destroy(&fhd);
+  fhd_classifier_destroy(classifier);
+  fhd_worker_pool_destroy(pool);
+}
+
+static void fhd_bench_median(const fhd_bench_options*,
+                             const fhd_bench_frames* frames) {
+  fhd_context reference;
+  fhd_context network;
+  fhd_context_init(&reference, 512, 424, 8, 8);
+  fhd_context_init(&network, 512, 424, 8, 8);
+  reference.median_method = fhd_median_nth_element;
+  network.median_method = fhd_median_network;
+
+  int mismatches = 0;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&reference, frames->frames[f]);
+    fhd_run_pass(&network, frames->frames[f]);
+    for (int i = 0; i < reference.cells_len; i++) {
+      if (reference.downscaled_depth[i] != network.downscaled_depth[i]) {
+        mismatches++;
+      }
+    }
+  }
+
+  const uint64_t ref_cycles =
+      reference.perf_records[pr_construct_pcl].avg_cycles;
+  const uint64_t net_cycles = network.perf_records[pr_construct_pcl].avg_cycles;
+  printf("%s, avg cycles\n", fhd_perf_record_names[pr_construct_pcl]);
+  printf("nth_element: %10llu\n", (unsigned long long)ref_cycles);
+  printf("network:     %10llu (%.2fx)\n", (unsigned long long)net_cycles,
+         double(ref_cycles) / double(net_cycles));
+  printf("mismatched cells: %d\n", mismatches);
+
+  fhd_context_destroy(&reference);
+  fhd_context_destroy(&network);
+}
+
+// Same region, its points in the same order
+static bool fhd_regions_equal(const fhd_region* a, const fhd_region* b) {
+  if (a->n != b->n || a->sx != b->sx || a->sy != b->sy || a->ex != b->ex ||
+      a->ey != b->ey || a->center.x != b->center.x ||
+      a->center.y != b->center.y || a->center.z != b->center.z ||
+      memcmp(&a->bounds, &b->bounds, sizeof(a->bounds)) != 0 ||
+      a->points_len != b->points_len) {
+    return false;
+  }
+
+  const fhd_point_chunk* ca = a->points;
+  const fhd_point_chunk* cb = b->points;
+  int ia = 0;
+  int ib = 0;
+  for (int p = 0; p < a->points_len; p++) {
+    while (ia == ca->len) {
+      ca = ca->next;
+      ia = 0;
+    }
+    while (ib == cb->len) {
+      cb = cb->next;
+      ib = 0;
+    }
+
+    const fhd_region_point& pa = ca->points[ia++];
+    const fhd_region_point& pb = cb->points[ib++];
+    if (pa.x != pb.x || pa.y != pb.y) return false;
+  }
+
+  return true;
+}
+
+// The pairwise region merge against the grid one, and how many merged regions
+// differ between them
+static void fhd_bench_merge(const fhd_bench_options*,
+                            const fhd_bench_frames* frames) {
+  fhd_context pairwise;
+  fhd_context grid;
+  fhd_context_init(&pairwise, 512, 424, 8, 8);
+  fhd_context_init(&grid, 512, 424, 8, 8);
+  pairwise.merge_method = fhd_merge_pairwise;
+  grid.merge_method = fhd_merge_grid;
+
+  int regions = 0;
+  int mismatches = 0;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_region_stages(&pairwise, frames->frames[f]);
+    fhd_run_region_stages(&grid, frames->frames[f]);
+    const int len = std::max(pairwise.filtered_regions_len,
+                             grid.filtered_regions_len);
+    for (int i = 0; i < len; i++) {
+      regions++;
+      if (i >= pairwise.filtered_regions_len ||
+          i >= grid.filtered_regions_len ||
+          !fhd_regions_equal(&pairwise.filtered_regions[i],
+                             &grid.filtered_regions[i])) {
+        mismatches++;
+      }
+    }
+  }
+
+  const uint64_t pairwise_cycles =
+      pairwise.perf_records[pr_merge_regions].avg_cycles;
+  const uint64_t grid_cycles = grid.perf_records[pr_merge_regions].avg_cycles;
+  printf("%s, avg cycles\n", fhd_perf_record_names[pr_merge_regions]);
+  printf("pairwise: %10llu\n", (unsigned long long)pairwise_cycles);
+  printf("grid:     %10llu (%.2fx)\n", (unsigned long long)grid_cycles,
+         double(pairwise_cycles) / double(grid_cycles));
+  printf("mismatched regions: %d of %d\n", mismatches, regions);
+
+  fhd_context_destroy(&pairwise);
+  fhd_context_destroy(&grid);
+}
+
+// Graphs are sorted in place by the pass, sorting them by node restores the
+// order they were built in
+static void fhd_capture_edges(const fhd_edge* edges, int num_edges,
+                              std::vector<fhd_edge>* out) {
+  out->assign(edges, edges + num_edges);
+  std::sort(out->begin(), out->end(), [](const fhd_edge& a, const fhd_edge& b) {
+    return a.a == b.a ? a.b < b.b : a.a < b.a;
+  });
+}
+
+static void fhd_bench_edges(const fhd_bench_options*,
+                            const fhd_bench_frames* frames) {
+  fhd_context fhd;
+  fhd_context_init(&fhd, 512, 424, 8, 8);
+
+  std::vector<std::vector<fhd_edge>> graphs;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&fhd, frames->frames[f]);
+    graphs.emplace_back();
+    fhd_capture_edges(fhd.depth_graph, fhd.num_depth_edges, &graphs.back());
+    graphs.emplace_back();
+    fhd_capture_edges(fhd.normals_graph, fhd.num_normals_edges,
+                      &graphs.back());
+  }
+
+  std::vector<fhd_edge> comparison;
+  std::vector<fhd_edge> radix;
+  std::vector<fhd_edge> scratch;
+  uint64_t comparison_cycles = 0;
+  uint64_t radix_cycles = 0;
+  int num_edges = 0;
+  int unsorted = 0;
+  for (const std::vector<fhd_edge>& graph : graphs) {
+    const int len = int(graph.size());
+    comparison = graph;
+    radix = graph;
+    scratch.resize(graph.size());
+
+    uint64_t start = fhd_rdtsc();
+    fhd_sort_edges(comparison.data(), scratch.data(), len,
+                   fhd_edge_sort_comparison);
+    comparison_cycles += fhd_rdtsc() - start;
+
+    start = fhd_rdtsc();
+    fhd_sort_edges(radix.data(), scratch.data(), len, fhd_edge_sort_radix);
+    radix_cycles += fhd_rdtsc() - start;
+
+    // NaN weights leave std::sort's order unspecified, check radix directly
+    for (int i = 1; i < len; i++) {
+      if (radix[i].weight < radix[i - 1].weight ||
+          (isnan(radix[i - 1].weight) && !isnan(radix[i].weight))) {
+        unsorted++;
+      }
+    }
+    num_edges += len;
+  }
+
+  const double num_graphs = double(graphs.size());
+  printf("%d graphs, %.0f edges on average\n", int(graphs.size()),
+         double(num_edges) / num_graphs);
+  printf("comparison: %10.0f cycles\n", double(comparison_cycles) / num_graphs);
+  printf("radix:      %10.0f cycles (%.2fx)\n",
+         double(radix_cycles) / num_graphs,
+         double(comparison_cycles) / double(radix_cycles));
+  printf("radix edges out of order: %d\n", unsorted);
+
+  fhd_context_destroy(&fhd);
+}
+
+// Angle between the least squares normals and the other methods over cells
+// where both have one
+static void fhd_bench_normals(const fhd_bench_options*,
+                              const fhd_bench_frames* frames) {
+  const fhd_normals_method methods[] = {
+      fhd_normals_least_squares, fhd_normals_integral, fhd_normals_batched};
+  const char* names[] = {"least squares", "integral", "batched"};
+  const int num_methods = sizeof(methods) / sizeof(methods[0]);
+
+  fhd_context contexts[num_methods];
+  double error_sum[num_methods] = {};
+  double max_error[num_methods] = {};
+  int compared[num_methods] = {};
+  int mismatches[num_methods] = {};
+  for (int m = 0; m < num_methods; m++) {
+    fhd_context_init(&contexts[m], 512, 424, 8, 8);
+    contexts[m].normals_method = methods[m];
+  }
+
+  // The integral method only pays off for neighbourhoods inside one depth
+  // component
+  int neighbourhoods = 0;
+  int crossing = 0;
+  const fhd_context* reference = &contexts[0];
+  for (int f = 0; f < frames->len; f++) {
+    for (int m = 0; m < num_methods; m++) {
+      fhd_run_pass(&contexts[m], frames->frames[f]);
+    }
+
+    for (int y = 1; y < reference->cells_y - 1; y++) {
+      for (int x = 1; x < reference->cells_x - 1; x++) {
+        const int idx = y * reference->cells_x + x;
+        if (reference->point_cloud[idx].z <= 0.f) continue;
+
+        bool crosses = false;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            const int j = idx + dy * reference->cells_x + dx;
+            crosses |= reference->point_cloud[j].z > 0.f &&
+                       reference->depth_components[j] !=
+                           reference->depth_components[idx];
+          }
+        }
+        neighbourhoods++;
+        crossing += crosses;
+      }
+    }
+
+    for (int m = 1; m < num_methods; m++) {
+      for (int i = 0; i < reference->cells_len; i++) {
+        const fhd_vec3 a = reference->normals[i];
+        const fhd_vec3 b = contexts[m].normals[i];
+        const bool has_a = a.x != 0.f || a.y != 0.f || a.z != 0.f;
+        const bool has_b = b.x != 0.f || b.y != 0.f || b.z != 0.f;
+        if (has_a != has_b) {
+          mismatches[m]++;
+          continue;
+        }
+
+        // n and -n are the same plane
+        const double dot =
+            fhd_clamp(fabs(double(fhd_vec3_dot(a, b))), 0.0, 1.0);
+        if (!has_a || isnan(dot)) continue;
+
+        const double error = acos(dot) * 180.0 / 3.14159265358979;
+        error_sum[m] += error;
+        max_error[m] = std::max(max_error[m], error);
+        compared[m]++;
+      }
+    }
+  }
+
+  const uint64_t ref_cycles =
+      reference->perf_records[pr_construct_normals].avg_cycles;
+  printf("%s, avg cycles (%s kernels)\n",
+         fhd_perf_record_names[pr_construct_normals],
+         fhd_isa_name(reference->kernels->isa));
+  for (int m = 0; m < num_methods; m++) {
+    const uint64_t cycles =
+        contexts[m].perf_records[pr_construct_normals].avg_cycles;
+    printf("%-14s %10llu (%.2fx)\n", names[m], (unsigned long long)cycles,
+           double(ref_cycles) / double(cycles));
+  }
+
+  printf("%.1f%% of %d neighbourhoods cross a depth component\n",
+         neighbourhoods ? 100.0 * crossing / neighbourhoods : 0.0,
+         neighbourhoods);
+  for (int m = 1; m < num_methods; m++) {
+    printf("%s: %.2e deg avg, %.2e deg max over %d normals, %d cells with a "
+           "normal in only one method\n",
+           names[m], compared[m] ? error_sum[m] / compared[m] : 0.0,
+           max_error[m], compared[m], mismatches[m]);
+  }
+
+  for (int m = 0; m < num_methods; m++) {
+    fhd_context_destroy(&contexts[m]);
+  }
+}
+
+static uint64_t fhd_segmentation_cycles(const fhd_context* fhd) {
+  return fhd->perf_records[pr_segment_depth].avg_cycles +
+         fhd->perf_records[pr_segment_normals].avg_cycles;
+}
+
+// Serial segmentation against bands of rows on the pool, at the default and
+// at a finer cell grid
+static void fhd_bench_segmentation(const fhd_bench_options* opts,
+                                   const fhd_bench_frames* frames) {
+  fhd_worker_pool* pool = fhd_worker_pool_create(opts->num_threads);
+  printf("worker threads: %d\n", fhd_worker_pool_num_threads(pool));
+
+  const int cell_sizes[] = {8, 4};
+  for (int cell_size : cell_sizes) {
+    fhd_context serial;
+    fhd_context tiled;
+    fhd_context_init(&serial, 512, 424, cell_size, cell_size);
+    fhd_context_init(&tiled, 512, 424, cell_size, cell_size);
+    tiled.pool = pool;
+    tiled.tiled_segmentation = true;
+
+    double components = 0.0;
+    double tiled_components = 0.0;
+    for (int f = 0; f < frames->len; f++) {
+      fhd_run_pass(&serial, frames->frames[f]);
+      fhd_run_pass(&tiled, frames->frames[f]);
+      components += double(serial.depth_segmentation->num_nodes +
+                           serial.normals_segmentation->num_nodes);
+      tiled_components += double(tiled.depth_segmentation->num_nodes +
+                                 tiled.normals_segmentation->num_nodes);
+    }
+
+    const uint64_t serial_cycles = fhd_segmentation_cycles(&serial);
+    const uint64_t tiled_cycles = fhd_segmentation_cycles(&tiled);
+    printf("%dx%d cells, %dx%d grid, depth + normals segmentation\n",
+           cell_size, cell_size, serial.cells_x, serial.cells_y);
+    printf("serial: %10llu cycles, %.0f components\n",
+           (unsigned long long)serial_cycles, components / frames->len);
+    printf("tiled:  %10llu cycles, %.0f components (%.2fx)\n",
+           (unsigned long long)tiled_cycles, tiled_components / frames->len,
+           double(serial_cycles) / double(tiled_cycles));
+
+    fhd_context_destroy(&serial);
+    fhd_context_destroy(&tiled);
+  }
+
+  fhd_worker_pool_destroy(pool);
+}
+
+// Scalar HOG cells against the ones of the selected kernels, and how far the
+// features and scores move
+static void fhd_bench_hog(const fhd_bench_options* opts,
+                          const fhd_bench_frames* frames) {
+  fhd_classifier* classifier = NULL;
+  if (opts->classifier_file) {
+    classifier = fhd_classifier_create(opts->classifier_file);
+  }
+
+  fhd_context reference;
+  fhd_context selected;
+  fhd_context_init(&reference, 512, 424, 8, 8);
+  fhd_context_init(&selected, 512, 424, 8, 8);
+  reference.kernels = fhd_get_kernels(fhd_isa_scalar);
+
+  const fhd_hog_cell_range all = fhd_hog_all_cells();
+  const double window_cells = double((all.x1 - all.x0) * (all.y1 - all.y0));
+  int candidates = 0;
+  double covered = 0.0;
+  double max_feature_error = 0.0;
+  double max_score_error = 0.0;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&reference, frames->frames[f]);
+    fhd_run_pass(&selected, frames->frames[f]);
+    if (classifier) {
+      fhd_run_classifier(&reference, classifier);
+      fhd_run_classifier(&selected, classifier);
+    }
+
+    for (int i = 0; i < reference.candidates_len; i++) {
+      const fhd_candidate* a = &reference.candidates[i];
+      const fhd_candidate* b = &selected.candidates[i];
+      for (int j = 0; j < a->num_features; j++) {
+        const double error = fabs(double(a->features[j] - b->features[j]));
+        max_feature_error = std::max(max_feature_error, error);
+      }
+
+      const double score_error = fabs(double(a->weight - b->weight));
+      max_score_error = std::max(max_score_error, score_error);
+
+      const fhd_hog_cell_range r = fhd_hog_cells_in(&a->depth_window);
+      covered += double((r.x1 - r.x0) * (r.y1 - r.y0)) / window_cells;
+      candidates++;
+    }
+  }
+
+  const uint64_t ref_cycles = reference.perf_records[pr_calc_hog].avg_cycles;
+  const uint64_t cycles = selected.perf_records[pr_calc_hog].avg_cycles;
+  printf("%s, avg cycles per frame\n", fhd_perf_record_names[pr_calc_hog]);
+  printf("%-7s %10llu\n", fhd_isa_name(reference.kernels->isa),
+         (unsigned long long)ref_cycles);
+  printf("%-7s %10llu (%.2fx)\n", fhd_isa_name(selected.kernels->isa),
+         (unsigned long long)cycles, double(ref_cycles) / double(cycles));
+  printf("%d candidates, max feature difference %.2e", candidates,
+         max_feature_error);
+  if (classifier) printf(", max score difference %.2e", max_score_error);
+  printf("\n");
+  printf("cells overlapping the region: %.0f%% of the window on average\n",
+         candidates ? 100.0 * covered / candidates : 0.0);
+
+  fhd_context_destroy(&reference);
+  fhd_context_destroy(&selected);
+  fhd_classifier_destroy(classifier);
+}
+
+// Feature creation and classification against scoring straight from the HOG
+// cells
+static void fhd_bench_fused(const fhd_bench_options* opts,
+                            const fhd_bench_frames* frames) {
+  if (!opts->classifier_file) {
+    printf("fused needs -classifier\n");
+    return;
+  }
+
+  fhd_classifier* classifier = fhd_classifier_create(opts->classifier_file);
+  fhd_context reference;
+  fhd_context fused;
+  fhd_context_init(&reference, 512, 424, 8, 8);
+  fhd_context_init(&fused, 512, 424, 8, 8);
+  fused.fuse_features = true;
+
+  int candidates = 0;
+  double max_score_error = 0.0;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&reference, frames->frames[f]);
+    fhd_run_pass(&fused, frames->frames[f]);
+    fhd_run_classifier(&reference, classifier);
+    fhd_run_classifier(&fused, classifier);
+    for (int i = 0; i < reference.candidates_len; i++) {
+      const double error = fabs(double(reference.candidates[i].weight -
+                                       fused.candidates[i].weight));
+      max_score_error = std::max(max_score_error, error);
+      candidates++;
+    }
+  }
+
+  const uint64_t ref_cycles =
+      reference.perf_records[pr_create_features].avg_cycles +
+      reference.perf_records[pr_classify].avg_cycles;
+  const uint64_t fused_cycles = fused.perf_records[pr_classify].avg_cycles;
+  printf("%s + %s, avg cycles per frame\n",
+         fhd_perf_record_names[pr_create_features],
+         fhd_perf_record_names[pr_classify]);
+  printf("features: %10llu\n", (unsigned long long)ref_cycles);
+  printf("fused:    %10llu (%.2fx)\n", (unsigned long long)fused_cycles,
+         double(ref_cycles) / double(fused_cycles));
+  printf("%d candidates, max score difference %.2e\n", candidates,
+         max_score_error);
+
+  fhd_context_destroy(&reference);
+  fhd_context_destroy(&fused);
+  fhd_classifier_destroy(classifier);
+}
+
+// Region merging with the planarity test off and on, the test with the scalar
+// and the default inlier count kernels
+static void fhd_bench_planar(const fhd_bench_options*,
+                             const fhd_bench_frames* frames) {
+  const char* names[] = {"off", "scalar", "default"};
+  fhd_context contexts[3];
+  double regions[3] = {};
+  for (int i = 0; i < 3; i++) {
+    fhd_context_init(&contexts[i], 512, 424, 8, 8);
+    contexts[i].planar_regions = i > 0;
+    // Same planes for both kernels
+    pcg32_srandom_r(contexts[i].rng, 42u, 54u);
+  }
+  contexts[1].kernels = fhd_get_kernels(fhd_isa_scalar);
+
+  for (int f = 0; f < frames->len; f++) {
+    for (int i = 0; i < 3; i++) {
+      fhd_run_pass(&contexts[i], frames->frames[f]);
+      regions[i] += double(contexts[i].filtered_regions_len);
+    }
+  }
+
+  const uint64_t off_cycles =
+      contexts[0].perf_records[pr_merge_regions].avg_cycles;
+  printf("%s, avg cycles (%s kernels)\n",
+         fhd_perf_record_names[pr_merge_regions],
+         fhd_isa_name(contexts[2].kernels->isa));
+  for (int i = 0; i < 3; i++) {
+    const uint64_t cycles =
+        contexts[i].perf_records[pr_merge_regions].avg_cycles;
+    printf("%-8s %10llu (%.2fx of off), %.1f regions\n", names[i],
+           (unsigned long long)cycles, double(cycles) / double(off_cycles),
+           regions[i] / frames->len);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    fhd_context_destroy(&contexts[i]);
+  }
+}
+
+// fann_run against scoring candidates one at a time and in batches across
+// streams, and how far they are from fann_run
+static void fhd_bench_batch(const fhd_bench_options* opts,
+                            const fhd_bench_frames* frames) {
+  if (!opts->classifier_file) {
+    printf("batch needs -classifier\n");
+    return;
+  }
+
+  fhd_classifier* classifier = fhd_classifier_create(opts->classifier_file);
+  fann* nn = fann_create_from_file(opts->classifier_file);
+  const int n = opts->max_streams;
+  std::vector<fhd_context> contexts(n);
+  std::vector<fhd_context*> context_ptrs(n);
+  for (int i = 0; i < n; i++) {
+    fhd_context_init(&contexts[i], 512, 424, 8, 8);
+    context_ptrs[i] = &contexts[i];
+  }
+
+  int candidates = 0;
+  uint64_t single_cycles = 0;
+  uint64_t batch_cycles = 0;
+  uint64_t fann_cycles = 0;
+  double max_score_error = 0.0;
+  for (int f = 0; f < frames->len; f++) {
+    for (int i = 0; i < n; i++) {
+      fhd_run_pass(&contexts[i], frames->frames[(f + i) % frames->len]);
+    }
+
+    // Untimed once so both start with the features in cache
+    fhd_run_classifier_streams(context_ptrs.data(), n, classifier);
+    const uint64_t start = fhd_rdtsc();
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < contexts[i].candidates_len; j++) {
+        fhd_candidate* candidate = &contexts[i].candidates[j];
+        candidate->weight = fhd_classify(classifier, candidate);
+      }
+    }
+    const uint64_t middle = fhd_rdtsc();
+    fhd_run_classifier_streams(context_ptrs.data(), n, classifier);
+    batch_cycles += fhd_rdtsc() - middle;
+    single_cycles += middle - start;
+
+    for (int i = 0; i < n; i++) {
+      for (int j = 0; j < contexts[i].candidates_len; j++) {
+        fhd_candidate* candidate = &contexts[i].candidates[j];
+        const uint64_t fann_start = fhd_rdtsc();
+        const float expected = fann_run(nn, candidate->features)[0];
+        fann_cycles += fhd_rdtsc() - fann_start;
+        const double error = fabs(double(candidate->weight - expected));
+        max_score_error = std::max(max_score_error, error);
+        candidates++;
+      }
+    }
+  }
+
+  printf("%d streams, %d candidates, avg cycles per frame of all streams (%s "
+         "kernels)\n",
+         n, candidates, fhd_isa_name(contexts[0].kernels->isa));
+  printf("fann:   %10llu\n", (unsigned long long)(fann_cycles / frames->len));
+  printf("single: %10llu (%.2fx)\n",
+         (unsigned long long)(single_cycles / frames->len),
+         double(fann_cycles) / double(single_cycles));
+  printf("batch:  %10llu (%.2fx)\n",
+         (unsigned long long)(batch_cycles / frames->len),
+         double(fann_cycles) / double(batch_cycles));
+  printf("max difference from fann_run %.2e\n", max_score_error);
+
+  for (int i = 0; i < n; i++) {
+    fhd_context_destroy(&contexts[i]);
+  }
+  fann_destroy(nn);
+  fhd_classifier_destroy(classifier);
+}
+
+// Float against int8 scores, calibrated on the candidates of the frames, from
+// the features in batches and straight from the HOG cells
+static void fhd_bench_int8(const fhd_bench_options* opts,
+                           const fhd_bench_frames* frames) {
+  if (!opts->classifier_file) {
+    printf("int8 needs -classifier\n");
+    return;
+  }
+
+  const fhd_hog_cell_range all = fhd_hog_all_cells();
+  const int num_cells = all.x1 * all.y1;
+  fhd_context fhd;
+  fhd_context_init(&fhd, 512, 424, 8, 8);
+  std::vector<float> features;
+  std::vector<fhd_hog_cell> cells;
+  for (int f = 0; f < frames->len; f++) {
+    fhd_run_pass(&fhd, frames->frames[f]);
+    for (int i = 0; i < fhd.candidates_len; i++) {
+      const fhd_candidate* candidate = &fhd.candidates[i];
+      features.insert(features.end(), candidate->features,
+                      candidate->features + candidate->num_features);
+      cells.insert(cells.end(), candidate->cells,
+                   candidate->cells + num_cells);
+    }
+  }
+  fhd_context_destroy(&fhd);
+
+  const int features_length = 3780;
+  const int count = int(features.size()) / features_length;
+  std::vector<const float*> feature_ptrs(count);
+  for (int i = 0; i < count; i++) {
+    feature_ptrs[i] = &features[i * features_length];
+  }
+
+  fhd_classifier* reference = fhd_classifier_create(opts->classifier_file);
+  fhd_classifier* quantized = fhd_classifier_create(opts->classifier_file);
+  if (!fhd_classifier_calibrate(quantized, feature_ptrs.data(), count)) {
+    printf("int8 needs a network without hidden layers and one output\n");
+  } else if (count > 0) {
+    fhd_classifier_use_int8(quantized, true);
+    const char* names[] = {"batch", "cells"};
+    std::vector<float> reference_scores(count);
+    std::vector<float> quantized_scores(count);
+    printf("%d candidates, avg cycles per candidate (%s kernels)\n", count,
+           fhd_isa_name(fhd_default_kernels()->isa));
+    for (int m = 0; m < 2; m++) {
+      uint64_t cycles[2] = {~0ull, ~0ull};
+      for (int r = 0; r < 10; r++) {
+        for (int q = 0; q < 2; q++) {
+          const fhd_classifier* classifier = q ? quantized : reference;
+          float* scores = q ? quantized_scores.data() : reference_scores.data();
+          const uint64_t start = fhd_rdtsc();
+          if (m == 0) {
+            fhd_classify_batch(classifier, feature_ptrs.data(), count, scores);
+          } else {
+            for (int i = 0; i < count; i++) {
+              scores[i] =
+                  fhd_classify_cells(classifier, &cells[i * num_cells]);
+            }
+          }
+          cycles[q] = std::min(cycles[q], fhd_rdtsc() - start);
+        }
+      }
+
+      double max_score_error = 0.0;
+      int flips = 0;
+      for (int i = 0; i < count; i++) {
+        const double error =
+            fabs(double(reference_scores[i] - quantized_scores[i]));
+        max_score_error = std::max(max_score_error, error);
+        flips +=
+            (reference_scores[i] >= 0.95f) != (quantized_scores[i] >= 0.95f);
+      }
+
+      printf("%s: float %llu, int8 %llu (%.2fx), max score difference %.2e, "
+             "%d flipped at 0.95\n",
+             names[m], (unsigned long long)(cycles[0] / count),
+             (unsigned long long)(cycles[1] / count),
+             double(cycles[0]) / double(cycles[1]), max_score_error, flips);
+    }
+  }
+
+  fhd_classifier_destroy(reference);
+  fhd_classifier_destroy(quantized);
+}
+
+struct fhd_bench_classifier_result {
+  uint64_t single_cycles;
+  uint64_t batch_cycles;
+  float precision;
+  float recall;
+  float accuracy;
+};
+
+static fhd_bench_classifier_result fhd_bench_classifier(
+    const fhd_classifier* classifier, const float* const* features,
+    const int* labels, int count, int features_length) {
+  std::vector<float> scores(count);
+  fhd_bench_classifier_result result;
+  result.single_cycles = ~0ull;
+  result.batch_cycles = ~0ull;
+  for (int r = 0; r < 10; r++) {
+    const uint64_t start = fhd_rdtsc();
+    for (int i = 0; i < count; i++) {
+      scores[i] = classifier->backend->score(classifier, features[i],
+                                             features_length);
+    }
+    const uint64_t middle = fhd_rdtsc();
+    fhd_classify_batch(classifier, features, count, scores.data());
+    result.batch_cycles = std::min(result.batch_cycles, fhd_rdtsc() - middle);
+    result.single_cycles = std::min(result.single_cycles, middle - start);
+  }
+
+  int tp = 0, fp = 0, fn = 0, correct = 0;
+  for (int i = 0; i < count; i++) {
+    const bool human = scores[i] >= 0.95f;
+    tp += human && labels[i];
+    fp += human && !labels[i];
+    fn += !human && labels[i];
+    correct += human == (labels[i] != 0);
+  }
+
+  result.precision = tp + fp > 0 ? float(tp) / float(tp + fp) : 0.f;
+  result.recall = tp + fn > 0 ? float(tp) / float(tp + fn) : 0.f;
+  result.accuracy = float(correct) / float(count);
+  return result;
+}
+
+// The FANN network against a linear SVM on the labelled candidates of a test
+// database
+static void fhd_bench_classifiers(const fhd_bench_options* opts,
+                                  const fhd_bench_frames*) {
+  if (!opts->classifier_file || !opts->svm_file || !opts->test_file) {
+    printf("classifiers needs -classifier, -svm and -test\n");
+    return;
+  }
+
+  fhd_candidate_db db;
+  if (!fhd_candidate_db_init(&db, opts->test_file, true)) {
+    printf("can't open %s\n", opts->test_file);
+    return;
+  }
+
+  const int features_length = 3780;
+  int count = fhd_candidate_db_get_count(&db);
+  std::vector<float> features(size_t(count) * features_length);
+  std::vector<fhd_result> results(count);
+  for (int i = 0; i < count; i++) {
+    results[i].num_features = features_length;
+    results[i].features = &features[size_t(i) * features_length];
+  }
+  count = fhd_candidate_db_get_features(&db, results.data(), count);
+  fhd_candidate_db_close(&db);
+
+  std::vector<const float*> feature_ptrs(count);
+  std::vector<int> labels(count);
+  for (int i = 0; i < count; i++) {
+    feature_ptrs[i] = results[i].features;
+    labels[i] = results[i].human;
+  }
+
+  const char* files[] = {opts->classifier_file, opts->svm_file};
+  printf("%d candidates, avg cycles per candidate (%s kernels), scores >= "
+         "0.95 are human\n",
+         count, fhd_isa_name(fhd_default_kernels()->isa));
+  printf("%-12s %10s %10s %10s %10s %10s\n", "", "single", "batch",
+         "precision", "recall", "accuracy");
+  for (const char* file : files) {
+    fhd_classifier* classifier = fhd_classifier_create(file);
+    if (!classifier) {
+      printf("can't load %s\n", file);
+      continue;
+    }
+
+    if (count > 0) {
+      const fhd_bench_classifier_result r =
+          fhd_bench_classifier(classifier, feature_ptrs.data(), labels.data(),
+                               count, features_length);
+      printf("%-12s %10llu %10llu %10.3f %10.3f %10.3f\n",
+             classifier->backend->name,
+             (unsigned long long)(r.single_cycles / count),
+             (unsigned long long)(r.batch_cycles / count), r.precision,
+             r.recall, r.accuracy);
+    }
+
+    fhd_classifier_destroy(classifier);
+  }
+}
+
+// HOG, features and classification without and with a cascade, and how many
+// candidates scoring 0.95 or more the cascade rejects
+static void fhd_bench_cascade(const fhd_bench_options* opts,
+                              const fhd_bench_frames* frames) {
+  if (!opts->classifier_file || !opts->cascade_file) {
+    printf("cascade needs -classifier and -cascade\n");
+    return;
+  }
+
+  fhd_cascade* cascade = fhd_cascade_create(opts->cascade_file);
+  if (!cascade) {
+    printf("can't load %s\n", opts->cascade_file);
+    return;
+  }
+
+  fhd_classifier* classifier = fhd_classifier_create(opts->classifier_file);
+  fhd_context plain;
+  fhd_context cascaded;
+  fhd_context_init(&plain, 512, 424, 8, 8);
+  fhd_context_init(&cascaded, 512, 424, 8, 8);
+  cascaded.cascade = cascade;
+  fhd_context* contexts[] = {&plain, &cascaded};
+
+  int candidates = 0;
+  int rejected = 0;
+  int detections = 0;
+  int lost = 0;
+  double max_score_error = 0.0;
+  for (int f = 0; f < frames->len; f++) {
+    const uint16_t* source = frames->frames[f];
+    for (int c = 0; c < 2; c++) {
+      fhd_context* fhd = contexts[c];
+      fhd_run_region_stages(fhd, source);
+      const uint16_t* depth =
+          fhd->fuse_depth_normalization ? source : fhd->normalized_source.data;
+      fhd_run_candidate_stages(fhd, depth, fhd->filtered_regions,
+                               fhd->filtered_regions_len);
+      fhd_run_classifier(fhd, classifier);
+    }
+
+    for (int i = 0; i < plain.candidates_len; i++) {
+      const fhd_candidate* expected = &plain.candidates[i];
+      const fhd_candidate* candidate = &cascaded.candidates[i];
+      const bool detection = expected->weight >= 0.95f;
+      candidates++;
+      rejected += candidate->rejected;
+      detections += detection;
+      lost += detection && candidate->rejected;
+      if (!candidate->rejected) {
+        const double error = fabs(double(candidate->weight - expected->weight));
+        max_score_error = std::max(max_score_error, error);
+      }
+    }
+  }
+
+  printf("%d candidates, avg cycles per candidate\n", candidates);
+  printf("%-16s %10s %10s\n", "", "full", "cascade");
+  const int stages[] = {pr_calc_hog, pr_create_features, pr_classify};
+  uint64_t totals[2] = {0, 0};
+  for (int stage : stages) {
+    uint64_t cycles[2];
+    for (int c = 0; c < 2; c++) {
+      cycles[c] = contexts[c]->perf_records[stage].cycles;
+      totals[c] += cycles[c];
+    }
+    printf("%-16s %10llu %10llu\n", fhd_perf_record_names[stage],
+           (unsigned long long)(cycles[0] / std::max(candidates, 1)),
+           (unsigned long long)(cycles[1] / std::max(candidates, 1)));
+  }
+  printf("%-16s %10llu %10llu (%.2fx)\n", "total",
+         (unsigned long long)(totals[0] / std::max(candidates, 1)),
+         (unsigned long long)(totals[1] / std::max(candidates, 1)),
+         double(totals[0]) / double(std::max(totals[1], uint64_t(1))));
+  printf("rejected %d, %d of %d detections lost, max difference of the rest "
+         "%.2e\n",
+         rejected, lost, detections, max_score_error);
+
+  fhd_context_destroy(&plain);
+  fhd_context_destroy(&cascaded);
+  fhd_classifier_destroy(classifier);
+  fhd_cascade_destroy(cascade);
+}
+
+typedef void (*fhd_bench_fn)(const fhd_bench_options*,
+                             const fhd_bench_frames*);
+
+struct fhd_bench_entry {
+  const char* name;
+  fhd_bench_fn fn;
+};
+
+static const fhd_bench_entry fhd_benchmarks[] = {
+    {"stages", fhd_bench_stages},
+    {"streams", fhd_bench_streams},
+    {"pipeline", fhd_bench_pipeline},
+    {"median", fhd_bench_median},
+    {"merge", fhd_bench_merge},
+    {"normals", fhd_bench_normals},
+    {"edges", fhd_bench_edges},
+    {"segmentation", fhd_bench_segmentation},
+    {"planar", fhd_bench_planar},
+    {"hog", fhd_bench_hog},
+    {"fused", fhd_bench_fused},
+    {"batch", fhd_bench_batch},
+    {"int8", fhd_bench_int8},
+    {"classifiers", fhd_bench_classifiers},
+    {"cascade", fhd_bench_cascade},
+};
+
+static void fhd_bench_usage() {
+  printf(
+      "usage: fhd_bench benchmark [-db depth.db] [-classifier file.nn] "
+      "[-svm file.svm] [-test candidates.db] [-cascade file.cascade] "
+      "[-frames n] [-threads n] [-streams n] [-isa level]\n");
+  printf("benchmarks:");
+  for (const fhd_bench_entry& entry : fhd_benchmarks) {
+    printf(" %s", entry.name);
+  }
+  printf("\nisa levels:");
+  for (int i = fhd_isa_scalar; i <= fhd_isa_avx512; i++) {
+    printf(" %s", fhd_isa_name(fhd_isa(i)));
+  }
+  printf("\n");
+}
+
+static bool fhd_parse_isa(const char* name, fhd_isa* isa) {
+  for (int i = fhd_isa_scalar; i <= fhd_isa_avx512; i++) {
+    if (strcmp(fhd_isa_name(fhd_isa(i)), name) == 0) {
+      *isa = fhd_isa(i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fhd_bench_usage();
+    return 1;
+  }
+
+  fhd_bench_options opts;
+  for (int i = 2; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!value) {
+      fhd_bench_usage();
+      return 1;
+    }
+
+    if (strcmp(arg, "-db") == 0) {
+      opts.db_file = value;
+    } else if (strcmp(arg, "-classifier") == 0) {
+      opts.classifier_file = value;
+    } else if (strcmp(arg, "-svm") == 0) {
+      opts.svm_file = value;
+    } else if (strcmp(arg, "-test") == 0) {
+      opts.test_file = value;
+    } else if (strcmp(arg, "-cascade") == 0) {
+      opts.cascade_file = value;
+    } else if (strcmp(arg, "-frames") == 0) {
+      opts.num_frames = atoi(value);
+    } else if (strcmp(arg, "-threads") == 0) {
+      opts.num_threads = atoi(value);
+    } else if (strcmp(arg, "-streams") == 0) {
+      opts.max_streams = atoi(value);
+    } else if (strcmp(arg, "-isa") == 0) {
+      if (!fhd_parse_isa(value, &opts.isa)) {
+        fhd_bench_usage();
+        return 1;
+      }
+    } else {
+      fhd_bench_usage();
+      return 1;
+    }
+    i++;
+  }
+
+  const fhd_bench_entry* bench = NULL;
+  for (const fhd_bench_entry& entry : fhd_benchmarks) {
+    if (strcmp(entry.name, argv[1]) == 0) bench = &entry;
+  }
+
+  if (!bench) {
+    fhd_bench_usage();
+    return 1;
+  }
+
+  fhd_set_max_isa(opts.isa);
+  const fhd_kernels* kernels = fhd_default_kernels();
+  printf("isa: %s (cpu supports %s)\n", fhd_isa_name(kernels->isa),
+         fhd_isa_name(fhd_cpu_isa()));
+
+  fhd_bench_frames frames;
+  fhd_load_frames(&opts, &frames);
+  if (frames.len == 0) {
+    printf("no frames to run\n");
+    return 1;
+  }
+
+  bench->fn(&opts, &frames);
+
+  return 0;
+}
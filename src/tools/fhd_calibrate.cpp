@@ -0,0 +1,56 @@
+#include "../fhd_candidate_db.h"
+#include "../fhd_candidate.h"
+#include "../fhd_classifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+
+  if (argc < 4) {
+    printf("usage: fhd_calibrate calibration.db classifier.nn result.cal\n");
+    return 1;
+  }
+
+  const char* db_file = argv[1];
+  const char* nn_file = argv[2];
+  const char* calibration_file = argv[3];
+
+  fhd_candidate_db db;
+  fhd_candidate_db_init(&db, db_file, true);
+
+  const int features_length = 3780;
+  int count = fhd_candidate_db_get_count(&db);
+
+  float* features = (float*)calloc(count * features_length, sizeof(float));
+  fhd_result* calibration_data = (fhd_result*)calloc(count, sizeof(fhd_result));
+  const float** feature_ptrs = (const float**)calloc(count, sizeof(float*));
+
+  for (int i = 0; i < count; i++) {
+    calibration_data[i].num_features = features_length;
+    calibration_data[i].features = &features[features_length * i];
+    feature_ptrs[i] = calibration_data[i].features;
+  }
+
+  count = fhd_candidate_db_get_features(&db, calibration_data, count);
+  fhd_candidate_db_close(&db);
+
+  fhd_classifier* classifier = fhd_classifier_create(nn_file);
+  int result = 1;
+  if (!classifier) {
+    printf("can't load %s\n", nn_file);
+  } else if (!fhd_classifier_calibrate(classifier, feature_ptrs, count)) {
+    printf("int8 mode needs a network without hidden layers and one output\n");
+  } else if (!fhd_classifier_save_calibration(classifier, calibration_file)) {
+    printf("can't write %s\n", calibration_file);
+  } else {
+    printf("calibrated on %d candidates\n", count);
+    result = 0;
+  }
+
+  fhd_classifier_destroy(classifier);
+  free(feature_ptrs);
+  free(calibration_data);
+  free(features);
+
+  return result;
+}
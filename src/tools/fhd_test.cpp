@@ -2,18 +2,64 @@
 #include <parallel_fann.h>
 #include "../fhd_candidate_db.h"
 #include "../fhd_candidate.h"
+#include "../fhd_classifier.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+struct fhd_test_result {
+  float precision;
+  float recall;
+};
+
+static fhd_test_result fhd_test_scores(const float* output, const float* scores,
+                                       int count) {
+  int true_positives = 0;
+  int true_negatives = 0;
+  int false_positives = 0;
+  int false_negatives = 0;
+  const float weight_threshold = 0.95f;
+
+  for (int i = 0; i < count; i++) {
+    bool expected = output[i] >= weight_threshold;
+    bool real = scores[i] >= weight_threshold;
+
+    if (expected && real) {
+      true_positives++;
+    }
+
+    if (!expected && !real) {
+      true_negatives++;
+    }
+
+    if (!expected && real) {
+      false_positives++;
+    }
+
+    if (expected && !real) {
+      false_negatives++;
+    }
+  }
+
+  float tp = float(true_positives);
+  float fp = float(false_positives);
+  float fn = float(false_negatives);
+
+  fhd_test_result result;
+  result.precision = tp / (tp + fp);
+  result.recall = tp / (tp + fn);
+  return result;
+}
+
 int main(int argc, char** argv) {
 
   if (argc < 3) {
-    printf("usage: test_classifier testdata.db classifier.nn\n");
+    printf("usage: test_classifier testdata.db classifier.nn [int8.cal]\n");
     return 1;
   }
 
   const char* db_file = argv[1];
   const char* nn_file = argv[2];
+  const char* calibration_file = argc > 3 ? argv[3] : NULL;
 
   fhd_candidate_db db;
   fhd_candidate_db_init(&db, db_file);
@@ -48,40 +94,41 @@ int main(int argc, char** argv) {
 
   nn = fann_create_from_file(nn_file);
 
-  int true_positives = 0;
-  int true_negatives = 0;
-  int false_positives = 0;
-  int false_negatives = 0;
-  const float weight_threshold = 0.95f;
-
+  float* scores = (float*)calloc(count, sizeof(float));
   for (int i = 0; i < count; i++) {
-    bool expected = output[i] >= weight_threshold;
-    bool real = fann_run(nn, training_data[i].features)[0] >= weight_threshold;
-
-    if (expected && real) {
-      true_positives++;
-    }
-
-    if (!expected && !real) {
-      true_negatives++;
-    }
+    scores[i] = fann_run(nn, training_data[i].features)[0];
+  }
 
-    if (!expected && real) {
-      false_positives++;
+  const fhd_test_result result = fhd_test_scores(output, scores, count);
+  printf("Precision %.3f\n", result.precision);
+  printf("Recall: %.3f\n", result.recall);
+
+  if (calibration_file) {
+    fhd_classifier* classifier = fhd_classifier_create(nn_file);
+    if (!classifier ||
+        !fhd_classifier_load_calibration(classifier, calibration_file) ||
+        !fhd_classifier_use_int8(classifier, true)) {
+      printf("can't use %s with %s\n", calibration_file, nn_file);
+    } else {
+      const float** feature_ptrs =
+          (const float**)calloc(count, sizeof(float*));
+      for (int i = 0; i < count; i++) {
+        feature_ptrs[i] = training_data[i].features;
+      }
+
+      fhd_classify_batch(classifier, feature_ptrs, count, scores);
+      const fhd_test_result int8 = fhd_test_scores(output, scores, count);
+      printf("int8 Precision %.3f (%+.3f)\n", int8.precision,
+             int8.precision - result.precision);
+      printf("int8 Recall: %.3f (%+.3f)\n", int8.recall,
+             int8.recall - result.recall);
+      free(feature_ptrs);
     }
 
-    if (expected && !real) {
-      false_negatives++;
-    }
+    fhd_classifier_destroy(classifier);
   }
 
-  float tp = float(true_positives);
-  float fp = float(false_positives);
-  float fn = float(false_negatives);
-
-  printf("Precision %.3f\n", (tp / (tp + fp)));
-  printf("Recall: %.3f\n", (tp / (tp + fn)));
-
+  free(scores);
   free(training_data);
   fann_destroy(nn);
 
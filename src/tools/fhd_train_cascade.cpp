@@ -0,0 +1,152 @@
+#include "../fhd_candidate_db.h"
+#include "../fhd_candidate.h"
+#include "../fhd_cascade.h"
+#include "../fhd_classifier.h"
+#include "../fhd_config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+// Picks the blocks with the largest weights of a linear SVM over all features,
+// trains another one over those blocks only and sets its threshold so that
+// recall of the humans in the training data stays at or above the target.
+// The last fifth of the database is held out and only used to report recall
+// and rejection on candidates the cascade was not fitted to.
+int main(int argc, char** argv) {
+
+  const float target_recall = argc > 4 ? float(atof(argv[4])) : 0.99f;
+  const float c = argc > 5 ? float(atof(argv[5])) : 0.1f;
+  if (argc < 3 || !(target_recall > 0.f && target_recall <= 1.f) ||
+      !(c > 0.f)) {
+    printf("usage: fhd_train_cascade train_data.db result.cascade [blocks] "
+           "[recall] [C]\n");
+    printf("recall is in (0, 1], C is positive\n");
+    return 1;
+  }
+
+  const char* db_file = argv[1];
+  const char* cascade_file = argv[2];
+  const int blocks_len = FHD_HOG_BLOCKS_X * FHD_HOG_BLOCKS_Y;
+  const int num_blocks =
+      std::min(std::max(argc > 3 ? atoi(argv[3]) : 12, 1), blocks_len);
+
+  fhd_candidate_db db;
+  fhd_candidate_db_init(&db, db_file, true);
+
+  const int features_length = blocks_len * FHD_HOG_BLOCK_LEN;
+  int count = fhd_candidate_db_get_count(&db);
+
+  std::vector<float> features(size_t(count) * features_length);
+  std::vector<fhd_result> training_data(count);
+  for (int i = 0; i < count; i++) {
+    training_data[i].num_features = features_length;
+    training_data[i].features = &features[size_t(i) * features_length];
+  }
+
+  count = fhd_candidate_db_get_features(&db, training_data.data(), count);
+  fhd_candidate_db_close(&db);
+
+  std::vector<const float*> feature_ptrs(count);
+  std::vector<int> labels(count);
+  for (int i = 0; i < count; i++) {
+    feature_ptrs[i] = training_data[i].features;
+    labels[i] = training_data[i].human;
+  }
+
+  // Candidates are stored in frame order, so the held out ones come from
+  // later frames than the training ones
+  const int train_count = count - count / 5;
+  int positives = 0;
+  for (int i = 0; i < train_count; i++) {
+    positives += labels[i];
+  }
+
+  if (positives == 0 || positives == train_count) {
+    printf("needs both humans and non-humans\n");
+    return 1;
+  }
+
+  std::vector<float> weights(features_length);
+  float bias = 0.f;
+  fhd_linear_svm_train(feature_ptrs.data(), labels.data(), train_count,
+                       features_length, c, weights.data(), &bias);
+
+  std::vector<float> block_norms(blocks_len);
+  std::vector<int> blocks(blocks_len);
+  for (int b = 0; b < blocks_len; b++) {
+    for (int i = 0; i < FHD_HOG_BLOCK_LEN; i++) {
+      const float w = weights[b * FHD_HOG_BLOCK_LEN + i];
+      block_norms[b] += w * w;
+    }
+    blocks[b] = b;
+  }
+
+  std::sort(blocks.begin(), blocks.end(), [&](int a, int b) {
+    return block_norms[a] > block_norms[b];
+  });
+  blocks.resize(num_blocks);
+  std::sort(blocks.begin(), blocks.end());
+
+  const int stage_length = num_blocks * FHD_HOG_BLOCK_LEN;
+  std::vector<float> stage_features(size_t(count) * stage_length);
+  std::vector<const float*> stage_ptrs(count);
+  for (int i = 0; i < count; i++) {
+    float* out = &stage_features[size_t(i) * stage_length];
+    for (int b = 0; b < num_blocks; b++) {
+      const float* in = &feature_ptrs[i][blocks[b] * FHD_HOG_BLOCK_LEN];
+      std::copy(in, in + FHD_HOG_BLOCK_LEN, &out[b * FHD_HOG_BLOCK_LEN]);
+    }
+    stage_ptrs[i] = out;
+  }
+
+  std::vector<float> stage_weights(stage_length);
+  float stage_bias = 0.f;
+  fhd_linear_svm_train(stage_ptrs.data(), labels.data(), train_count,
+                       stage_length, c, stage_weights.data(), &stage_bias);
+
+  std::vector<float> margins(count);
+  std::vector<float> positive_margins;
+  for (int i = 0; i < count; i++) {
+    margins[i] = stage_bias;
+    for (int j = 0; j < stage_length; j++) {
+      margins[i] += stage_weights[j] * stage_ptrs[i][j];
+    }
+    if (i < train_count && labels[i]) positive_margins.push_back(margins[i]);
+  }
+
+  // Rejecting below the k-th smallest positive margin loses k humans
+  std::sort(positive_margins.begin(), positive_margins.end());
+  const int lost = std::min(
+      std::max(int(float(positives) * (1.f - target_recall)), 0),
+      positives - 1);
+  const float threshold = positive_margins[lost];
+
+  // Rejected non-humans and humans, training and held out
+  int rejected[2][2] = {};
+  int totals[2][2] = {};
+  for (int i = 0; i < count; i++) {
+    const int held_out = i >= train_count;
+    totals[held_out][labels[i]]++;
+    if (margins[i] < threshold) rejected[held_out][labels[i]]++;
+  }
+
+  printf("%d blocks, threshold %f\n", num_blocks, threshold);
+  const char* sets[] = {"training", "held out"};
+  for (int set = 0; set < 2; set++) {
+    const int humans = totals[set][1];
+    printf("%-8s: rejects %d of %d non-humans and %d of %d humans, recall "
+           "%.3f\n",
+           sets[set], rejected[set][0], totals[set][0], rejected[set][1],
+           humans,
+           humans ? 1.0 - double(rejected[set][1]) / humans : 0.0);
+  }
+
+  if (!fhd_cascade_save(cascade_file, blocks.data(), num_blocks,
+                        stage_weights.data(), stage_bias, threshold)) {
+    printf("can't write %s\n", cascade_file);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include "../fhd_candidate_db.h"
+#include "../fhd_candidate.h"
+#include "../fhd_classifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Platt scaling: fits P(human) = 1 / (1 + exp(-(a * margin + b))) with
+// Newton's method and a backtracking line search
+static void fit_sigmoid(const float* margins, const int* labels, int count,
+                        double* a, double* b) {
+  int positives = 0;
+  for (int i = 0; i < count; i++) {
+    positives += labels[i];
+  }
+
+  // Smoothed targets so separable data doesn't push a to infinity
+  const double high = (positives + 1.0) / (positives + 2.0);
+  const double low = 1.0 / (count - positives + 2.0);
+  auto loss = [&](double sa, double sb) {
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+      const double t = labels[i] ? high : low;
+      const double z = sa * margins[i] + sb;
+      // log(1 + exp(z)) - t z without overflow
+      sum += (z > 0.0 ? z + log1p(exp(-z)) : log1p(exp(z))) - t * z;
+    }
+    return sum;
+  };
+
+  *a = 1.0;
+  *b = 0.0;
+  double current = loss(*a, *b);
+  for (int iteration = 0; iteration < 100; iteration++) {
+    double ga = 0.0, gb = 0.0, haa = 1e-12, hab = 0.0, hbb = 1e-12;
+    for (int i = 0; i < count; i++) {
+      const double t = labels[i] ? high : low;
+      const double p = 1.0 / (1.0 + exp(-(*a * margins[i] + *b)));
+      const double d = p * (1.0 - p);
+      ga += margins[i] * (p - t);
+      gb += p - t;
+      haa += margins[i] * margins[i] * d;
+      hab += margins[i] * d;
+      hbb += d;
+    }
+
+    if (fabs(ga) < 1e-5 && fabs(gb) < 1e-5) break;
+
+    const double det = haa * hbb - hab * hab;
+    const double da = -(hbb * ga - hab * gb) / det;
+    const double db = -(haa * gb - hab * ga) / det;
+    double step = 1.0;
+    for (; step > 1e-10; step *= 0.5) {
+      const double next = loss(*a + step * da, *b + step * db);
+      if (next < current + 1e-4 * step * (ga * da + gb * db)) {
+        *a += step * da;
+        *b += step * db;
+        current = next;
+        break;
+      }
+    }
+
+    if (step <= 1e-10) break;
+  }
+}
+
+int main(int argc, char** argv) {
+
+  if (argc < 3) {
+    printf("usage: fhd_train_svm train_data.db result.svm [C]\n");
+    return 1;
+  }
+
+  const char* db_file = argv[1];
+  const char* svm_file = argv[2];
+  const float c = argc > 3 ? float(atof(argv[3])) : 1.f;
+
+  fhd_candidate_db db;
+  fhd_candidate_db_init(&db, db_file, true);
+
+  const int features_length = 3780;
+  int count = fhd_candidate_db_get_count(&db);
+
+  float* features = (float*)calloc(count * features_length, sizeof(float));
+  fhd_result* training_data = (fhd_result*)calloc(count, sizeof(fhd_result));
+
+  for (int i = 0; i < count; i++) {
+    training_data[i].num_features = features_length;
+    training_data[i].features = &features[features_length * i];
+  }
+
+  count = fhd_candidate_db_get_features(&db, training_data, count);
+  fhd_candidate_db_close(&db);
+
+  const float** feature_ptrs = (const float**)calloc(count, sizeof(float*));
+  int* labels = (int*)calloc(count, sizeof(int));
+  for (int i = 0; i < count; i++) {
+    feature_ptrs[i] = training_data[i].features;
+    labels[i] = training_data[i].human;
+  }
+
+  float* weights = (float*)calloc(features_length, sizeof(float));
+  float bias = 0.f;
+  const int epochs = fhd_linear_svm_train(feature_ptrs, labels, count,
+                                          features_length, c, weights, &bias);
+  printf("trained in %d epochs\n", epochs);
+
+  // Scores are tanh(z) = 2 P(human) - 1 for z = (a margin + b) / 2, which
+  // folds into the weights and keeps the model linear
+  float* margins = (float*)calloc(count, sizeof(float));
+  for (int i = 0; i < count; i++) {
+    margins[i] = bias;
+    for (int j = 0; j < features_length; j++) {
+      margins[i] += weights[j] * feature_ptrs[i][j];
+    }
+  }
+
+  double a, b;
+  fit_sigmoid(margins, labels, count, &a, &b);
+  printf("sigmoid a %f b %f\n", a, b);
+  for (int j = 0; j < features_length; j++) {
+    weights[j] = float(0.5 * a * weights[j]);
+  }
+  bias = float(0.5 * (a * bias + b));
+
+  int result = 0;
+  if (!fhd_linear_svm_save(svm_file, weights, features_length, bias)) {
+    printf("can't write %s\n", svm_file);
+    result = 1;
+  }
+
+  free(margins);
+  free(labels);
+  free(feature_ptrs);
+  free(weights);
+  free(training_data);
+  free(features);
+
+  return result;
+}
@@ -196,7 +196,7 @@ void fhd_ui_update(fhd_ui* ui, const uint16_t* depth) {
   }
 
   for (int i = 0; i < fhd->cells_len; i++) {
-    int component = fhd_segmentation_find(fhd->normals_segmentation, i);
+    int component = fhd->normals_components[i];
 
     fhd_color color = ui->colors[component];
 
@@ -207,7 +207,7 @@ void fhd_ui_update(fhd_ui* ui, const uint16_t* depth) {
   }
 
   for (int i = 0; i < fhd->cells_len; i++) {
-    int component = fhd_segmentation_find(fhd->depth_segmentation, i);
+    int component = fhd->depth_components[i];
     fhd_color color = ui->colors[component];
 
     ui->depth_segmentation.data[4 * i] = color.r;
@@ -220,16 +220,18 @@ void fhd_ui_update(fhd_ui* ui, const uint16_t* depth) {
   for (int i = 0; i < fhd->filtered_regions_len; i++) {
     fhd_region* r = &fhd->filtered_regions[i];
     fhd_color c = ui->colors[i];
-    for (int j = 0; j < r->points_len; j++) {
-      fhd_vec3 p = r->points[j].p_r;
-      const fhd_vec2 sc = fhd_kinect_coord_to_depth(p);
-      const int sx = int(std::round(sc.x / fhd->cell_wf));
-      const int sy = int(std::round(sc.y / fhd->cell_hf));
-      int idx = sy * fhd->cells_x + sx;
-      ui->filtered_regions.data[4 * idx] = c.r;
-      ui->filtered_regions.data[4 * idx + 1] = c.g;
-      ui->filtered_regions.data[4 * idx + 2] = c.b;
-      ui->filtered_regions.data[4 * idx + 3] = 255;
+    for (fhd_point_chunk* chunk = r->points; chunk; chunk = chunk->next) {
+      for (int j = 0; j < chunk->len; j++) {
+        fhd_vec3 p = chunk->points[j].p_r;
+        const fhd_vec2 sc = fhd_camera_project(&fhd->camera, p);
+        const int sx = int(std::round(sc.x / fhd->cell_wf));
+        const int sy = int(std::round(sc.y / fhd->cell_hf));
+        int idx = sy * fhd->cells_x + sx;
+        ui->filtered_regions.data[4 * idx] = c.r;
+        ui->filtered_regions.data[4 * idx + 1] = c.g;
+        ui->filtered_regions.data[4 * idx + 2] = c.b;
+        ui->filtered_regions.data[4 * idx + 3] = 255;
+      }
     }
   }
 